@@ -0,0 +1,200 @@
+#include <config.h>
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "device.h"
+
+/* Writers sleep on queued, and are woken up when a slot is queued on
+   any device; freed is signalled back when a slot has been saved. The
+   mutex only orders the wakeups, the slots themselves are
+   lock-free. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+
+int buffer_init(int count, int size, int sweep_len, int sample_size) {
+    buffer_ring_t *r = &dev->ring;
+    buffer_t *buffer;
+    int i, sweeps = (size + sweep_len - 1) / sweep_len;
+
+    buffer = (buffer_t*)calloc(count, sizeof(buffer_t));
+    if (!buffer)
+	return 0;
+    for (i = 0; i < count; i++) {
+	buffer[i].data = (uint8_t*)malloc((size_t)size * sample_size);
+	buffer[i].sweep_times = (usec_t*)malloc(sizeof(usec_t) * sweeps);
+	if (!buffer[i].data || !buffer[i].sweep_times)
+	    return 0;
+	atomic_init(&buffer[i].size, 0);
+	atomic_init(&buffer[i].state, SLOT_FREE);
+	atomic_init(&buffer[i].seq, 0);
+	buffer[i].sample_size = sample_size;
+	buffer[i].device = dev;
+    }
+    r->slot = buffer;
+    r->count = count;
+    r->size = size;
+    r->sample_size = sample_size;
+    r->next_seq = 0;
+    atomic_init(&r->overflows, 0);
+    atomic_init(&r->samples_dropped, 0);
+
+    atomic_init(&r->current, 0);
+    atomic_store(&buffer[0].state, SLOT_FILLING);
+    return 1;
+}
+
+
+buffer_t *buffer_current() {
+    return &dev->ring.slot[dev->ring.current];
+}
+
+/* Try to move a slot from one state to another, returns nonzero if
+   successful: */
+static int slot_move(buffer_t *b, int from, int to) {
+    return atomic_compare_exchange_strong(&b->state, &from, to);
+}
+
+static void dropped(buffer_ring_t *r, buffer_t *b) {
+    atomic_fetch_add(&r->overflows, 1);
+    atomic_fetch_add(&r->samples_dropped, atomic_load(&b->size));
+}
+
+int buffer_queue() {
+    buffer_ring_t *r = &dev->ring;
+    buffer_t *buffer = r->slot;
+    int current = r->current, buffer_count = r->count;
+    buffer_t *cur = &buffer[current];
+    int i, j, next = -1, ok = 1;
+
+    /* a free slot, in ring order: */
+    for (i = 1; i < buffer_count && next < 0; i++) {
+	j = (current + i) % buffer_count;
+	if (slot_move(&buffer[j], SLOT_FREE, SLOT_FILLING))
+	    next = j;
+    }
+
+    if (next < 0) {
+	/* all in flight, take over the oldest queued slot: */
+	int oldest = -1;
+	for (i = 1; i < buffer_count; i++) {
+	    j = (current + i) % buffer_count;
+	    if (atomic_load(&buffer[j].state) == SLOT_QUEUED
+		&& (oldest < 0
+		    || (int)(atomic_load(&buffer[j].seq)
+			     - atomic_load(&buffer[oldest].seq)) < 0))
+		oldest = j;
+	}
+	if (oldest >= 0 && slot_move(&buffer[oldest], SLOT_QUEUED,
+				     SLOT_FILLING)) {
+	    dropped(r, &buffer[oldest]);
+	    next = oldest;
+	    ok = 0;
+	}
+    }
+
+    if (next < 0) {
+	/* every other slot is being saved, keep filling this one: */
+	dropped(r, cur);
+	atomic_store(&cur->size, 0);
+	r->next_seq++;
+	return 0;
+    }
+
+    atomic_store(&cur->seq, r->next_seq++);
+    atomic_store(&cur->state, SLOT_QUEUED);
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+
+    atomic_store(&buffer[next].size, 0);
+    atomic_store(&r->current, next);
+
+    return ok;
+}
+
+void buffer_discard() {
+    atomic_store(&buffer_current()->size, 0);
+}
+
+
+/* The oldest queued slot of a ring: */
+static buffer_t *ring_oldest(buffer_ring_t *r) {
+    buffer_t *buffer = r->slot;
+    int i, oldest = -1;
+
+    for (i = 0; i < r->count; i++)
+	if (atomic_load(&buffer[i].state) == SLOT_QUEUED
+	    && (oldest < 0
+		|| (int)(atomic_load(&buffer[i].seq)
+			 - atomic_load(&buffer[oldest].seq)) < 0))
+	    oldest = i;
+    return oldest < 0 ? NULL : &buffer[oldest];
+}
+
+buffer_t *buffer_claim() {
+    buffer_t *b, *oldest;
+    int d;
+
+    do {
+	/* the oldest of each device, the earliest of those first: */
+	oldest = NULL;
+	for (d = 0; d < ndevices; d++)
+	    if ((b = ring_oldest(&devices[d].ring))
+		&& (!oldest || b->timestamp < oldest->timestamp))
+		oldest = b;
+	if (!oldest)
+	    return NULL;
+	/* retry if the producer or another writer got there first: */
+    } while (!slot_move(oldest, SLOT_QUEUED, SLOT_SAVING));
+
+    return oldest;
+}
+
+buffer_t *buffer_wait() {
+    buffer_t *b;
+
+    pthread_mutex_lock(&lock);
+    while (!(b = buffer_claim()))
+	pthread_cond_wait(&queued, &lock);
+    pthread_mutex_unlock(&lock);
+
+    return b;
+}
+
+void buffer_release(buffer_t *b) {
+    atomic_store(&b->state, SLOT_FREE);
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
+
+int buffer_idle() {
+    buffer_ring_t *r = &dev->ring;
+    int i;
+
+    for (i = 0; i < r->count; i++)
+	if (i != r->current && atomic_load(&r->slot[i].state) != SLOT_FREE)
+	    return 0;
+    return 1;
+}
+
+void buffer_wait_idle() {
+    pthread_mutex_lock(&lock);
+    while (!buffer_idle())
+	pthread_cond_wait(&freed, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+int buffer_in_flight(buffer_ring_t *r) {
+    int i, n = 0;
+
+    for (i = 0; i < r->count; i++)
+	if (atomic_load(&r->slot[i].state) >= SLOT_QUEUED)
+	    n++;
+    return n;
+}
@@ -0,0 +1,96 @@
+#ifndef CALLISTO_BUFFER_H
+#define CALLISTO_BUFFER_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+/* Sample buffers form a ring of slots. The acquisition thread fills
+   one slot at a time and queues it when it is full (or a new FITS file
+   is wanted), the FITS writer claims queued slots oldest first, saves
+   them and returns them to the free pool. Neither side ever waits for
+   the other. Each device has its own ring, of the current device
+   (dev) for the producer side, and the writers take from all of
+   them. */
+
+/* A slot holds a whole FITS file, or in streaming mode a part of
+   one. The flags mark the first and last part of a file: */
+#define BUFFER_FILE_START 0x01
+#define BUFFER_FILE_END 0x02
+
+/* slot states: */
+#define SLOT_FREE 0
+#define SLOT_FILLING 1
+#define SLOT_QUEUED 2
+#define SLOT_SAVING 3
+
+struct device;
+
+typedef struct {
+    uint8_t *data;     /* uint8_t or uint16_t samples */
+    atomic_int size;
+    usec_t timestamp;  /* timestamp of the first sample */
+    usec_t *sweep_times; /* start time of each sweep */
+    uint64_t first_sample; /* sample count of the device at data[0] */
+    int flags;
+    atomic_int state;
+    atomic_uint seq;   /* queueing order, dropped slots leave a gap */
+    int sample_size;   /* bytes per sample, 1 or 2 */
+    struct device *device; /* whose samples */
+    usec_t trace_origin, trace_queued; /* for trace.h */
+} buffer_t;
+
+#define MIN_BUFFERS 2
+#define MAX_BUFFERS 64
+
+typedef struct {
+    int size;          /* samples per slot */
+    int sample_size;   /* bytes per sample, 1 or 2 */
+    int count;
+    buffer_t *slot;
+    atomic_int current; /* slot being filled */
+    unsigned next_seq;
+    /* Overflow accounting: slots whose samples were dropped because
+       all slots were in flight, and the number of samples lost. */
+    atomic_ulong overflows;
+    atomic_ullong samples_dropped;
+} buffer_ring_t;
+
+/* Sample i of b, of either size: */
+static inline unsigned buffer_sample(const buffer_t *b, int i) {
+    return b->sample_size == 2 ? ((const uint16_t*)b->data)[i]
+	: b->data[i];
+}
+
+/* Set up the ring of the current device, slots of size samples of
+   sweeps of sweep_len samples: */
+int buffer_init(int count, int size, int sweep_len, int sample_size);
+
+/* Producer side, for the acquisition thread only. */
+/* The slot being filled: */
+buffer_t *buffer_current();
+/* Queue the current slot for saving and start filling the next
+   one. If all other slots are in flight, the oldest slot not yet
+   claimed by a writer is taken over, or failing that the current
+   samples are discarded. Returns 0 if samples were dropped. */
+int buffer_queue();
+/* Discard the samples in the current slot: */
+void buffer_discard();
+
+/* Consumer side, for any device. Claim the oldest queued slot, or
+   return NULL if there is none: */
+buffer_t *buffer_claim();
+/* Claim the oldest queued slot, sleeping until there is one: */
+buffer_t *buffer_wait();
+/* Return a saved slot to the free pool: */
+void buffer_release(buffer_t *b);
+/* Nonzero if all slots of the current device other than the one
+   being filled are free: */
+int buffer_idle();
+/* Sleep until all slots other than the current one are free: */
+void buffer_wait_idle();
+/* The number of slots of ring r queued or being saved: */
+int buffer_in_flight(buffer_ring_t *r);
+
+#endif
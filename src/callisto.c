@@ -15,6 +15,10 @@
 #include <fcntl.h>
 #include <time.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "callisto.h"
 #include "conf.h"
@@ -24,6 +28,12 @@
 #include "fits.h"
 #include "server.h"
 #include "eeprom.h"
+#include "hexdecode.h"
+#include "buffer.h"
+#include "output.h"
+#include "device.h"
+#include "metrics.h"
+#include "trace.h"
 
 int debug = 0;
 
@@ -33,12 +43,19 @@ int debug = 0;
 #define ID_QUERY "S0\r"
 #define ID_RESPONSE "$CRX:Stopped\r"
 
-#define HEXDATA_RESET ((char)-1)
-
-static void hexdata(char c);
-static void run_schedule();
+static int handle_input(const char *s, int n);
+static int hexdata(const char *s, int n);
+static void hexdata_reset();
+static void resync(const char *error);
+static void queue_buffer(int end);
+static void data_interrupted(int cause);
+static void end_file();
+static time_t run_schedule();
+static int acquisition_init();
+static void acquisition_start();
+static void run_scheduler();
 static int detect_firmware_version();
-static int reset();
+static int reset(int cause);
 static void init();
 static void start();
 static void stop();
@@ -47,25 +64,13 @@ static void finish_overview();
 static void handle_message(const char *msg);
 
 
-int buffer_size = 0;
-buffer_t buffer[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
-static int current_buffer = 0;
-volatile int save_buffer = -1;
-volatile int active_buffer = 0; /* interthread copy of current_buffer */
-
+device_t *devices = NULL;
+int ndevices = 0;
+__thread device_t *dev = NULL;
 
-static char message[MAX_MESSAGE] = "";
-static int message_length = 0, in_message = 0, in_data = 0;
-
-enum {
-    STOPPED,
-    STOPPING,
-    STARTING,
-    RUNNING,
-    OVERVIEW
-};
-static int state = STOPPED;
-volatile int start_command = 0, overview_command = 0, stop_command = 0;
+#define SCHEDULE_CHECK_INTERVAL 60
+static int schedule_fd = -1;
+static int devices_finished = 0;
 
 
 
@@ -73,7 +78,7 @@ volatile int start_command = 0, overview_command = 0, stop_command = 0;
 static void usage(const char *prog) {
     fprintf(stderr, "Usage: %s [options]\nOptions:\n", prog);
     fprintf(stderr,
-            "\t-c,--config <file>   Specify configuration file\n"
+            "\t-c,--config <file>   Specify configuration file (once per device)\n"
 	    "\t-o,--datadir <dir>   Specify data output directory\n"
 	    "\t-O,--ovsdir <dir>    Specify ovewrview output directory\n"
 	    "\t-s,--schedule <file> Specify schedule file\n"
@@ -83,6 +88,9 @@ static void usage(const char *prog) {
 	    "\t-P,--pidfile <file>  Write PID into the sepcified file\n"
             "\t-d,--debug           Debug mode (no fork, messages to STDERR)\n"
             "\t-D,--serial-debug    Debug mode with serial port traffic logging\n"
+            "\t-w,--capture <file>  Record serial port input into a capture file\n"
+            "\t-r,--replay <file>   Read serial input from a capture file\n"
+            "\t-S,--replay-speed N  Replay at N times the captured rate (0 = max)\n"
             "\t-4,--ipv4            Bind to IPv4 address (default is IPv6 with IPv4 mapping)\n"
             "\t-6,--ipv6            Bind only to IPv6 address (no IPv4 mapping)\n"
 	    "\t-V,--version         Show program version\n"
@@ -96,6 +104,8 @@ static volatile int killed = 0;
 static int pidfd = -1;
 static const char *pidfile = NULL;
 void terminate(int signum) {
+    int i;
+
     if (signum < 0) /* negative signal means immediate termination */
 	killed = 2;
 
@@ -103,7 +113,11 @@ void terminate(int signum) {
     if (killed) {
 	if (killed < 2) {
 	    /* stop callisto hw: */
-	    write_serial("GD\rS0\r");
+	    for (i = 0; i < ndevices; i++) {
+		dev = &devices[i];
+		if (dev->serial)
+		    write_serial("GD\rS0\r");
+	    }
 	    logprintf(LOG_NOTICE, "Failed to die cleanly, data loss possible");
 	}
 	if (pidfd >= 0) {
@@ -119,28 +133,51 @@ void terminate(int signum) {
         logprintf(LOG_NOTICE, "Caught signal %i, terminating", signum);
 
     killed = 1;
+    post_command(NULL, 0); /* wake up acquisition */
+}
+
+/* Post a command to device d, or to all devices if d is NULL. This is
+   async-signal-safe: */
+void post_command(device_t *d, int cmd) {
+    uint64_t one = 1;
+    int i;
+
+    if (!d) {
+	for (i = 0; i < ndevices; i++)
+	    post_command(&devices[i], cmd);
+	return;
+    }
+    __sync_fetch_and_or(&d->posted_commands, cmd);
+    /* only fails if the counter is full, nothing sensible to do: */
+    (void)!write(d->command_fd, &one, sizeof(one));
 }
 
-static volatile int switch_buffers = 0;
 static void hup_handler(int signum) {
-    start_command = 1;
+    (void)signum;
+    post_command(NULL, COMMAND_START);
 }
 
 
 
 
 int main(int argc, char **argv) {
-    char *config_dir = NULL,
+    char *config_paths[MAX_DEVICES],
+	*first_config_dir = NULL,
+	*config_dir = NULL,
 	*config_file = NULL,
 	*datadir = NULL,
 	*ovsdir = NULL,
 	*schedulefile = NULL;
     char c;
-    int i, l;
+    const char *decoder;
+    int i, j, l, nconfigs = 0, cwd;
+    sigset_t sigs, oldsigs;
     int do_upload = 0, check_only = 0;
     uid_t server_uid = 0;
     gid_t server_gid = 0;
     int use_ipv4 = 0, ipv6only = 0;
+    const char *capturefile = NULL, *replayfile = NULL;
+    double replay_speed = 1;
 
 
     /* parse options */
@@ -157,6 +194,9 @@ int main(int argc, char **argv) {
             {"pidfile", 1, NULL, 'P'},
             {"debug", 0, NULL, 'd'},
             {"serial-debug", 0, NULL, 'D'},
+            {"capture", 1, NULL, 'w'},
+            {"replay", 1, NULL, 'r'},
+            {"replay-speed", 1, NULL, 'S'},
             {"version", 0, NULL, 'V'},
             {"help", 0, NULL, 'h'},
             {"ipv4", 0, NULL, '4'},
@@ -164,13 +204,18 @@ int main(int argc, char **argv) {
             {0, 0, 0, 0}
         };
         
-        opt = getopt_long(argc, argv, "c:o:O:s:u:LCdDVh46", long_options, NULL);
+        opt = getopt_long(argc, argv, "c:o:O:s:u:LCdDw:r:S:Vh46", long_options, NULL);
         if (opt == -1)
             break;
         
         switch (opt) {
 	case 'c':
-	    config_dir = optarg;
+	    if (nconfigs == MAX_DEVICES) {
+		fprintf(stderr, "ERROR: At most %d configuration files\n",
+			MAX_DEVICES);
+		return EXIT_FAILURE;
+	    }
+	    config_paths[nconfigs++] = optarg;
 	    break;
 	case 'o':
 	    datadir = optarg;
@@ -218,6 +263,26 @@ int main(int argc, char **argv) {
 	    debug = 1;
 	    serial_debug++;
 	    break;
+	case 'w':
+	    capturefile = optarg;
+	    break;
+	case 'r':
+	    replayfile = optarg;
+	    break;
+	case 'S':
+	    {
+		char *end;
+
+		if (!strcmp(optarg, "max"))
+		    replay_speed = 0;
+		else if ((replay_speed = strtod(optarg, &end)) < 0
+			 || end == optarg || *end) {
+		    fprintf(stderr, "ERROR: Invalid replay speed: %s\n",
+			    optarg);
+		    return EXIT_FAILURE;
+		}
+	    }
+	    break;
 	case 'V':
 	    printf("e-Callisto for Unix " PACKAGE_VERSION "\n");
 	    return 0;
@@ -239,37 +304,114 @@ int main(int argc, char **argv) {
         usage(argv[0]);
     }
 
-    if (config_dir) {
-	char *d = strrchr(config_dir, '/');
-	if (d) {
-	    config_file = d+1;
-	    *d = 0;
+    if (replayfile && capturefile) {
+	fprintf(stderr, "ERROR: Cannot capture a replay\n");
+	return EXIT_FAILURE;
+    }
+    if ((replayfile || capturefile) && nconfigs > 1) {
+	fprintf(stderr, "ERROR: Capture and replay need a single device\n");
+	return EXIT_FAILURE;
+    }
+
+    /* One device per configuration file: */
+    ndevices = nconfigs ? nconfigs : 1;
+    if ((devices = calloc(ndevices, sizeof(device_t))) == NULL
+	|| (cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+	fprintf(stderr, "ERROR: Cannot allocate devices: %s\n",
+		strerror(errno));
+	return EXIT_FAILURE;
+    }
+    for (i = 0; i < ndevices; i++) {
+	dev = &devices[i];
+	dev->index = i;
+	dev->command_fd = dev->epoll_fd = -1;
+	dev->firmware = default_firmware;
+	if ((dev->ovs = malloc(MAX_OVS * sizeof(ovs_t))) == NULL) {
+	    fprintf(stderr, "ERROR: Cannot allocate overview buffer\n");
+	    return EXIT_FAILURE;
+	}
+
+	if (nconfigs) {
+	    char *d;
+
+	    config_dir = config_paths[i];
+	    if ((d = strrchr(config_dir, '/'))) {
+		config_file = d+1;
+		*d = 0;
+		if (d == config_dir)
+		    config_dir = "/";
+	    } else {
+		config_file = config_dir;
+		config_dir = ".";
+	    }
 	} else {
-	    config_file = config_dir;
-	    config_dir = ".";
+	    config_dir = ETCDIR;
+	    config_file = "callisto.cfg";
+	}
+
+	/* Each configuration is read in its own directory, so that the
+	   channel file can be given relative to it: */
+	if (fchdir(cwd) || chdir(config_dir)) {
+	    fprintf(stderr,
+		    "ERROR: Cannot access configuration directory %s: %s\n",
+		    config_dir, strerror(errno));
+	    return EXIT_FAILURE;
+	}
+	if (!read_config(config_file))
+	    return EXIT_FAILURE;
+
+	if (!read_channels(dev->config.channelfile))
+	    return EXIT_FAILURE;
+
+	if (i == 0) {
+	    first_config_dir = config_dir;
+	    continue;
+	}
+	/* the daemon-wide settings are those of the first device: */
+	dev->config.net_port = devices[0].config.net_port;
+	dev->config.metrics_port = devices[0].config.metrics_port;
+	dev->config.native_fits = devices[0].config.native_fits;
+	dev->config.stream_fits = devices[0].config.stream_fits;
+	dev->config.fits_compress = devices[0].config.fits_compress;
+	dev->config.fits_threads = devices[0].config.fits_threads;
+	dev->config.fits_fsync = devices[0].config.fits_fsync;
+	for (j = 0; j < i; j++) {
+	    if (!strcmp(devices[j].config.serialport,
+			dev->config.serialport)) {
+		fprintf(stderr, "ERROR: Serial port %s is used twice\n",
+			dev->config.serialport);
+		return EXIT_FAILURE;
+	    }
+	    if (!strcmp(devices[j].config.instrument,
+			dev->config.instrument)
+		&& devices[j].config.focuscode == dev->config.focuscode) {
+		fprintf(stderr, "ERROR: Instrument %s with focus code %d "
+			"is configured twice\n",
+			dev->config.instrument, dev->config.focuscode);
+		return EXIT_FAILURE;
+	    }
 	}
-    } else {
-	config_dir = ETCDIR;
-	config_file = "callisto.cfg";
     }
 
-    /* Note: the CWD of the program will be config_dir from this point
-       onwards to allow further config files (frq, schedule) to be
-       given without full path i.e. relative to the config
-       directory. */
-    if (chdir(config_dir)) {
+    /* Note: the CWD of the program will be the directory of the first
+       configuration file from this point onwards to allow further
+       config files (frq, schedule) to be given without full path
+       i.e. relative to the config directory. */
+    if (fchdir(cwd) || chdir(first_config_dir)) {
 	fprintf(stderr,
 		"ERROR: Cannot access configuration directory %s: %s\n",
-		config_dir, strerror(errno));
+		first_config_dir, strerror(errno));
 	return EXIT_FAILURE;
     }
-    if (!read_config(config_file))
-	return EXIT_FAILURE;
+    close(cwd);
 
-    if (!read_channels(config.channelfile))
-	return EXIT_FAILURE;
-
-    if (!init_serial(config.serialport))
+    for (i = 0; i < ndevices; i++) {
+	dev = &devices[i];
+	if (replayfile ? !init_replay(replayfile, replay_speed)
+	    : !init_serial(dev->config.serialport))
+	    return EXIT_FAILURE;
+    }
+    if (capturefile && !capture_serial(capturefile))
 	return EXIT_FAILURE;
 
     if (pidfile != NULL) {
@@ -286,60 +428,99 @@ int main(int argc, char **argv) {
         }
     }
 
-    buffer_size = config.filetime * config.samplerate;
-    buffer[0].data = (uint8_t*)malloc(buffer_size);
-    buffer[1].data = (uint8_t*)malloc(buffer_size);
-
-    if (!buffer[0].data || !buffer[1].data) {
-	fprintf(stderr, "ERROR: Cannot allocate data buffers\n");
-	return EXIT_FAILURE;
-    }
+    for (i = 0; i < ndevices; i++) {
+	dev = &devices[i];
+
+	/* In streaming mode a buffer holds stream_fits seconds of whole
+	   sweeps, otherwise a whole file: */
+	dev->file_size = dev->config.filetime * dev->config.samplerate;
+	j = dev->file_size;
+	if (dev->config.stream_fits > 0
+	    && dev->config.stream_fits < dev->config.filetime)
+	    j = dev->config.stream_fits * dev->config.samplerate;
+	if (!buffer_init(dev->config.buffers, j, dev->config.nchannels,
+			 dev->config.sample_bits / 8)) {
+	    fprintf(stderr, "ERROR: Cannot allocate data buffers\n");
+	    return EXIT_FAILURE;
+	}
+	timing_init(&dev->timing, dev->config.samplerate);
+	timing_publish(&dev->timing_shared, &dev->timing);
+	gaps_init(&dev->gaps, dev->config.samplerate, dev->config.nchannels);
+	/* the sweeps of the last history seconds: */
+	if (!sweeps_init(&dev->sweeps, dev->config.nchannels,
+			 dev->config.sample_bits / 8,
+			 dev->config.history * dev->config.samplerate
+			 / dev->config.nchannels, 1)
+	    || !pyramid_init(&dev->pyramid, dev->config.nchannels,
+			     dev->config.sample_bits / 8)) {
+	    fprintf(stderr, "ERROR: Cannot allocate the sweep ring\n");
+	    return EXIT_FAILURE;
+	}
 
-    /* in unknown state => "reset" callisto */
-    if (!reset()) {
-	fprintf(stderr,
-		"ERROR: The device at %s does not seem to be Callisto "
-		"(reset failed)\n",
-		config.serialport);
-	return EXIT_FAILURE;
-    }
+	/* in unknown state => "reset" callisto */
+	if (!reset(METRIC_RESET_STARTUP)) {
+	    fprintf(stderr,
+		    "ERROR: The device at %s does not seem to be Callisto "
+		    "(reset failed)\n",
+		    dev->config.serialport);
+	    return EXIT_FAILURE;
+	}
 
-    /* identify: */
-    write_serial(ID_QUERY);
-    i = 0;
-    while (read_serial(&c)) {
-	message[i] = c;
-	if (i < MAX_MESSAGE-1) i++;
-    }
-    message[i] = 0;
-    l = strlen(ID_RESPONSE);
-    if (i < l || strncmp(message, ID_RESPONSE, l)) {
-	fprintf(stderr,
-		"ERROR: The device at %s does not seem to be Callisto "
-		"(ID failed)\n",
-		config.serialport);
-	return EXIT_FAILURE;
-    }
-    message[0] = 0;
+	/* identify: */
+	write_serial(ID_QUERY);
+	j = 0;
+	while (read_serial(&c)) {
+	    dev->message[j] = c;
+	    if (j < MAX_MESSAGE-1) j++;
+	}
+	dev->message[j] = 0;
+	l = strlen(ID_RESPONSE);
+	if (j < l || strncmp(dev->message, ID_RESPONSE, l)) {
+	    fprintf(stderr,
+		    "ERROR: The device at %s does not seem to be Callisto "
+		    "(ID failed)\n",
+		    dev->config.serialport);
+	    return EXIT_FAILURE;
+	}
+	dev->message[0] = 0;
+
+	/* firmware version */
+	if (!detect_firmware_version()) {
+	    fprintf(stderr,
+		    "ERROR: The device at %s does not seem to have a supported Callisto firmware version (1.5, 1.7, 1.8)\n",
+		    dev->config.serialport);
+	    return EXIT_FAILURE;
+	}
+	if (debug)
+	    logprintf(LOG_DEBUG, "Detected firmware version %s\n",
+		      dev->firmware.versionstr);
 
-    /* firmware version */
-    if (!detect_firmware_version()) {
-	fprintf(stderr,
-		"ERROR: The device at %s does not seem to have a supported Callisto firmware version (1.5, 1.7, 1.8)\n",
-		config.serialport);
-	return EXIT_FAILURE;
+	/* the sample format is known now => pick the decoder: */
+	decoder = hexdecode_init(dev->firmware.data10bit,
+				 &dev->hexdecode, &dev->hexdecode_wide);
+	if (debug)
+	    logprintf(LOG_DEBUG, "Using %s hex data decoder", decoder);
+	if (debug && dev->firmware.data10bit && dev->ring.sample_size == 1)
+	    logprintf(LOG_DEBUG, "Firmware sends 10-bit data, storing the "
+		      "top 8 bits (set sample_bits=16 to keep all)");
+	if (debug)
+	    logprintf(LOG_DEBUG,
+		      "Sample buffers: %d x %d %d-bit samples, %lu kB",
+		      dev->ring.count, dev->ring.size, 8*dev->ring.sample_size,
+		      (unsigned long)((size_t)dev->ring.count * dev->ring.size
+				      * dev->ring.sample_size / 1024));
+
+	if (do_upload && !upload_channels())
+	    return EXIT_FAILURE;
     }
-    if (debug)
-	logprintf(LOG_DEBUG, "Detected firmware version %s\n",
-		  firmware.versionstr);
-
-    if (do_upload && !upload_channels())
-	return EXIT_FAILURE;
 
     if (check_only)
 	return EXIT_SUCCESS;
 
-    if (config.net_port > 0 && !server_init(config.net_port, !ipv6only, !use_ipv4))
+    dev = &devices[0];
+    if ((dev->config.net_port > 0 || dev->config.metrics_port > 0)
+	&& !server_init(dev->config.net_port, dev->config.metrics_port,
+			!ipv6only, !use_ipv4))
 	return EXIT_FAILURE;
 
     /* drop privileges */
@@ -354,33 +535,50 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (datadir)
-	config.datadir = datadir;
-    if (access(config.datadir, W_OK)) {
-	fprintf(stderr,
-		"ERROR: Cannot access data directory %s: %s\n",
-		config.datadir, strerror(errno));
-	return EXIT_FAILURE;
-    }
-    if (ovsdir)
-	config.ovsdir = ovsdir;
-    if (access(config.ovsdir, W_OK)) {
-	fprintf(stderr,
-		"ERROR: Cannot access overview directory %s: %s\n",
-		config.ovsdir, strerror(errno));
-	return EXIT_FAILURE;
+    for (i = 0; i < ndevices; i++) {
+	dev = &devices[i];
+	if (datadir)
+	    dev->config.datadir = datadir;
+	if (access(dev->config.datadir, W_OK)) {
+	    fprintf(stderr,
+		    "ERROR: Cannot access data directory %s: %s\n",
+		    dev->config.datadir, strerror(errno));
+	    return EXIT_FAILURE;
+	}
+	if (ovsdir)
+	    dev->config.ovsdir = ovsdir;
+	if (access(dev->config.ovsdir, W_OK)) {
+	    fprintf(stderr,
+		    "ERROR: Cannot access overview directory %s: %s\n",
+		    dev->config.ovsdir, strerror(errno));
+	    return EXIT_FAILURE;
+	}
     }
 
+    /* one schedule for all devices, that of the first: */
+    dev = &devices[0];
     if (schedulefile)
-	config.schedulefile = schedulefile;
-    if (!read_schedule(config.schedulefile))
+	dev->config.schedulefile = schedulefile;
+    if (!read_schedule(dev->config.schedulefile))
 	return EXIT_FAILURE;
 
     if (!fits_init())
 	return EXIT_FAILURE;
 
-    if (!download_channels())
+    for (i = 0; i < ndevices; i++) {
+	dev = &devices[i];
+	if (!download_channels())
+	    return EXIT_FAILURE;
+
+	if (!acquisition_init())
+	    return EXIT_FAILURE;
+    }
+
+    if ((schedule_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC)) < 0) {
+	fprintf(stderr, "ERROR: Cannot create schedule timer: %s\n",
+		strerror(errno));
 	return EXIT_FAILURE;
+    }
 
     /* daemonize */
     if (!debug && daemonize()) {
@@ -409,151 +607,336 @@ int main(int argc, char **argv) {
 
     log_init(!debug);
 
-    if (config.net_port > 0)
+    /* The worker threads inherit a signal mask blocking the handled
+       signals, so that the handlers always run in the main thread,
+       which only runs the schedule. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    if (devices[0].config.net_port > 0 || devices[0].config.metrics_port > 0)
 	server_start();
     fits_start();
+    acquisition_start();
+
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    dev = NULL; /* the main thread is not working on any device */
 
     logprintf(LOG_NOTICE, "e-Callisto for Unix " PACKAGE_VERSION " started");
 
-    /* main loop */
+    run_scheduler();
+
+    return EXIT_FAILURE;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+static int acquisition_init() {
+    struct epoll_event ev;
+
+    if ((dev->command_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+	|| (dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	fprintf(stderr, "ERROR: Cannot create event descriptors: %s\n",
+		strerror(errno));
+	return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = dev->command_fd;
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->command_fd, &ev) == 0) {
+	/* serial is enabled when not stopped: */
+	ev.events = 0;
+	ev.data.fd = get_serial_fd();
+	if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0)
+	    return 1;
+    }
+    fprintf(stderr, "ERROR: Cannot set up event loop: %s\n",
+	    strerror(errno));
+    return 0;
+}
+
+static void watch_serial(int on) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.fd = get_serial_fd();
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev)) {
+	logprintf(LOG_CRIT, "epoll_ctl() failed, terminating: %s",
+		  strerror(errno));
+	terminate(-1);
+    }
+}
+
+static void read_commands() {
+    uint64_t n;
+    int cmd;
+
+    if (read(dev->command_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+	logprintf(LOG_ERR, "Reading command event failed: %s",
+		  strerror(errno));
+
+    cmd = __sync_fetch_and_and(&dev->posted_commands, 0);
+    if (cmd & COMMAND_START)
+	dev->start_command = 1;
+    if (cmd & COMMAND_STOP)
+	dev->stop_command = 1;
+    if (cmd & COMMAND_OVERVIEW)
+	dev->overview_command = 1;
+    if ((cmd & COMMAND_RESUME)
+	&& dev->state != STARTING && dev->state != RUNNING)
+	dev->start_command = 1;
+}
+
+/* Process all buffered serial input, reading the device once. Returns
+   0 if there was nothing to read. */
+static int process_serial() {
+    const char *span;
+    usec_t now, offset;
+    double r;
+    int i, n, lost;
+
+    if (!(n = read_serial_span(&span)))
+	return 0;
+
+    do {
+	/* Process the span until it is exhausted, the input is flushed
+	   by a reset or we have stopped (leave the rest of the input
+	   unread, as the stopped state does not read serial): */
+	dev->input_flushed = 0;
+	i = 0;
+	while (i < n) {
+	    i += handle_input(span + i, n - i);
+	    if (dev->input_flushed || dev->state == STOPPED)
+		break;
+	}
+	if (dev->input_flushed)
+	    break;
+	consume_serial(i);
+    } while (dev->state != STOPPED && pending_serial()
+	     && (n = read_serial_span(&span)));
+
+    /* all samples so far had arrived by the latest read: */
+    now = serial_read_time();
+    offset = serial_clock_offset();
+    /* samples missing from the sample clock: */
+    if ((r = timing_observe(&dev->timing, now, offset)) > 0)
+	gap_add(&dev->gaps, GAP_RATE, now + offset - r, now + offset);
+
+    /* input lost by the serial port, four bytes per sample at most: */
+    if (now - dev->lost_checked >= 1000000) {
+	dev->lost_checked = now;
+	if ((lost = serial_lost()) > 0)
+	    gap_add(&dev->gaps, GAP_OVERRUN, now + offset, now + offset
+		    + (usec_t)(lost / 4 * dev->timing.period));
+    }
+
+    return 1;
+}
+
+/* Errors in the hex data without a whole sweep in between, and stray
+   bytes in a row outside the data, before the device is reset: */
+#define MAX_RESYNC_ERRORS 3
+#define MAX_STRAY 16
+
+/* The serial port timeout, same as VTIME: */
+#define SERIAL_TIMEOUT 1000000
+#define MAX_EVENTS 4
+
+static void *acquisition(void *arg) {
+    struct epoll_event events[MAX_EVENTS];
+    int watching = 0;
+    usec_t last_input = 0;
+    char name[32];
+
+    dev = arg;
+    snprintf(name, sizeof(name), "acquisition %d", dev->index);
+    trace_thread(name);
+
     init();
-    if (config.autostart)
+    if (dev->config.autostart)
 	start();
+
     while (1) {
+	int i, nev, timeout, readable;
+	usec_t now;
+
 	if (killed) {
 	    /* stop hw: */
 	    write_serial("GD\rS0\r");
-	    /* wait for FITS write to finish: */
-	    while (save_buffer != -1)
-		msleep(1);
-	    /* If there is data in the current buffer, save
-	       it. Otherwise the other buffer has already been
-	       saved above. */
-	    if (buffer[current_buffer].size > 0) {
-		save_buffer = current_buffer;
-		/* wait for FITS write to finish: */
-		while (save_buffer != -1)
-		    msleep(1);
+	    gap_close(&dev->gaps, serial_time());
+	    /* save the current file, and wait for all FITS writes to
+	       finish: */
+	    end_file();
+	    buffer_wait_idle();
+	    if (dev->ring.overflows)
+		logprintf(LOG_NOTICE, "Sample buffer overflows: %lu "
+			  "buffer(s), %llu samples dropped",
+			  (unsigned long)dev->ring.overflows,
+			  (unsigned long long)dev->ring.samples_dropped);
+	    if (dev->timing.observations)
+		logprintf(LOG_NOTICE, "Sample clock: %.4f samples/s (%+.2f "
+			  "ppm), jitter %.0f us rms",
+			  timing_rate(&dev->timing),
+			  timing_drift(&dev->timing),
+			  timing_jitter(&dev->timing));
+	    if (dev->gaps.count) {
+		unsigned long lost = 0;
+		for (i = 0; i < GAP_CAUSES; i++)
+		    lost += dev->gaps.lost[i];
+		logprintf(LOG_NOTICE, "Data gaps: %lu, %lu sweep(s) lost",
+			  dev->gaps.count, lost);
 	    }
+	    /* the last device to finish exits: */
+	    if (__sync_add_and_fetch(&devices_finished, 1) < ndevices)
+		return NULL;
+	    output_wait_idle();
 	    killed = 2;
 	    terminate(0);
 	}
 
-	/* check schedule (if it exists) for start/stop/overview commands */
-	run_schedule();
-
 	/* state switching: */
-	if (overview_command) {
-	    if (state == OVERVIEW) { /* already in progress */
-		overview_command = 0;
-	    } else if (state == STARTING || state == RUNNING) {
+	if (dev->overview_command) {
+	    if (dev->state == OVERVIEW) { /* already in progress */
+		dev->overview_command = 0;
+	    } else if (dev->state == STARTING || dev->state == RUNNING) {
 		stop();
-		start_command = 1; /* start again after finished */
-	    } else if (state == STOPPED) {
+		dev->start_command = 1; /* start again after finished */
+	    } else if (dev->state == STOPPED) {
 		start_overview();
 	    }
-	} else if (stop_command) {
-	    if (state == STARTING || state == RUNNING)
+	} else if (dev->stop_command) {
+	    if (dev->state == STARTING || dev->state == RUNNING)
 		stop();
-	    stop_command = 0;
-	    start_command = 0;
-	} else if (state == STOPPED && start_command) {
+	    dev->stop_command = 0;
+	    dev->start_command = 0;
+	} else if (dev->state == STOPPED && dev->start_command) {
 	    init();
 	    start();
-	    start_command = 0;
-	} else if (state == RUNNING && start_command) {
-	    switch_buffers = 1; /* start a new FITS file */
-	    start_command = 0;
+	    dev->start_command = 0;
+	} else if (dev->state == RUNNING && dev->start_command) {
+	    dev->switch_buffers = 1; /* start a new FITS file */
+	    dev->start_command = 0;
 	}
 
-
-	if (state == STOPPED) {
-	    /* we are stopped => wait for commands */
-	    msleep(1);
-	    continue;
+	/* When stopped, serial is not read and we only wait for
+	   commands, with no timeout. Otherwise the
+	   serial port must produce data within the timeout. */
+	now = get_monotonic_usecs();
+	if (watching != (dev->state != STOPPED)) {
+	    watching = (dev->state != STOPPED);
+	    watch_serial(watching);
+	    last_input = now;
 	}
-
-
-	if (!read_serial(&c)) {
-	    if (state == OVERVIEW) {
-		finish_overview();
+	if (!watching)
+	    timeout = -1;
+	else if (pending_serial())
+	    timeout = 0;
+	else if (now - last_input >= SERIAL_TIMEOUT)
+	    timeout = 0;
+	else
+	    timeout = (int)((last_input + SERIAL_TIMEOUT - now + 999) / 1000);
+
+	nev = epoll_wait(dev->epoll_fd, events, MAX_EVENTS, timeout);
+	if (nev < 0) {
+	    if (errno == EINTR)
 		continue;
-	    }
-	    logprintf(LOG_ERR, "Timeout reading from serial port, resetting");
-	    reset();
-	    init();
-	    start();
-	    continue;
+	    logprintf(LOG_CRIT, "epoll_wait() failed, terminating: %s",
+		      strerror(errno));
+	    terminate(-1);
 	}
 
-	if (in_message && c == MESSAGE_END) {
-	    message[message_length] = 0;
-	    handle_message(message);
-	    message_length = 0;
-	    in_message = 0;
-	    continue;
-	}
-
-	if (!in_message && c == MESSAGE_START) {
-	    message_length = 0;
-	    in_message = 1;
-	    continue;
-	}
+	for (i = 0; i < nev; i++)
+	    if (events[i].data.fd == dev->command_fd)
+		read_commands();
 
-	if (in_message) {
-	    message[message_length] = c;
-	    if (message_length < MAX_MESSAGE-1)
-		message_length++;
+	if (!watching || dev->state == STOPPED)
 	    continue;
-	}
 
-	if (c == EEPROM_READY)
+	/* serial input, also input left over from before stopping: */
+	readable = pending_serial();
+	for (i = 0; i < nev; i++)
+	    if (events[i].data.fd == get_serial_fd())
+		readable = 1;
+	if (readable) {
+	    if (process_serial()) {
+		last_input = get_monotonic_usecs();
+		continue;
+	    }
+	    /* readable but nothing to read is as good as a timeout,
+	       unless the end of a replay was reached: */
+	    if (killed)
+		continue;
+	} else if (get_monotonic_usecs() - last_input < SERIAL_TIMEOUT)
 	    continue;
 
-	if (!in_data && c == DATA_START) {
-	    in_data = 1;
-	    continue;
-	}
-	
-	if (in_data && c == DATA_END) {
-	    /* data stream ends => stop state machine, write partial
-	       FITS and reset data buffers: */
-	    in_data = 0;
-	    write_serial("S0\r");
-	    hexdata(HEXDATA_RESET);
-	    /* wait for previous buffer save to finish: */
-	    while (save_buffer != -1)
-		msleep(1);
-	    /* save the current buffer and wait for it to finish: */
-	    save_buffer = current_buffer;
-	    while (save_buffer != -1)
-		msleep(1);
-	    buffer[0].size = buffer[1].size = 0;
+	if (dev->state == OVERVIEW) {
+	    finish_overview();
 	    continue;
 	}
-
-	if (in_data)
-	    hexdata(c);
-	else {
-	    logprintf(LOG_ERR, "Unexpected character '%c', resetting", c);
-	    reset();
-	}
-
-
+	logprintf(LOG_ERR, "Timeout reading from serial port, resetting");
+	data_interrupted(GAP_TIMEOUT);
+	reset(METRIC_RESET_TIMEOUT);
+	init();
+	start();
+	last_input = get_monotonic_usecs();
     }
 
-    return EXIT_FAILURE;
+    return NULL;
 }
 
+/* One acquisition thread per device: */
+static void acquisition_start() {
+    pthread_attr_t attr;
+    int i;
 
+    if (pthread_attr_init(&attr) != 0
+        || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0)
+	i = -1;
+    else
+	for (i = 0; i < ndevices; i++)
+	    if (pthread_create(&devices[i].thread, &attr, acquisition,
+			       &devices[i]) != 0)
+		break;
+    if (i < ndevices || pthread_attr_destroy(&attr) != 0) {
+	logprintf(LOG_CRIT,
+		  "Cannot create acquisition thread, terminating: %s",
+		  strerror(errno));
+        terminate(-1);
+    }
+}
 
+/* The main thread runs the schedule for all devices: */
+static void run_scheduler() {
+    struct itimerspec its;
+    uint64_t n;
 
-
-
-
-
-
-
+    while (1) {
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = run_schedule();
+	if (timerfd_settime(schedule_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+	    logprintf(LOG_ERR, "Cannot set schedule timer: %s",
+		      strerror(errno));
+	    sleep(SCHEDULE_CHECK_INTERVAL);
+	    continue;
+	}
+	while (read(schedule_fd, &n, sizeof(n)) < 0 && errno == EINTR)
+	    ;
+    }
+}
 
 
 
@@ -561,14 +944,23 @@ int main(int argc, char **argv) {
 static void disable_schedule() {
     logprintf(LOG_WARNING, "Disabling scheduling and starting recording");
     numschedule = 0;
-    if (state != STARTING && state != RUNNING)
-	start_command = 1;
+    post_command(NULL, COMMAND_RESUME);
 }
 
-#define SCHEDULE_CHECK_INTERVAL 60
-static void run_schedule() {
+/* Post a command to the devices with the focus code of a schedule
+   entry: */
+static void post_scheduled(const schedule_t *s, int cmd) {
+    int i;
+
+    for (i = 0; i < ndevices; i++)
+	if (devices[i].config.focuscode == s->focuscode)
+	    post_command(&devices[i], cmd);
+}
+
+/* Returns the time when the schedule needs to be run next. */
+static time_t run_schedule() {
     int i, hadsched;
-    time_t now = time(NULL);
+    time_t now = time(NULL), next;
     static time_t last_check = 0;
     static struct stat old_st;
     struct stat st;
@@ -580,19 +972,19 @@ static void run_schedule() {
 	    logprintf(LOG_DEBUG, "Checking for new schedule file");
 
 	last_check = now;
-	if (stat(config.schedulefile, &st)) {
+	if (stat(devices[0].config.schedulefile, &st)) {
 	    if (errno == ENOENT && hadsched)
 		logprintf(LOG_WARNING, "Schedule file has vanished");
 	    else if (errno != ENOENT)
 		logprintf(LOG_ERR, "Cannot stat schedule file %s: %s",
-			  config.schedulefile, strerror(errno));
+			  devices[0].config.schedulefile, strerror(errno));
 	    if (hadsched)
 		disable_schedule();
 	    if (debug)
 		logprintf(LOG_DEBUG, "(Schedule file stat failed)");
 
 	} else if (memcmp(&old_st, &st, sizeof(st))) {
-	    int e = read_schedule(config.schedulefile);
+	    int e = read_schedule(devices[0].config.schedulefile);
 	    memcpy(&old_st, &st, sizeof(st));
 	    switch(e) {
 	    case 0: /* fail */
@@ -618,24 +1010,33 @@ static void run_schedule() {
     }
     
 
-    for (i = 0; i < numschedule; i++)
+    next = last_check + SCHEDULE_CHECK_INTERVAL;
+    for (i = 0; i < numschedule; i++) {
 	if (now >= schedule[i].t) {
 	    switch (schedule[i].action) {
 	    case SCHEDULE_START:
-		start_command = 1;
+		post_scheduled(&schedule[i], COMMAND_START);
+		metric_add(METRIC_SCHEDULE_START, 1);
 		logprintf(LOG_NOTICE, "Recording (re)started by schedule");
 		break;
 	    case SCHEDULE_STOP:
-		stop_command = 1;
+		post_scheduled(&schedule[i], COMMAND_STOP);
+		metric_add(METRIC_SCHEDULE_STOP, 1);
 		logprintf(LOG_NOTICE, "Recording stopped by schedule");
 		break;
 	    case SCHEDULE_OVERVIEW:
-		overview_command = 1;
+		post_scheduled(&schedule[i], COMMAND_OVERVIEW);
+		metric_add(METRIC_SCHEDULE_OVERVIEW, 1);
 		logprintf(LOG_NOTICE, "Overview started by schedule");
 		break;
 	    }
 	    schedule[i].t += 86400;
 	}
+	if (schedule[i].t < next)
+	    next = schedule[i].t;
+    }
+
+    return next;
 }
 
 
@@ -701,22 +1102,22 @@ static int detect_firmware_version() {
     /* 1.7 */
     l = strlen(VERSION_STR_17);
     if (i >= l && !strncmp(buf, VERSION_STR_17, l)) {
-	firmware.if_init = 37.7; /* 10.70 + 27 */
-	firmware.if_init_correction = 0.0;
-	firmware.data10bit = 1;
-	firmware.eeprom_info = 0;
-	firmware.versionstr = "1.7";
+	dev->firmware.if_init = 37.7; /* 10.70 + 27 */
+	dev->firmware.if_init_correction = 0.0;
+	dev->firmware.data10bit = 1;
+	dev->firmware.eeprom_info = 0;
+	dev->firmware.versionstr = "1.7";
 	return 1;
     }
 
     /* 1.8 */
     l = strlen(VERSION_STR_18);
     if (i >= l && !strncmp(buf, VERSION_STR_18, l)) {
-	firmware.if_init = 36.13; /* 10.70 + 25.43 */
-	firmware.if_init_correction = 0.0;
-	firmware.data10bit = 1;
-	firmware.eeprom_info = 1;
-	firmware.versionstr = "1.8";
+	dev->firmware.if_init = 36.13; /* 10.70 + 25.43 */
+	dev->firmware.if_init_correction = 0.0;
+	dev->firmware.data10bit = 1;
+	dev->firmware.eeprom_info = 1;
+	dev->firmware.versionstr = "1.8";
 	return 1;
     }
 
@@ -724,22 +1125,25 @@ static int detect_firmware_version() {
 }
 
 
-static int reset() {
-    static int count = 0;
-    static time_t last_reset = 0;
+/* Reset the device, counting it as cause, a METRIC_RESET_*: */
+static int reset(int cause) {
     int i = 10000;
     char c;
     time_t t;
 
-    while (save_buffer != -1) /* wait for FITS write to complete */
-	msleep(1);
-    buffer[0].size = buffer[1].size = 0;
-    current_buffer = active_buffer = 0;
+    metric_add(cause, 1);
+    data_interrupted(GAP_RESET);
+    pyramid_sync(&dev->pyramid);
+    buffer_discard();
+    dev->file_samples = 0;
+    timing_reset(&dev->timing);
 
-    hexdata(HEXDATA_RESET);
-    message_length = in_data = in_message = 0;
-    state = STOPPED;
-    
+    hexdata_reset();
+    dev->message_length = dev->in_data = dev->in_message = 0;
+    dev->state = STOPPED;
+
+    flush_serial();
+    dev->input_flushed = 1;
     write_serial(RESET_STRING);
     /* discard bytes until timeout or 10kB read: */
     while (i && read_serial(&c))
@@ -747,12 +1151,12 @@ static int reset() {
 
     /* detect continuous resetting: */
     t = time(NULL);
-    if (t - last_reset < 5)
-	count++;
+    if (t - dev->last_reset < 5)
+	dev->reset_count++;
     else
-	count = 0;
-    last_reset = t;
-    if (count > 2) {
+	dev->reset_count = 0;
+    dev->last_reset = t;
+    if (dev->reset_count > 2) {
 	logprintf(LOG_ERR, "Reset loop detected, terminating");
 	terminate(0);
     }
@@ -764,24 +1168,25 @@ static void init() {
     char cmd[64];
 
     /* clockrate: */
-    if (config.clocksource == 1) { /* internal */
+    if (dev->config.clocksource == 1) { /* internal */
 	/* Internal clock 11.0592 MHz + prescaler 64x => 172800, 2
 	   clock cycles per sample => 86400. Counter goes from 0 to N-1
 	   (?) */
-        int maxcounter = 86400 / config.samplerate - 1;
+        int maxcounter = 86400 / dev->config.samplerate - 1;
         sprintf(cmd, "GS%u\r", maxcounter);
 	write_serial(cmd);
-    } else if (config.clocksource == 2) { /* external */
+    } else if (dev->config.clocksource == 2) { /* external */
 	/* External clock 1 MHz => 1000000, 2 clock cycles per sample
 	   => 500000. Counter goes from 0 to N-1 (?) */
-	int maxcounter = 500000 / config.samplerate - 1;
+	int maxcounter = 500000 / dev->config.samplerate - 1;
 	sprintf(cmd, "GA%u\r", maxcounter);
 	write_serial(cmd);
     }
 
     /* gain, clocksource, chargepump: */
     sprintf(cmd, "T%u\rO%03u\rC%u\r",
-	    config.clocksource, config.agclevel, config.chargepump);
+	    dev->config.clocksource, dev->config.agclevel,
+	    dev->config.chargepump);
     write_serial(cmd);
 }
 
@@ -790,30 +1195,24 @@ static void start() {
 
     /* FOPA, channels, start, enable: */
     sprintf(cmd, "FS%02u%02u\rL%u\rS1\rGE\r",
-	    config.focuscode, config.focuscode-1, config.nchannels);
+	    dev->config.focuscode, dev->config.focuscode-1,
+	    dev->config.nchannels);
     write_serial(cmd);
-    state = STARTING;
+    dev->state = STARTING;
+    timing_reset(&dev->timing);
 }
 static void stop() {
+    gap_close(&dev->gaps, serial_time());
     write_serial("GD\r");
-    state = STOPPING;
+    dev->state = STOPPING;
 }
 
 
-typedef struct {
-    double freq;
-    int value;
-} ovs_t;
-#define MAX_OVS 13200
-static ovs_t ovs[MAX_OVS];
-static int ovsnum = 0;
-static time_t ovstime = 0; 
-
 static void start_overview() {
     write_serial("T0\rM2\r%5\rF0045.0\rL13200\rP2\r");
-    state = OVERVIEW;
-    ovsnum = 0;
-    ovstime = time(NULL);
+    dev->state = OVERVIEW;
+    dev->ovsnum = 0;
+    dev->ovstime = serial_time() / 1000000;
     if (debug)
 	logprintf(LOG_DEBUG, "Started overview");
 }
@@ -822,9 +1221,9 @@ static void finish_overview() {
     struct tm tm;
     FILE *f;
 
-    gmtime_r(&ovstime, &tm);
+    gmtime_r(&dev->ovstime, &tm);
     snprintf(fname, PATH_MAX, "%s/OVS_%s_%04u%02u%02u_%02u%02u%02u.prn",
-	     config.ovsdir, config.instrument,
+	     dev->config.ovsdir, dev->config.instrument,
 	     tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
 	     tm.tm_hour, tm.tm_min, tm.tm_sec);
 
@@ -834,14 +1233,14 @@ static void finish_overview() {
     } else {
 	int i;
 	fprintf(f, "Frequency[MHz];Amplitude RX1[mV] at pwm=%u\n",
-		config.agclevel);
-	for (i = 0; i < ovsnum; i++)
-	    fprintf(f, "%7.3f;%u\n", ovs[i].freq, ovs[i].value);
+		dev->config.agclevel);
+	for (i = 0; i < dev->ovsnum; i++)
+	    fprintf(f, "%7.3f;%u\n", dev->ovs[i].freq, dev->ovs[i].value);
 	fflush(f);
 	fclose(f);
     }
 
-    state = STOPPED;
+    dev->state = STOPPED;
     if (debug)
 	logprintf(LOG_DEBUG, "Overview finished");
 }
@@ -851,106 +1250,365 @@ static void handle_message(const char *msg) {
     int ovs_value;
 
     if (!strcmp(msg, "CRX:Started")) {
-	state = RUNNING;
+	dev->state = RUNNING;
 	if (debug)
 	    logprintf(LOG_DEBUG, "Recording loop started");
     } else if (!strcmp(msg, "CRX:Stopped")) {
-	state = STOPPED;
+	dev->state = STOPPED;
+	pyramid_sync(&dev->pyramid);
 	if (debug)
 	    logprintf(LOG_DEBUG, "Recording loop stopped");
     } else if (strstr(msg, "CRX:e-Callisto ETH Zurich")) {
 	/* hardware reset, do reset&init in software: */
-	int do_start = (state == RUNNING);
+	int do_start = (dev->state == RUNNING);
 
 	logprintf(LOG_WARNING, "Hardware reset detected, resetting software");
 
-	reset();
+	reset(METRIC_RESET_HARDWARE);
 	init();
 	if (do_start)
 	    start();
 
 	/* (the channels are in eeprom => preserved across resets) */
-    } else if (state == OVERVIEW
+    } else if (dev->state == OVERVIEW
 	       && sscanf(msg, "CRX:%lf,%d", &ovs_freq, &ovs_value) == 2) {
-	if (ovsnum < MAX_OVS) {
-	    ovs[ovsnum].freq = ovs_freq;
-	    ovs[ovsnum].value = ovs_value;
-	    ovsnum++;
+	if (dev->ovsnum < MAX_OVS) {
+	    dev->ovs[dev->ovsnum].freq = ovs_freq;
+	    dev->ovs[dev->ovsnum].value = ovs_value;
+	    dev->ovsnum++;
 	}
     }
 }
 
 
 
-static void hexdata(char c) {
-    static int value = 0;
-    static int count = 0;
-    static int end_marker = 0;
+static int handle_input(const char *s, int n) {
+    char c = *s;
+
+    /* the bulk of the data goes straight to the hex decoder: */
+    if (dev->in_data && !dev->in_message && c != MESSAGE_START
+	&& c != EEPROM_READY && c != DATA_END)
+	return hexdata(s, n);
+
+    if (dev->in_message && c == MESSAGE_END) {
+	dev->message[dev->message_length] = 0;
+	handle_message(dev->message);
+	dev->message_length = 0;
+	dev->in_message = 0;
+	return 1;
+    }
+
+    if (!dev->in_message && c == MESSAGE_START) {
+	dev->stray = 0;
+	dev->message_length = 0;
+	dev->in_message = 1;
+	return 1;
+    }
+
+    if (dev->in_message) {
+	dev->message[dev->message_length] = c;
+	if (dev->message_length < MAX_MESSAGE-1)
+	    dev->message_length++;
+	return 1;
+    }
+
+    if (c == EEPROM_READY)
+	return 1;
+
+    if (!dev->in_data && c == DATA_START) {
+	dev->stray = 0;
+	dev->in_data = 1;
+	return 1;
+    }
+
+    if (dev->in_data && c == DATA_END) {
+	/* data stream ends => stop state machine, write partial
+	   FITS: */
+	dev->in_data = 0;
+	write_serial("S0\r");
+	hexdata_reset();
+	end_file();
+	return 1;
+    }
+
+    /* noise between the data, unless it goes on: */
+    dev->stray_bytes++;
+    if (++dev->stray > MAX_STRAY) {
+	logprintf(LOG_ERR, "Unexpected character '%c', resetting", c);
+	reset(METRIC_RESET_DATA);
+    } else if (debug)
+	logprintf(LOG_DEBUG, "Unexpected character '%c', ignored", c);
+    return 1;
+}
+
+
+
+static void hexdata_reset() {
+    dev->hex_value = dev->hex_count = dev->hex_end_markers = 0;
+    dev->hex_bad = dev->resync_skip = dev->resync_errors = 0;
+}
 
-    if (c == HEXDATA_RESET) { /* reset */
-	value = count = end_marker = 0;
+/* A corrupt word in the hex data, counted as one sample: instead of a
+   reset, drop the sweep it is in, and skip the rest of the sweep in the
+   input so that recording resumes at the next sweep boundary. Errors
+   that go on without a whole sweep in between mean the framing is lost
+   for good, then the device is reset. */
+static void resync(const char *error) {
+    buffer_t *b = buffer_current();
+    int n = dev->config.nchannels, pos;
+    usec_t t;
+
+    dev->hex_value = dev->hex_count = dev->hex_bad = 0;
+    if (++dev->resync_errors > MAX_RESYNC_ERRORS) {
+	logprintf(LOG_ERR, "%s, framing lost, resetting", error);
+	reset(METRIC_RESET_DATA);
+	return;
+    }
+    if (dev->resync_skip) {
+	/* within the sweep already dropped */
+	dev->timing.samples++;
+	dev->resync_skip--;
 	return;
     }
 
+    /* the sweep must not have begun in a buffer already queued: */
+    pos = (dev->file_samples + b->size) % n;
+    if (pos > b->size) {
+	logprintf(LOG_ERR, "%s, resetting", error);
+	reset(METRIC_RESET_DATA);
+	return;
+    }
+    t = timing_sample_time(&dev->timing, dev->timing.samples - pos,
+			   dev->timing.valid ? 0 : serial_time());
+    b->size -= pos;
+    gaps_received(&dev->gaps, -pos);
+    dev->timing.samples++;
+    dev->resync_skip = n - pos - 1;
+    b->first_sample = dev->timing.samples + dev->resync_skip - b->size;
+    gap_add(&dev->gaps, GAP_RESYNC, t, t + (usec_t)dev->gaps.sweep_len);
+    logprintf(LOG_WARNING, "%s, dropping sweep", error);
+}
+
+/* Hand the current buffer to the FITS writer, as the last part of the
+   file if end is set. Samples lost because the writer has fallen
+   behind are logged when it starts and stops happening. */
+static void queue_buffer(int end) {
+    buffer_t *b = buffer_current();
+    usec_t start = b->timestamp, stop = start;
+    int queued;
+
+    if (b->size > 0)
+	stop = b->sweep_times[(b->size - 1) / dev->config.nchannels]
+	    + (usec_t)dev->gaps.sweep_len;
+    b->flags = (dev->file_samples == 0 ? BUFFER_FILE_START : 0)
+	| (end ? BUFFER_FILE_END : 0);
+    dev->file_samples = end ? 0 : dev->file_samples + b->size;
+    /* traced from the latest read to the writer: */
+    b->trace_origin = trace_origin();
+    b->trace_queued = trace_start();
+
+    queued = buffer_queue();
+    metric_observe(HISTOGRAM_BUFFERS, buffer_in_flight(&dev->ring));
+    if (!queued) {
+	gap_add(&dev->gaps, GAP_OVERFLOW, start, stop);
+	if (!dev->overflowing)
+	    logprintf(LOG_ERR, "All %d sample buffers in use, FITS writer "
+		      "too slow, dropping data", dev->ring.count);
+	dev->overflowing = 1;
+    } else if (dev->overflowing) {
+	logprintf(LOG_ERR, "FITS writer caught up, %lu buffer(s) and %llu "
+		  "samples dropped so far",
+		  (unsigned long)dev->ring.overflows,
+		  (unsigned long long)dev->ring.samples_dropped);
+	dev->overflowing = 0;
+    }
+}
+
+/* The sample stream stops, for cause: the samples in the current
+   buffer are lost along with those until it resumes. */
+static void data_interrupted(int cause) {
+    buffer_t *b = buffer_current();
+
+    if (dev->state != STARTING && dev->state != RUNNING)
+	return;
+    gap_open(&dev->gaps, cause, b->size > 0 ? b->timestamp
+	     : timing_sample_time(&dev->timing, dev->timing.samples,
+				  serial_time()));
+}
+
+/* Finish the current file, if there is one: */
+static void end_file() {
+    if (buffer_current()->size > 0 || dev->file_samples > 0)
+	queue_buffer(1);
+}
+
+/* Room in the current buffer up to the end of the file: */
+static int buffer_room(int bsize) {
+    int room = dev->ring.size - bsize;
+
+    if (room > dev->file_size - dev->file_samples - bsize)
+	room = dev->file_size - dev->file_samples - bsize;
+    return room;
+}
+
+/* Samples have been stored in the current buffer up to bsize: time
+   the sweeps started by the sample clock, and queue the buffer if it
+   is full, or as the end of the file if the file is full or a new file
+   has been requested. */
+static void samples_added(int bsize) {
+    buffer_t *b = buffer_current();
+    int n = dev->config.nchannels, old = b->size, s;
+    usec_t now = dev->timing.valid ? 0 : serial_time();
+
+    if (old == 0)
+	b->first_sample = dev->timing.samples;
+    for (s = (old + n - 1) / n * n; s < bsize; s += n)
+	b->sweep_times[s / n] = timing_sample_time(&dev->timing,
+						   b->first_sample + s, now);
+    if (old == 0) {
+	b->timestamp = b->sweep_times[0];
+	gap_close(&dev->gaps, b->timestamp);
+    }
+    dev->timing.samples += bsize - old;
+    gaps_received(&dev->gaps, bsize - old);
+    /* a whole sweep since the last error: */
+    if (dev->resync_errors && bsize / n > old / n)
+	dev->resync_errors = 0;
+    /* the sweeps completed, for live readers: */
+    if (bsize / n > old / n) {
+	metric_add(METRIC_SWEEPS, bsize / n - old / n);
+	timing_publish(&dev->timing_shared, &dev->timing);
+    }
+    for (s = (old / n + 1) * n; s <= bsize; s += n) {
+	const uint8_t *sweep = b->data + (size_t)(s - n) * b->sample_size;
+	usec_t t0 = trace_start();
+
+	sweep_publish(&dev->sweeps, sweep, b->sweep_times[s / n - 1]);
+	trace_stage(TRACE_PUBLISH, t0);
+	pyramid_add(&dev->pyramid, sweep, b->sweep_times[s / n - 1]);
+    }
+    b->size = bsize;
+    if (dev->file_samples + bsize == dev->file_size
+	|| (bsize > 0
+	    && (bsize % dev->config.nchannels) == 0
+	    && dev->switch_buffers)) {
+	queue_buffer(1);
+	dev->switch_buffers = 0;
+    } else if (bsize == dev->ring.size)
+	queue_buffer(0);
+}
+
+/* Decode one character. This handles partial words, end markers and
+   invalid data, everything else goes through hexdecode(). */
+static void hexchar(char c) {
     if (c >= '0' && c <= '9') {
-	value = (value << 4) | (c - '0');
-	count++;
+	dev->hex_value = (dev->hex_value << 4) | (c - '0');
+	dev->hex_count++;
     } else if (c >= 'A' && c <= 'F') {
-	value = (value << 4) | (0x0a + c - 'A');
-	count++;
+	dev->hex_value = (dev->hex_value << 4) | (0x0a + c - 'A');
+	dev->hex_count++;
     } else {
-	logprintf(LOG_ERR, "Invalid hex character '%c', resetting", c);
-	reset();
-	return;
+	/* counted, so that the words stay aligned if it took the place
+	   of a hex character: */
+	if (!dev->hex_bad)
+	    dev->hex_bad_char = c;
+	dev->hex_bad = 1;
+	dev->hex_value <<= 4;
+	dev->hex_count++;
     }
 
-    if (count == 4) {
-	if (value == 0x2323) {
-	    end_marker++;
-	    if (end_marker == 2 && debug)
+    if (dev->hex_count == 4 && dev->hex_bad) {
+	char error[32];
+	snprintf(error, sizeof(error), "Invalid hex character '%c'",
+		 dev->hex_bad_char);
+	resync(error);
+    } else if (dev->hex_count == 4) {
+	if (dev->hex_value == 0x2323) {
+	    dev->hex_end_markers++;
+	    if (dev->hex_end_markers == 2 && debug)
 		logprintf(LOG_DEBUG, "Hexdata end marker received");
-	    else if (end_marker > 2) {
+	    else if (dev->hex_end_markers > 2) {
 		logprintf(LOG_ERR, "Too many hexdata end markers, resetting");
-		reset();
+		reset(METRIC_RESET_DATA);
 	    }
-	    value = count = 0;
+	    dev->hex_value = dev->hex_count = 0;
 	    return;
 	}
 
-	if ((value & ~0x3ff) || (!firmware.data10bit && (value & ~0xff))) {
-	    logprintf(LOG_ERR, "Invalid hex value 0x%.4X, resetting", value);
-	    reset();
+	if ((dev->hex_value & ~0x3ff)
+	    || (!dev->firmware.data10bit && (dev->hex_value & ~0xff))) {
+	    char error[32];
+	    snprintf(error, sizeof(error), "Invalid hex value 0x%.4X",
+		     dev->hex_value);
+	    resync(error);
 	    return;
+	} else if (dev->resync_skip) {
+	    /* the rest of a dropped sweep: */
+	    dev->timing.samples++;
+	    if (!--dev->resync_skip && debug)
+		logprintf(LOG_DEBUG, "Resynchronized at the next sweep");
 	} else {
-	    int bsize = buffer[current_buffer].size; /* cache volatile value */
-	    if (firmware.data10bit)
-		buffer[current_buffer].data[bsize]
-		    = (uint8_t)(value>>2);
+	    buffer_t *b = buffer_current();
+	    int bsize = b->size;
+	    if (dev->ring.sample_size == 2)
+		((uint16_t*)b->data)[bsize] = (uint16_t)dev->hex_value;
+	    else if (dev->firmware.data10bit)
+		b->data[bsize] = (uint8_t)(dev->hex_value>>2);
 	    else
-		buffer[current_buffer].data[bsize]
-		    = (uint8_t)value;
-	    if (bsize == 0)
-		buffer[current_buffer].timestamp = get_usecs();
-	    bsize++;
-	    buffer[current_buffer].size = bsize; /* save cached value */
-	    if (bsize == buffer_size
-		|| (bsize > 0
-		    && (bsize % config.nchannels) == 0
-		    && switch_buffers)) {
-		/* wait for FITS thread to finish if it is currently
-		   saving the previous buffer: */
-		while (save_buffer != -1)
-		    msleep(1);
-		/* signal FITS save thread: */
-		save_buffer = current_buffer;
-		/* swap buffers: */
-		current_buffer = 1 - current_buffer;
-		active_buffer = current_buffer;
-		buffer[current_buffer].size = 0;
-
-		switch_buffers = 0;
+		b->data[bsize] = (uint8_t)dev->hex_value;
+	    samples_added(bsize + 1);
+	}
+	dev->hex_value = dev->hex_count = 0;
+    }
+}
+
+/* Decode a span of hex data. Whole words are converted in bulk up to
+   the next buffer swap point. Returns the number of characters
+   consumed, which is less than n if there is a non-data character for
+   the caller to handle, or if the input was flushed by reset(). */
+static int hexdata(const char *s, int n) {
+    usec_t start = trace_start();
+    int i = 0;
+
+    while (i < n) {
+	char c = s[i];
+	int words;
+
+	if (c == MESSAGE_START || c == EEPROM_READY || c == DATA_END)
+	    break;
+
+	if (!dev->hex_count && !dev->resync_skip
+	    && (words = (n - i) / 4) > 0) {
+	    buffer_t *b = buffer_current();
+	    int bsize = b->size;
+	    int room = buffer_room(bsize);
+	    int sweep_left = dev->config.nchannels
+		- bsize % dev->config.nchannels;
+
+	    if (dev->switch_buffers && room > sweep_left)
+		room = sweep_left;
+	    if (words > room)
+		words = room;
+
+	    if (dev->ring.sample_size == 2)
+		words = dev->hexdecode_wide(s + i, words,
+				       (uint16_t*)b->data + bsize);
+	    else
+		words = dev->hexdecode(s + i, words, &b->data[bsize]);
+	    if (words) {
+		i += 4 * words;
+		samples_added(bsize + words);
+		continue;
 	    }
 	}
-	value = count = 0;
+
+	/* partial word, or the next word is not a plain sample: */
+	hexchar(c);
+	i++;
+	if (dev->input_flushed)
+	    break;
     }
+
+    trace_stage(TRACE_DECODE, start);
+    return i;
 }
@@ -21,22 +21,19 @@ typedef struct {
     int eeprom_info;
     char *versionstr;
 } firmware_t;
-extern firmware_t firmware;
+extern const firmware_t default_firmware;
 
 extern int debug;
 
-typedef struct {
-    uint8_t *data;
-    volatile int size;
-    usec_t timestamp;  /* timestamp of the first sample */
-} buffer_t;
-
-extern int buffer_size;
-extern buffer_t buffer[2];
-extern volatile int save_buffer;
-extern volatile int active_buffer;
-
-extern volatile int start_command, overview_command, stop_command;
+/* Commands for the acquisition thread, can be combined: */
+#define COMMAND_START 0x01
+#define COMMAND_STOP 0x02
+#define COMMAND_OVERVIEW 0x04
+/* start, unless already recording: */
+#define COMMAND_RESUME 0x08
+struct device;
+/* Post to device d, or to all devices if d is NULL: */
+void post_command(struct device *d, int cmd);
 
 void terminate(int signum);
 
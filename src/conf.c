@@ -9,9 +9,8 @@
 #include "log.h"
 #include "util.h"
 #include "callisto.h"
-
-config_t config;
-channel_t channels[MAX_CHANNELS];
+#include "buffer.h"
+#include "device.h"
 
 #define MAXLINE 1024
 
@@ -97,6 +96,7 @@ int read_config(const char *fname) {
     char *key, *value;
     int nconf = 0;
     int mmode = 3;
+    config_t *c = &dev->config;
 
     if ((f = fopen(fname, "r")) == NULL) {
 	fprintf(stderr, "ERROR: Cannot open configuration file %s: %s\n",
@@ -104,68 +104,96 @@ int read_config(const char *fname) {
 	return 0;
     }
 
-    memset(&config, 0, sizeof(config));
+    memset(c, 0, sizeof(*c));
     /* defaults: */
-    config.chargepump = 1;
-    config.agclevel = 120;
-    config.local_oscillator = 0.0;
-    config.clocksource = 1;
-    config.ovsdir = NULL;
-    config.schedulefile = NULL;
-    config.autostart = -1; /* 0=no, 1=yes, -1=by schedule */
-
-    config.net_port = 0;
+    c->chargepump = 1;
+    c->agclevel = 120;
+    c->local_oscillator = 0.0;
+    c->clocksource = 1;
+    c->ovsdir = NULL;
+    c->schedulefile = NULL;
+    c->autostart = -1; /* 0=no, 1=yes, -1=by schedule */
+
+    c->buffers = 4;
+    c->sample_bits = 8;
+    c->history = 300;
+
+    c->net_port = 0;
+    c->metrics_port = 0;
+    c->native_fits = 0;
+    c->stream_fits = 0;
+    c->fits_compress = NULL;
+    c->fits_threads = 0;
+    c->fits_fsync = 0;
 
     while (getconf(f, &key, &value)) {
 	
 	if (!strcmp(key, "rxcomport")) {
-	    config.serialport = strdup(value);
-	    if (config.serialport) nconf++;
+	    c->serialport = strdup(value);
+	    if (c->serialport) nconf++;
 	} else if (!strcmp(key, "instrument")) {
-	    config.instrument = strdup(value);
-	    if (config.instrument) nconf++;
+	    c->instrument = strdup(value);
+	    if (c->instrument) nconf++;
 	} else if (!strcmp(key, "origin")) {
-	    config.origin = strdup(value);
-	    if (config.origin) nconf++;
+	    c->origin = strdup(value);
+	    if (c->origin) nconf++;
 	} else if (!strcmp(key, "frqfile")) {
-	    config.channelfile = strdup(value);
-	    if (config.channelfile) nconf++;
+	    c->channelfile = strdup(value);
+	    if (c->channelfile) nconf++;
 	} else if (!strcmp(key, "datapath")) {
-	    config.datadir = strdup(value);
-	    if (config.datadir) nconf++;
+	    c->datadir = strdup(value);
+	    if (c->datadir) nconf++;
 	} else if (!strcmp(key, "ovspath")) {
-	    config.ovsdir = strdup(value);
+	    c->ovsdir = strdup(value);
 	} else if (!strcmp(key, "longitude")) {
-	    char c;
-	    sscanf(value, "%c , %lf", &c, &config.obs_long);
-	    if (c == 'W' || c == 'w')
-		config.obs_long = -config.obs_long;
-	    if (strchr("EeWw", c)) nconf++;
+	    char h;
+	    sscanf(value, "%c , %lf", &h, &c->obs_long);
+	    if (h == 'W' || h == 'w')
+		c->obs_long = -c->obs_long;
+	    if (strchr("EeWw", h)) nconf++;
 	} else if (!strcmp(key, "latitude")) {
-	    char c;
-	    sscanf(value, "%c , %lf", &c, &config.obs_lat);
-	    if (c == 'S' || c == 's')
-		config.obs_lat = -config.obs_lat;
-	    if (strchr("NnSs", c)) nconf++;
+	    char h;
+	    sscanf(value, "%c , %lf", &h, &c->obs_lat);
+	    if (h == 'S' || h == 's')
+		c->obs_lat = -c->obs_lat;
+	    if (strchr("NnSs", h)) nconf++;
 	} else if (!strcmp(key, "height")) {
-	    config.obs_height = atof(value);
+	    c->obs_height = atof(value);
 	    nconf++;
 	} else if (!strcmp(key, "chargepump")) {
-	    config.chargepump = !!atoi(value);
+	    c->chargepump = !!atoi(value);
 	} else if (!strcmp(key, "agclevel")) {
-	    config.agclevel = atoi(value);
+	    c->agclevel = atoi(value);
 	} else if (!strcmp(key, "clocksource")) {
-	    config.clocksource = atoi(value);
+	    c->clocksource = atoi(value);
 	} else if (!strcmp(key, "filetime")) {
-	    config.filetime = atoi(value);
+	    c->filetime = atoi(value);
 	    nconf++;
 	} else if (!strcmp(key, "focuscode")) {
-	    config.focuscode = atoi(value);
+	    c->focuscode = atoi(value);
 	    nconf++;
 	} else if (!strcmp(key, "autostart")) {
-	    config.autostart = atoi(value);
+	    c->autostart = atoi(value);
 	} else if (!strcmp(key, "net_port")) {
-	    config.net_port = atoi(value);
+	    c->net_port = atoi(value);
+	} else if (!strcmp(key, "metrics_port")) {
+	    c->metrics_port = atoi(value);
+	} else if (!strcmp(key, "native_fits")) {
+	    c->native_fits = atoi(value);
+	} else if (!strcmp(key, "stream_fits")) {
+	    c->stream_fits = atoi(value);
+	} else if (!strcmp(key, "fits_compress")) {
+	    c->fits_compress = strdup(value);
+	} else if (!strcmp(key, "fits_threads")) {
+	    c->fits_threads = atoi(value);
+	} else if (!strcmp(key, "fits_fsync")) {
+	    c->fits_fsync = atoi(value);
+	} else if (!strcmp(key, "buffers")) {
+	    c->buffers = atoi(value);
+	} else if (!strcmp(key, "sample_bits")) {
+	    c->sample_bits = atoi(value);
+	} else if (!strcmp(key, "history")) {
+	    c->history = atoi(value);
 	} else if (!strcmp(key, "mmode")) {
 	    mmode = atoi(value);
 	}
@@ -187,10 +215,49 @@ int read_config(const char *fname) {
 	return 0;
     }
 
-    if (config.ovsdir == NULL)
-	config.ovsdir = config.datadir;
-    if (config.schedulefile == NULL)
-	config.schedulefile = "scheduler.cfg";
+    if (c->buffers < MIN_BUFFERS || c->buffers > MAX_BUFFERS) {
+	fprintf(stderr,
+		"ERROR: buffers must be between %d and %d, "
+		"set in configuration file %s\n",
+		MIN_BUFFERS, MAX_BUFFERS, fname);
+	return 0;
+    }
+
+    if (c->sample_bits != 8 && c->sample_bits != 16) {
+	fprintf(stderr,
+		"ERROR: sample_bits must be 8 or 16, "
+		"set in configuration file %s\n", fname);
+	return 0;
+    }
+
+    if (c->stream_fits < 0
+	|| (c->stream_fits > 0 && c->stream_fits >= c->filetime)) {
+	fprintf(stderr,
+		"ERROR: stream_fits must be 0 (off) or less than "
+		"filetime (%d), set in configuration file %s\n",
+		c->filetime, fname);
+	return 0;
+    }
+
+    if (c->fits_fsync < 0) {
+	fprintf(stderr,
+		"ERROR: fits_fsync must be 0 (off) or a number of files, "
+		"set in configuration file %s\n", fname);
+	return 0;
+    }
+
+    if (c->history < 0 || c->history > MAX_HISTORY) {
+	fprintf(stderr,
+		"ERROR: history must be between 0 and %d, "
+		"set in configuration file %s\n",
+		MAX_HISTORY, fname);
+	return 0;
+    }
+
+    if (c->ovsdir == NULL)
+	c->ovsdir = c->datadir;
+    if (c->schedulefile == NULL)
+	c->schedulefile = "scheduler.cfg";
 
     return 1;
 }
@@ -209,7 +276,7 @@ int read_channels(const char *fname) {
 	return 0;
     }
 
-    memset(&channels, 0, MAX_CHANNELS * sizeof(channel_t));
+    memset(dev->channels, 0, MAX_CHANNELS * sizeof(channel_t));
 
     while (getconf(f, &key, &value)) {
 
@@ -217,16 +284,16 @@ int read_channels(const char *fname) {
 	    if (!strcasecmp(value, "CALLISTO"))
 		targetok = 1;
 	} else if (!strcmp(key, "number_of_measurements_per_sweep")) {
-	    config.nchannels = atoi(value);
-	    if (config.nchannels < 1 || config.nchannels > 512) {
+	    dev->config.nchannels = atoi(value);
+	    if (dev->config.nchannels < 1 || dev->config.nchannels > 512) {
 		fprintf(stderr, "ERROR: Invalid number of channels: %i\n",
-			config.nchannels);
+			dev->config.nchannels);
 		return 0;
 	    }
 	} else if (!strcmp(key, "number_of_sweeps_per_second")) {
 	    nsweeps = atoi(value);
 	} else if (!strcmp(key, "external_lo")) {
-	    config.local_oscillator = atof(value);
+	    dev->config.local_oscillator = atof(value);
 	} else {
 	    int ch;
 	    char *e;
@@ -237,9 +304,9 @@ int read_channels(const char *fname) {
 			    fname, ch);
 		} else {
 		    ch--;
-		    if (sscanf(value, "%lf , %d",
-			       &channels[ch].f, &channels[ch].lc) == 2)
-			channels[ch].valid = 1;
+		    if (sscanf(value, "%lf , %d", &dev->channels[ch].f,
+			       &dev->channels[ch].lc) == 2)
+			dev->channels[ch].valid = 1;
 		    else
 			fprintf(stderr,
 				"WARNING: Bad channel definition: %s\n", value);
@@ -255,15 +322,15 @@ int read_channels(const char *fname) {
     }
 
 
-    config.samplerate = nsweeps * config.nchannels;
-    if (config.samplerate < 1 || config.samplerate > 1000) {
+    dev->config.samplerate = nsweeps * dev->config.nchannels;
+    if (dev->config.samplerate < 1 || dev->config.samplerate > 1000) {
 	fprintf(stderr, "ERROR: Sample rate out of range in %s (%i)\n",
-		fname, config.samplerate);
+		fname, dev->config.samplerate);
 	return 0;
     }
 
-    for (i = 0; i < config.nchannels; i++)
-	if (!channels[i].valid) {
+    for (i = 0; i < dev->config.nchannels; i++)
+	if (!dev->channels[i].valid) {
 	    fprintf(stderr, "ERROR: Channel definitions missing from %s\n",
 		    fname);
 	    return 0;
@@ -282,6 +349,7 @@ int read_schedule(const char *fname) {
     FILE *f;
     char *s;
     time_t now = time(NULL);
+    int i, d;
 
     if ((f = fopen(fname, "r")) == NULL) {
 	if (errno == ENOENT)
@@ -316,8 +384,12 @@ int read_schedule(const char *fname) {
 	    continue;
 	}
 
-	/* This program does not support switching focuscodes: */
-	if (fc != config.focuscode) {
+	/* Switching focuscodes is not supported, the entries are for
+	   the devices with the focus code: */
+	for (i = 0; i < ndevices; i++)
+	    if (devices[i].config.focuscode == fc)
+		break;
+	if (i == ndevices) {
 	    if (debug)
 		logprintf(LOG_DEBUG,
 			  "Skipping schedule entry of not our focus code: %s",
@@ -351,6 +423,7 @@ int read_schedule(const char *fname) {
 	    t += 86400;
 
 	schedule[numschedule].t = t;
+	schedule[numschedule].focuscode = fc;
 	schedule[numschedule].action = mode;
 	numschedule++;
 
@@ -362,19 +435,23 @@ int read_schedule(const char *fname) {
     if (!numschedule)
 	logprintf(LOG_WARNING, "Loaded schedule is empty");
 
-    if (config.autostart < 0) {
-	/* determine what our starting mode (on/off) should be */
-	int i;
+    /* determine the starting mode (on/off) of each device from its
+       latest entry: */
+    for (d = 0; d < ndevices; d++) {
+	config_t *c = &devices[d].config;
 	time_t max = 0;
 	int n = -1;
 
+	if (c->autostart >= 0)
+	    continue;
 	if (debug)
 	    logprintf(LOG_DEBUG, "Configuring autostart from schedule");
 
 	for (i = 0; i < numschedule; i++)
-	    if (schedule[i].t > max
-		&& (schedule[n].action == SCHEDULE_START
-		    || schedule[n].action == SCHEDULE_STOP))
+	    if (schedule[i].focuscode == c->focuscode
+		&& schedule[i].t > max
+		&& (schedule[i].action == SCHEDULE_START
+		    || schedule[i].action == SCHEDULE_STOP))
 		{
 		    max = schedule[i].t;
 		    n = i;
@@ -382,9 +459,9 @@ int read_schedule(const char *fname) {
 
 	if (n >= 0) {
 	    if (schedule[n].action == SCHEDULE_START)
-		config.autostart = 1;
+		c->autostart = 1;
 	    else
-		config.autostart = 0;
+		c->autostart = 0;
 	}
     }
 
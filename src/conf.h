@@ -27,20 +27,25 @@ typedef struct {
     int nchannels;       /* = sweep length */
     int samplerate;      /* samples / sec */
     int autostart;
+    int buffers;         /* number of sample buffers */
+    int sample_bits;     /* 8 or 16 */
+    int history;         /* seconds of sweeps kept for the server */
 
     int net_port;
+    int metrics_port;    /* 0 = off */
+    int native_fits;
+    int stream_fits;     /* seconds between appends, 0 = off */
+    const char *fits_compress;
+    int fits_threads;    /* 0 = default */
+    int fits_fsync;      /* files per fsync, 0 = never */
 } config_t;
 
-extern config_t config;
-
 typedef struct {
     int valid;
     double f; /* frequency, in MHz */
     int lc;   /* number of integrations for lightcurves */
 } channel_t;
 
-extern channel_t channels[MAX_CHANNELS];
-
 /* Supported callisto operating modes: */
 #define SCHEDULE_STOP 0
 #define SCHEDULE_START 3
@@ -48,14 +53,17 @@ extern channel_t channels[MAX_CHANNELS];
 
 typedef struct {
     time_t t;
+    int focuscode;
     int action;
 } schedule_t;
 
 extern schedule_t schedule[MAX_SCHEDULE];
 extern int numschedule;
 
+/* These read into the configuration of the current device: */
 int read_config(const char *fname);
 int read_channels(const char *fname);
+/* The schedule is for all devices, by focus code: */
 int read_schedule(const char *fname);
 
 #endif
@@ -0,0 +1,95 @@
+#ifndef CALLISTO_DEVICE_H
+#define CALLISTO_DEVICE_H
+
+#include <pthread.h>
+
+#include "callisto.h"
+#include "conf.h"
+#include "buffer.h"
+#include "hexdecode.h"
+#include "timing.h"
+#include "gaps.h"
+#include "sweeps.h"
+#include "pyramid.h"
+
+/* One Callisto receiver, with its configuration, serial port, sample
+   buffers and acquisition state. Each thread works on one device at a
+   time, dev: an acquisition thread on its own device, a FITS writer on
+   the device of the buffer it is saving and a server client on the
+   device it has selected. */
+
+#define MAX_DEVICES 16
+
+/* acquisition states: */
+enum {
+    STOPPED,
+    STOPPING,
+    STARTING,
+    RUNNING,
+    OVERVIEW
+};
+
+typedef struct {
+    double freq;
+    int value;
+} ovs_t;
+#define MAX_OVS 13200
+
+typedef struct device {
+    int index;                 /* from 0, in command line order */
+    config_t config;
+    channel_t channels[MAX_CHANNELS];
+    firmware_t firmware;
+    hexdecode_t hexdecode;
+    hexdecode_wide_t hexdecode_wide;
+    buffer_ring_t ring;
+    timing_t timing;
+    timing_shared_t timing_shared; /* for other threads */
+    gaps_t gaps;
+    sweep_ring_t sweeps;      /* completed sweeps, for live readers */
+    pyramid_t pyramid;        /* and at coarser resolutions */
+    usec_t lost_checked;      /* serial_lost() last called */
+    struct serial_port *serial;
+    struct fits_device *fits;
+
+    /* The rest is only touched by the acquisition thread, except for
+       posted_commands. */
+    pthread_t thread;
+    int state;
+    /* pending commands: */
+    int start_command, overview_command, stop_command;
+    /* commands posted by other threads and signal handlers: */
+    volatile int posted_commands;
+    int command_fd, epoll_fd;
+    volatile int switch_buffers;
+
+    char message[MAX_MESSAGE];
+    int message_length, in_message, in_data;
+    int input_flushed;        /* serial input discarded by reset() */
+    /* samples per file, and in the buffers already queued for the
+       current file: */
+    int file_size, file_samples;
+    int overflowing;          /* logged that the writer is behind */
+    /* hex data decoder state: partial word, end markers seen, and the
+       first invalid character of the word */
+    int hex_value, hex_count, hex_end_markers, hex_bad;
+    char hex_bad_char;
+    /* recovery from corrupt input: samples left to skip to the next
+       sweep, errors since the last whole sweep, stray bytes in a row
+       outside the data and in total */
+    int resync_skip, resync_errors, stray;
+    unsigned long stray_bytes;
+    /* reset loop detection: */
+    int reset_count;
+    time_t last_reset;
+
+    ovs_t *ovs;
+    int ovsnum;
+    time_t ovstime;
+} device_t;
+
+extern device_t *devices;
+extern int ndevices;
+extern __thread device_t *dev;
+
+#endif
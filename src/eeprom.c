@@ -4,6 +4,7 @@
 
 #include "callisto.h"
 #include "conf.h"
+#include "device.h"
 #include "serial.h"
 #include "log.h"
 
@@ -11,7 +12,7 @@
 #define SYNTHESIZER_RESOLUTION 0.0625
 
 /* Default to firmware version 1.5 (of 1.5/1.7/1.8): */
-firmware_t firmware = {
+const firmware_t default_firmware = {
     /* IF-frequency #1 = IF-frequency #2 + Quarz-frequency [MHz]
        (10.70+27.0 for firmware 1.5/1.7). */
     .if_init = 37.7,
@@ -29,19 +30,20 @@ int upload_channels() {
     int i;
 
     if (debug)
-	logprintf(LOG_DEBUG, "Uploading %i channels", config.nchannels);
+	logprintf(LOG_DEBUG, "Uploading %i channels", dev->config.nchannels);
 
-    for (i = 0; i < config.nchannels; i++) {
+    for (i = 0; i < dev->config.nchannels; i++) {
 	unsigned divider, div_hi, div_lo, control = 0x86, band = 1;
-	double f = fabs(channels[i].f - config.local_oscillator);
+	double f = fabs(dev->channels[i].f - dev->config.local_oscillator);
 	char cmd[32];
 	char c = 0;
 
-	divider = (unsigned)((f + firmware.if_init) / SYNTHESIZER_RESOLUTION);
+	divider = (unsigned)((f + dev->firmware.if_init)
+			     / SYNTHESIZER_RESOLUTION);
 	div_hi = (divider >> 8) & 0xff;
 	div_lo = divider & 0xff;
 
-	if (config.chargepump)
+	if (dev->config.chargepump)
 	    control |= 0x40;
 
 	if (f < LOW_BAND)
@@ -72,7 +74,7 @@ int download_channels() {
     double d;
 
     if (debug)
-	logprintf(LOG_DEBUG, "Downloading %i channels", config.nchannels);
+	logprintf(LOG_DEBUG, "Downloading %i channels", dev->config.nchannels);
 
     /* Turn on debugging: */
     write_serial("D1\r");
@@ -92,7 +94,7 @@ int download_channels() {
 	    return 0;
 	}
 
-    for (ch = 0; ch < config.nchannels; ch++) {
+    for (ch = 0; ch < dev->config.nchannels; ch++) {
 	/* Query the channel: */
 	sprintf(msg, "FR%i\r", ch+1);
 	write_serial(msg);
@@ -126,13 +128,13 @@ int download_channels() {
 	    fprintf(stderr, "ERROR: Invalid response to FR command: %s\n", msg);
 	    return 0;
 	}
-	if ((c == '~' && firmware.eeprom_info)
+	if ((c == '~' && dev->firmware.eeprom_info)
 	    ||
-	    (c == '=' && !firmware.eeprom_info)) {
+	    (c == '=' && !dev->firmware.eeprom_info)) {
 	    fprintf(stderr, "ERROR: Firmware mismatch detected\n");
 	    return 0;
 	}
-	if (firmware.eeprom_info) {
+	if (dev->firmware.eeprom_info) {
 	    /* eat the "EEPROM=aaa,bbb,ccc,ddd" info line */
 	    c = 0;
 	    while (c != '\r')
@@ -143,16 +145,17 @@ int download_channels() {
 		}
 	}
 
-	d = (double)(d1*1000+d2)/1000.0 + firmware.if_init_correction;
+	d = (double)(d1*1000+d2)/1000.0 + dev->firmware.if_init_correction;
 
 	/* Compensate for config.local_oscillator: */
 	{
 	    /* d == fabs(f - config.local_oscillator) */
-	    double f1 = d + config.local_oscillator,
-		f2 = config.local_oscillator - d;
+	    double f1 = d + dev->config.local_oscillator,
+		f2 = dev->config.local_oscillator - d;
 	    if (f2 < 0.0) f2 = f1;
 	    /* select the one closest to the configured frequency: */
-	    if (fabs(channels[ch].f - f1) <= fabs(channels[ch].f - f2))
+	    if (fabs(dev->channels[ch].f - f1)
+		<= fabs(dev->channels[ch].f - f2))
 		d = f1;
 	    else
 		d = f2;
@@ -161,7 +164,7 @@ int download_channels() {
 	/* check the downloaded frequency against the
 	   configured(/uploaded) one (the one percent fudge factor is
 	   there for possible floating point rounding errors): */
-	if (fabs(d - channels[ch].f) > 1.01*SYNTHESIZER_RESOLUTION) {
+	if (fabs(d - dev->channels[ch].f) > 1.01*SYNTHESIZER_RESOLUTION) {
 	    fprintf(stderr,
 		    "ERROR: Frequency of channel %i differs from its "
 		    "configured value. Perhaps channels need to be loaded "
@@ -172,7 +175,7 @@ int download_channels() {
 	}
 
 	/* Store frequency: */
-	channels[ch].f = d;
+	dev->channels[ch].f = d;
 
 	/* eat the command echo: */
 	c = 0;
@@ -0,0 +1,594 @@
+/*
+  Callisto hardware emulator. Opens a pseudo-terminal and speaks the
+  serial protocol of the Callisto firmware (versions 1.5, 1.7 and 1.8)
+  on it, as far as the daemon uses it: reset and identification, the
+  "?" version banner, EEPROM channel upload (FE) and download (FR),
+  recording (S1/GE/GD/S0) with hex data at a configurable rate, the
+  spectral overview and hardware resets. Point rxcomport in the
+  daemon configuration at the printed (or -l linked) device.
+*/
+
+#define _GNU_SOURCE /* posix_openpt() and friends */
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <math.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "util.h"
+
+/* Channels are stored in 4096-byte EEPROM, 8 bytes per channel: */
+#define MAX_CHANNELS 512
+
+#define SYNTHESIZER_RESOLUTION 0.0625
+
+/* Output is paced in ticks, like the USB serial converter does: */
+#define TICK_USECS 5000
+#define OUTBUF_SIZE (1 << 20)
+#define MAXLINE 128
+
+enum { FW_15, FW_17, FW_18 };
+static int fw = FW_18;
+
+typedef struct {
+    int valid;
+    unsigned div_hi, div_lo, control, band;
+} eeprom_t;
+static eeprom_t eeprom[MAX_CHANNELS];
+
+static int master_fd = -1;
+
+static char outbuf[OUTBUF_SIZE];
+static int out_start = 0, out_len = 0;
+
+/* emulated hardware state: */
+static int debug_mode = 0;
+static int started = 0, streaming = 0;
+static int nchannels = 200;
+static int samplerate = 800;   /* from GS/GA */
+static int forced_rate = 0;    /* -r, overrides GS/GA */
+static int max_speed = 0;      /* -m */
+static int ovs_active = 0, ovs_points = 13200, ovs_done = 0;
+static double ovs_start = 45.0;
+
+static usec_t stream_start = 0;
+static uint64_t stream_sent = 0;   /* samples since stream_start */
+static uint64_t sample_count = 0;  /* position in the sweep */
+static uint32_t noise = 1;
+
+/* statistics: */
+static uint64_t total_samples = 0, total_bytes = 0, dropped_bytes = 0;
+static unsigned resets = 0;
+
+static volatile int quit = 0, inject_reset = 0;
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\nOptions:\n", prog);
+    fprintf(stderr,
+	    "\t-v,--firmware <ver>   Firmware version to emulate: 1.5, 1.7 or 1.8 (default)\n"
+	    "\t-r,--rate <n>         Sample rate in samples/s, overrides the rate set by the host\n"
+	    "\t-m,--max-speed        Send data as fast as the host reads it\n"
+	    "\t-f,--frqfile <file>   Preload the EEPROM with the channels of a frequency file\n"
+	    "\t-l,--link <path>      Create a symbolic link to the pseudo-terminal\n"
+	    "\t-R,--reset <secs>     Inject a hardware reset every secs seconds\n"
+	    "\t-S,--seed <n>         Seed of the generated data\n"
+	    "\t-V,--version          Show program version\n"
+	    "\t-h,--help             This help text\n"
+	    );
+    exit(EXIT_FAILURE);
+}
+
+static void signal_handler(int signum) {
+    if (signum == SIGUSR1)
+	inject_reset = 1;
+    else
+	quit = 1;
+}
+
+
+/* Queue output for the host. Output that does not fit is dropped, as
+   the hardware would when the host does not keep up. */
+static void emit(const char *s, int n) {
+    int pos;
+
+    if (n > OUTBUF_SIZE - out_len) {
+	dropped_bytes += n - (OUTBUF_SIZE - out_len);
+	n = OUTBUF_SIZE - out_len;
+    }
+    pos = (out_start + out_len) % OUTBUF_SIZE;
+    out_len += n;
+    total_bytes += n;
+    while (n > 0) {
+	int l = n;
+	if (pos + l > OUTBUF_SIZE)
+	    l = OUTBUF_SIZE - pos;
+	memcpy(&outbuf[pos], s, l);
+	s += l;
+	n -= l;
+	pos = 0;
+    }
+}
+
+static void emit_str(const char *s) {
+    emit(s, strlen(s));
+}
+
+static void flush_output() {
+    while (out_len > 0) {
+	int l = out_len;
+	ssize_t w;
+
+	if (out_start + l > OUTBUF_SIZE)
+	    l = OUTBUF_SIZE - out_start;
+	if ((w = write(master_fd, &outbuf[out_start], l)) <= 0) {
+	    if (w < 0 && errno != EAGAIN && errno != EINTR && errno != EIO) {
+		fprintf(stderr, "ERROR: Writing pseudo-terminal failed: %s\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	    }
+	    return;
+	}
+	out_start = (out_start + w) % OUTBUF_SIZE;
+	out_len -= w;
+    }
+}
+
+
+static double if_init() {
+    switch (fw) {
+    case FW_15:
+	return 37.75; /* sic, see the daemon source */
+    case FW_17:
+	return 37.7;
+    default:
+	return 36.13;
+    }
+}
+
+static void banner() {
+    switch (fw) {
+    case FW_15:
+	emit_str("$CRX:ChargePump=1\r$CRX:Debug=0\r$CRX:Agc=120\r");
+	break;
+    case FW_17:
+	emit_str("$CRX:Debug=0\r$CRX:Agc=120\r");
+	break;
+    default:
+	emit_str("$CRX:V1.8 / emulator\r$CRX:Debug=0\r$CRX:Agc=120\r");
+	break;
+    }
+}
+
+static void stop_stream() {
+    if (streaming) {
+	/* two end markers, then end of data: */
+	emit_str("23232323&");
+	streaming = 0;
+    }
+}
+
+static void hardware_reset() {
+    streaming = started = ovs_active = 0;
+    debug_mode = 0;
+    out_start = out_len = 0; /* whatever was in flight is lost */
+    emit_str("$CRX:e-Callisto ETH Zurich\r");
+    banner();
+    resets++;
+    fprintf(stderr, "Injected hardware reset\n");
+}
+
+static int current_rate() {
+    return forced_rate > 0 ? forced_rate : samplerate;
+}
+
+static void frequency_response(int ch) {
+    char s[MAXLINE];
+    double f;
+    int d1, d2;
+    eeprom_t *e = &eeprom[ch];
+
+    f = (double)((e->div_hi << 8) | e->div_lo) * SYNTHESIZER_RESOLUTION
+	- if_init();
+    if (f < 0.0)
+	f = 0.0;
+    d1 = (int)f;
+    d2 = (int)floor((f - d1) * 1000.0 + 0.5);
+    if (d2 >= 1000) {
+	d1++;
+	d2 -= 1000;
+    }
+    /* the decimal part is printed without leading zeroes: */
+    snprintf(s, MAXLINE, "$CRX:Frequency%c%d.%dMHz\r",
+	     fw == FW_18 ? '=' : '~', d1, d2);
+    emit_str(s);
+    if (fw == FW_18) {
+	snprintf(s, MAXLINE, "$CRX:EEPROM=%03u,%03u,%03u,%03u\r",
+		 e->div_hi, e->div_lo, e->control, e->band);
+	emit_str(s);
+    }
+}
+
+static void command(const char *cmd) {
+    unsigned ch, hi, lo, control, band, n;
+    char echo[MAXLINE + 8];
+
+    if (!strcmp(cmd, "?")) {
+	banner();
+    } else if (!strcmp(cmd, "S0")) {
+	stop_stream();
+	started = 0;
+	emit_str("$CRX:Stopped\r");
+    } else if (!strcmp(cmd, "S1")) {
+	started = 1;
+	emit_str("$CRX:Started\r");
+    } else if (!strcmp(cmd, "GE")) {
+	if (started && !streaming) {
+	    emit_str("2"); /* data start */
+	    streaming = 1;
+	    sample_count = 0;
+	    stream_sent = 0;
+	    stream_start = get_monotonic_usecs();
+	}
+    } else if (!strcmp(cmd, "GD")) {
+	stop_stream();
+    } else if (!strcmp(cmd, "D0")) {
+	debug_mode = 0;
+	return; /* no echo, debugging is off already */
+    } else if (!strcmp(cmd, "D1")) {
+	debug_mode = 1;
+	emit_str("$CRX:Debug=1\r");
+    } else if (sscanf(cmd, "FE%u,%u,%u,%u,%u",
+		      &ch, &hi, &lo, &control, &band) == 5) {
+	if (ch >= 1 && ch <= MAX_CHANNELS) {
+	    eeprom[ch-1].div_hi = hi & 0xff;
+	    eeprom[ch-1].div_lo = lo & 0xff;
+	    eeprom[ch-1].control = control & 0xff;
+	    eeprom[ch-1].band = band & 0xff;
+	    eeprom[ch-1].valid = 1;
+	}
+	emit_str("]");
+    } else if (sscanf(cmd, "FR%u", &ch) == 1) {
+	if (ch >= 1 && ch <= MAX_CHANNELS)
+	    frequency_response(ch-1);
+    } else if (sscanf(cmd, "GS%u", &n) == 1) {
+	samplerate = 86400 / (n + 1);
+    } else if (sscanf(cmd, "GA%u", &n) == 1) {
+	samplerate = 500000 / (n + 1);
+    } else if (cmd[0] == 'L' && sscanf(cmd, "L%u", &n) == 1) {
+	if (n >= 1)
+	    nchannels = ovs_points = n;
+    } else if (cmd[0] == 'F' && cmd[1] != 'S'
+	       && sscanf(cmd, "F%lf", &ovs_start) == 1) {
+	; /* overview start frequency */
+    } else if (!strcmp(cmd, "P2")) {
+	ovs_active = 1;
+	ovs_done = 0;
+	stream_sent = 0;
+	stream_start = get_monotonic_usecs();
+    }
+    /* T, O, C, FS, M and % only change the analog side. */
+
+    if (debug_mode) {
+	snprintf(echo, sizeof(echo), "$CRX:%s\r", cmd);
+	emit_str(echo);
+    }
+}
+
+static void read_commands() {
+    static char line[MAXLINE];
+    static int len = 0;
+    char buf[256];
+    ssize_t r;
+    int i;
+
+    while ((r = read(master_fd, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < r; i++) {
+	    if (buf[i] == '\r') {
+		line[len] = 0;
+		if (len)
+		    command(line);
+		len = 0;
+	    } else if (buf[i] != '\n' && len < MAXLINE-1)
+		line[len++] = buf[i];
+	}
+    }
+}
+
+
+/* Generate n samples of a smooth spectrum with noise: */
+static void generate_samples(uint64_t n) {
+    static const char hex[] = "0123456789ABCDEF";
+    char s[4*256];
+    int maxval = fw == FW_15 ? 0xff : 0x3ff;
+
+    while (n > 0) {
+	int k = n > 256 ? 256 : (int)n, i;
+	for (i = 0; i < k; i++) {
+	    int c = (int)(sample_count % nchannels);
+	    int v = maxval / 3
+		+ (int)(maxval / 8 * sin(6.2831853 * c / nchannels));
+	    noise = noise * 1103515245 + 12345;
+	    v += (int)((noise >> 16) & 31) - 16;
+	    if (v < 0) v = 0;
+	    if (v > maxval) v = maxval;
+	    s[4*i] = hex[(v >> 12) & 0xf];
+	    s[4*i+1] = hex[(v >> 8) & 0xf];
+	    s[4*i+2] = hex[(v >> 4) & 0xf];
+	    s[4*i+3] = hex[v & 0xf];
+	    sample_count++;
+	}
+	emit(s, 4*k);
+	n -= k;
+	total_samples += k;
+    }
+}
+
+static void generate_overview(uint64_t n) {
+    char s[MAXLINE];
+
+    while (n-- > 0 && ovs_done < ovs_points) {
+	double f = ovs_start + ovs_done * SYNTHESIZER_RESOLUTION;
+	noise = noise * 1103515245 + 12345;
+	snprintf(s, MAXLINE, "$CRX:%.3f,%u\r", f,
+		 300 + (unsigned)((noise >> 16) % 200));
+	emit_str(s);
+	ovs_done++;
+    }
+    if (ovs_done >= ovs_points)
+	ovs_active = 0; /* the host notices by timeout */
+}
+
+/* Produce what is due by now, or (at max speed) what fits. */
+static void generate() {
+    uint64_t due;
+
+    if (!streaming && !ovs_active)
+	return;
+
+    if (max_speed) {
+	/* keep the buffer about half full: */
+	if (out_len > OUTBUF_SIZE / 2)
+	    return;
+	due = (OUTBUF_SIZE / 2 - out_len) / 4;
+    } else {
+	uint64_t target = (uint64_t)(get_monotonic_usecs() - stream_start)
+	    * current_rate() / 1000000;
+	due = target - stream_sent;
+	stream_sent = target;
+    }
+
+    if (ovs_active)
+	generate_overview(max_speed ? due / 8 : due);
+    else
+	generate_samples(due);
+}
+
+
+static int read_frqfile(const char *fname) {
+    FILE *f;
+    char line[1024];
+    double lo = 0.0;
+    int i, n = 0;
+    double freq[MAX_CHANNELS];
+
+    if ((f = fopen(fname, "r")) == NULL) {
+	fprintf(stderr, "ERROR: Cannot open frequency file %s: %s\n",
+		fname, strerror(errno));
+	return 0;
+    }
+    memset(freq, 0, sizeof(freq));
+    while (fgets(line, sizeof(line), f)) {
+	int ch;
+	double fr;
+	if (sscanf(line, " [external_lo] = %lf", &fr) == 1)
+	    lo = fr;
+	else if (sscanf(line, " [%d] = %lf", &ch, &fr) == 2
+		 && ch >= 1 && ch <= MAX_CHANNELS) {
+	    freq[ch-1] = fr;
+	    if (ch > n)
+		n = ch;
+	}
+    }
+    fclose(f);
+
+    /* same as what the daemon uploads with -L: */
+    for (i = 0; i < n; i++) {
+	double fr = fabs(freq[i] - lo);
+	unsigned divider = (unsigned)((fr + (fw == FW_18 ? 36.13 : 37.7))
+				      / SYNTHESIZER_RESOLUTION);
+	eeprom[i].div_hi = (divider >> 8) & 0xff;
+	eeprom[i].div_lo = divider & 0xff;
+	eeprom[i].control = 0xc6;
+	eeprom[i].band = fr < 171.0 ? 1 : (fr < 450.0 ? 2 : 4);
+	eeprom[i].valid = 1;
+    }
+
+    return 1;
+}
+
+static int open_pty(const char *link, int *slave_fd) {
+    struct termios tc;
+    const char *name;
+
+    if ((master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+	|| grantpt(master_fd) || unlockpt(master_fd)
+	|| (name = ptsname(master_fd)) == NULL) {
+	fprintf(stderr, "ERROR: Cannot create pseudo-terminal: %s\n",
+		strerror(errno));
+	return 0;
+    }
+
+    /* Keep the slave open ourselves, so that the master does not see
+       a hangup between host program runs. Also make it raw, so there
+       is no echo before the host has configured the port. */
+    if ((*slave_fd = open(name, O_RDWR | O_NOCTTY)) < 0
+	|| tcgetattr(*slave_fd, &tc)) {
+	fprintf(stderr, "ERROR: Cannot open %s: %s\n", name, strerror(errno));
+	return 0;
+    }
+    cfmakeraw(&tc);
+    tcsetattr(*slave_fd, TCSANOW, &tc);
+
+    fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+    if (link) {
+	unlink(link);
+	if (symlink(name, link)) {
+	    fprintf(stderr, "ERROR: Cannot create link %s: %s\n",
+		    link, strerror(errno));
+	    return 0;
+	}
+    }
+
+    printf("%s\n", link ? link : name);
+    fflush(stdout);
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    const char *link = NULL, *frqfile = NULL;
+    int reset_interval = 0, slave_fd = -1;
+    usec_t next_reset = 0;
+    struct sigaction sa;
+
+    while (1) {
+        int opt;
+        static struct option long_options[] = {
+            {"firmware", 1, NULL, 'v'},
+            {"rate", 1, NULL, 'r'},
+            {"max-speed", 0, NULL, 'm'},
+            {"frqfile", 1, NULL, 'f'},
+            {"link", 1, NULL, 'l'},
+            {"reset", 1, NULL, 'R'},
+            {"seed", 1, NULL, 'S'},
+            {"version", 0, NULL, 'V'},
+            {"help", 0, NULL, 'h'},
+            {0, 0, 0, 0}
+        };
+
+        opt = getopt_long(argc, argv, "v:r:mf:l:R:S:Vh", long_options, NULL);
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+	case 'v':
+	    if (!strcmp(optarg, "1.5"))
+		fw = FW_15;
+	    else if (!strcmp(optarg, "1.7"))
+		fw = FW_17;
+	    else if (!strcmp(optarg, "1.8"))
+		fw = FW_18;
+	    else {
+		fprintf(stderr, "ERROR: Unsupported firmware version %s\n",
+			optarg);
+		return EXIT_FAILURE;
+	    }
+	    break;
+	case 'r':
+	    forced_rate = atoi(optarg);
+	    break;
+	case 'm':
+	    max_speed = 1;
+	    break;
+	case 'f':
+	    frqfile = optarg;
+	    break;
+	case 'l':
+	    link = optarg;
+	    break;
+	case 'R':
+	    reset_interval = atoi(optarg);
+	    break;
+	case 'S':
+	    noise = (uint32_t)strtoul(optarg, NULL, 0);
+	    break;
+	case 'V':
+	    printf("e-Callisto emulator for Unix " PACKAGE_VERSION "\n");
+	    return 0;
+	case 'h':
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (optind < argc) {
+        fprintf(stderr,
+                "Command line should contain only recognized options\n");
+        usage(argv[0]);
+    }
+
+    /* the -f channels are converted with the firmware IF: */
+    if (frqfile && !read_frqfile(frqfile))
+	return EXIT_FAILURE;
+
+    if (!open_pty(link, &slave_fd))
+	return EXIT_FAILURE;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (reset_interval > 0)
+	next_reset = get_monotonic_usecs() + 1000000LL * reset_interval;
+
+    while (!quit) {
+	struct pollfd pfd;
+	int timeout = -1;
+
+	if (inject_reset
+	    || (next_reset && get_monotonic_usecs() >= next_reset)) {
+	    inject_reset = 0;
+	    if (next_reset)
+		next_reset = get_monotonic_usecs()
+		    + 1000000LL * reset_interval;
+	    hardware_reset();
+	}
+
+	generate();
+	flush_output();
+
+	if (streaming || ovs_active)
+	    timeout = max_speed ? 100 : TICK_USECS / 1000;
+	if (next_reset)
+	    timeout = timeout < 0 || timeout > 100 ? 100 : timeout;
+
+	pfd.fd = master_fd;
+	pfd.events = POLLIN | (out_len > 0 ? POLLOUT : 0);
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeout) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "ERROR: poll() failed: %s\n", strerror(errno));
+	    return EXIT_FAILURE;
+	}
+	if (pfd.revents & POLLIN)
+	    read_commands();
+    }
+
+    fprintf(stderr,
+	    "%llu samples, %llu bytes sent, %llu bytes dropped, "
+	    "%u resets injected\n",
+	    (unsigned long long)total_samples,
+	    (unsigned long long)total_bytes,
+	    (unsigned long long)dropped_bytes, resets);
+
+    if (link)
+	unlink(link);
+    close(slave_fd);
+    close(master_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,279 @@
+/* Check that the native FITS writer of fits.c writes the same files as
+   cfitsio, for make check. The same buffers are written both ways and
+   the files compared byte for byte, except for the DATE card, which
+   cfitsio may stamp itself. The source is included to reach the
+   writers, which are static; the rest of the daemon is replaced by
+   the stubs below. */
+
+#include "fits.c"
+
+#include <stdarg.h>
+
+int debug = 0;
+device_t *devices = NULL;
+int ndevices = 0;
+__thread device_t *dev = NULL;
+
+void logprintf(int priority, const char *format, ...) {
+    va_list ap;
+
+    (void)priority;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+void terminate(int signum) {
+    exit(signum ? 1 : 0);
+}
+
+void metric_add(int metric, int64_t n) {
+    (void)metric;
+    (void)n;
+}
+
+void metric_observe(int histogram, uint64_t v) {
+    (void)histogram;
+    (void)v;
+}
+
+buffer_t *buffer_wait() {
+    return NULL;
+}
+
+void buffer_release(buffer_t *b) {
+    (void)b;
+}
+
+/* The output keeps the last file submitted, in memory: */
+static output_file_t file;
+static uint8_t *written = NULL;
+static size_t written_len = 0;
+
+const char *output_init(int count, size_t size, int sync_batch) {
+    (void)count;
+    (void)sync_batch;
+    if (!(file.data = (uint8_t*)realloc(file.data, size)))
+	return NULL;
+    file.size = size;
+    return "memory";
+}
+
+void output_start() {
+}
+
+output_file_t *output_get() {
+    file.len = 0;
+    file.started = get_monotonic_usecs();
+    return &file;
+}
+
+void output_submit(output_file_t *f) {
+    free(written);
+    written_len = 0;
+    if ((written = (uint8_t*)malloc(f->len))) {
+	memcpy(written, f->data, f->len);
+	written_len = f->len;
+    }
+}
+
+void output_abort(output_file_t *f) {
+    (void)f;
+    free(written);
+    written = NULL;
+    written_len = 0;
+}
+
+void output_wait_idle() {
+}
+
+int output_preallocate(int fd, off_t len) {
+    (void)fd;
+    (void)len;
+    return 1;
+}
+
+
+/* xorshift64, the same sequence every run unless seeded: */
+static uint64_t state = 88172645463325252ull;
+
+static unsigned rnd(unsigned n) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (unsigned)(state >> 11) % n;
+}
+
+typedef struct {
+    const char *name;
+    int sample_size, nchannels, samplerate, filetime;
+    double obs_lat, obs_long, obs_height;
+    const char *origin;
+    int gaps;
+} case_t;
+
+/* Values that need all the formatting cases: exponents, negative
+   coordinates, quotes in strings and comments cut at the card end. */
+static const case_t cases[] = {
+    { "8-bit", 1, 200, 800, 900, 47.3, 8.1, 469.0, "ETH Zurich", 0 },
+    { "16-bit", 2, 200, 800, 900, 47.3, 8.1, 469.0, "ETH Zurich", 0 },
+    { "gaps", 1, 200, 800, 900, -33.86, -151.21, 58.25, "Observatory", 3 },
+    { "partial", 2, 10, 1000, 60, 1e-7, 123.456789012345, -12.5,
+      "O'Neill's", 1 },
+    { "exponents", 1, 10, 1000000, 1, 0.0, 1e20, 1e-300,
+      "The long name of an organization, with its quote at the very end: "
+      "O'Brien's", 0 },
+    { NULL, 0, 0, 0, 0, 0.0, 0.0, 0.0, NULL, 0 }
+};
+
+/* A device and a buffer of w sweeps of random samples for c: */
+static int setup(const case_t *c, buffer_t *buf, int w) {
+    static device_t d;
+    static struct fits_device *fd = NULL;
+    usec_t t0 = 1400000000000000ll + rnd(1000000000);
+    double sweep_len = 1e6 * c->nchannels / c->samplerate;
+    int x, i;
+
+    if (fd) {
+	free(fd->primary.cards);
+	free(fd->table.cards);
+	free(fd->table_time);
+	free(fd->table_freq);
+	free(fd);
+    }
+    memset(&d, 0, sizeof(d));
+    d.config.instrument = "TEST";
+    d.config.origin = c->origin;
+    d.config.channelfile = "frq00005.cfg";
+    d.config.datadir = ".";
+    d.config.obs_lat = c->obs_lat;
+    d.config.obs_long = c->obs_long;
+    d.config.obs_height = c->obs_height;
+    d.config.agclevel = 120;
+    d.config.filetime = c->filetime;
+    d.config.focuscode = 59;
+    d.config.nchannels = c->nchannels;
+    d.config.samplerate = c->samplerate;
+    d.config.native_fits = 1;
+    d.ring.sample_size = c->sample_size;
+    d.ring.size = c->filetime * c->samplerate;
+    gaps_init(&d.gaps, c->samplerate, c->nchannels);
+    dev = &d;
+    if (!fits_device_init())
+	return 0;
+    fd = d.fits;
+    /* the frequencies are read from the device after fits_init(): */
+    for (i = 0; i < c->nchannels; i++)
+	d.channels[i].f = 45.0 + 0.0625 * rnd(14000);
+
+    buf->size = w * c->nchannels;
+    buf->sample_size = c->sample_size;
+    buf->timestamp = t0;
+    buf->device = &d;
+    buf->data = (uint8_t*)malloc((size_t)buf->size * c->sample_size);
+    buf->sweep_times = (usec_t*)malloc(w * sizeof(usec_t));
+    if (!buf->data || !buf->sweep_times)
+	return 0;
+    for (i = 0; i < buf->size; i++)
+	if (c->sample_size == 2)
+	    ((uint16_t*)buf->data)[i] = rnd(1024);
+	else
+	    buf->data[i] = rnd(256);
+    for (x = 0; x < w; x++)
+	buf->sweep_times[x] = t0 + (usec_t)(x * sweep_len) + rnd(3);
+    for (i = 0; i < c->gaps; i++) {
+	x = rnd(w);
+	gap_add(&d.gaps, GAP_TIMEOUT, buf->sweep_times[x],
+		buf->sweep_times[x] + (usec_t)(sweep_len * (1 + rnd(5))));
+    }
+    return 1;
+}
+
+static int is_date(const uint8_t *p, size_t off) {
+    return off % FITS_CARD == 0 && !memcmp(p + off, "DATE    =", 9);
+}
+
+/* Compare the files, skipping the DATE cards. Returns the offset of
+   the first difference, or -1 if they are the same. */
+static long compare(const uint8_t *a, size_t alen, const uint8_t *b,
+		    size_t blen) {
+    size_t i, n = alen < blen ? alen : blen;
+
+    for (i = 0; i < n; i++) {
+	if (is_date(a, i) && is_date(b, i)) {
+	    i += FITS_CARD - 1;
+	    continue;
+	}
+	if (a[i] != b[i])
+	    return (long)i;
+    }
+    return alen == blen ? -1 : (long)n;
+}
+
+static int check(const case_t *c, int w) {
+    buffer_t buf;
+    uint8_t *cfitsio;
+    size_t cfitsio_len;
+    long off;
+
+    memset(&buf, 0, sizeof(buf));
+    if (!setup(c, &buf, w)) {
+	fprintf(stderr, "%s: cannot set up\n", c->name);
+	return 0;
+    }
+    image_w = w;
+    if (!output_init(1, native_size(file_w), 0)) {
+	fprintf(stderr, "%s: cannot allocate the output\n", c->name);
+	return 0;
+    }
+
+    dev->config.native_fits = 0;
+    write_fits(&buf);
+    cfitsio = written;
+    cfitsio_len = written_len;
+    written = NULL;
+    dev->config.native_fits = 1;
+    write_fits(&buf);
+
+    off = cfitsio && written ? compare(cfitsio, cfitsio_len, written,
+				       written_len) : 0;
+    if (off >= 0) {
+	fprintf(stderr, "%s, %d sweeps: %zu bytes with cfitsio, %zu "
+		"native, different from byte %ld\n", c->name, w,
+		cfitsio_len, written_len, off);
+	off -= off % FITS_CARD;
+	if (cfitsio && (size_t)off < cfitsio_len)
+	    fprintf(stderr, "cfitsio: %.80s\n", cfitsio + off);
+	if (written && (size_t)off < written_len)
+	    fprintf(stderr, "native:  %.80s\n", written + off);
+    }
+    free(cfitsio);
+    free(buf.data);
+    free(buf.sweep_times);
+    return off < 0;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t image[1 << 24];
+    static double times[1 << 20], freqs[MAX_CHANNELS];
+    const case_t *c;
+    int ok = 1, passed, w;
+
+    if (argc > 1)
+	state = strtoull(argv[1], NULL, 0) | 1;
+    image_buffer = image;
+    image_time = times;
+    image_freq = freqs;
+    transpose_init();
+
+    for (c = cases; c->name; c++) {
+	/* a whole file, and one cut short: */
+	w = c->filetime * c->samplerate / c->nchannels;
+	passed = check(c, w) && check(c, 1 + rnd(w));
+	printf("%s: %s\n", c->name, passed ? "ok" : "FAILED");
+	ok &= passed;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -10,52 +10,687 @@
 #include <limits.h>
 #include <fitsio.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include "conf.h"
 #include "util.h"
 #include "callisto.h"
+#include "buffer.h"
 #include "log.h"
+#include "transpose.h"
+#include "output.h"
+#include "device.h"
+#include "metrics.h"
+#include "trace.h"
 
-static int image_w = 0, image_h = 0;
-static uint8_t *image_buffer = NULL;
-static double *image_time = NULL, *image_freq = NULL;
+static int compression = 0; /* cfitsio compression type, or 0 */
 
-static int write_fits(int buf)	{
+/* Each writer thread has its own image buffers: */
+typedef struct {
+    pthread_t thread_id;
+    uint8_t *image_buffer;
+    double *image_time, *image_freq;
+} writer_t;
+static writer_t *writers = NULL;
+static int nwriters = 1;
+
+static __thread int image_w = 0;
+static __thread uint8_t *image_buffer = NULL;
+static __thread double *image_time = NULL, *image_freq = NULL;
+
+/* and the image size of the device being written, see fits_select(): */
+static __thread int image_h = 0;
+static __thread int file_w = 0; /* sweeps in a whole file */
+static __thread int sample_size = 1; /* bytes, 2 for 16-bit images */
+
+
+/* The native writer. The headers are formatted once by native_init()
+   the same way cfitsio formats them for write_fits() below, and only
+   the cards that change from file to file are rewritten. The file is
+   then written with a single writev(). */
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+#define MAX_CARDS 72 /* two blocks, the primary header needs 43 */
+#define MAX_VALUE 72
+
+typedef struct {
+    char *cards;
+    int n;
+    size_t len; /* in bytes, after header_end() */
+} header_t;
+
+static const uint8_t zeros[FITS_BLOCK];
+
+/* Streaming mode state, see below: */
+typedef struct {
+    int fd;
+    char name[PATH_MAX];
+    usec_t timestamp;
+    usec_t end;   /* of the last sweep written */
+    int w;        /* sweeps written */
+    unsigned seq; /* of the last buffer */
+    unsigned min, max;
+} stream_t;
+
+/* The FITS state of a device: */
+struct fits_device {
+    int image_h, file_w, sample_size;
+    header_t primary, table;
+    /* the cards rewritten for each file: */
+    char *card_naxis1, *card_date, *card_content, *card_date_obs,
+	*card_time_obs, *card_date_end, *card_time_end, *card_datamin,
+	*card_datamax, *card_crval1, *card_tnaxis1, *card_tform1;
+    /* table columns in big-endian byte order: */
+    uint8_t *table_time, *table_freq;
+    stream_t stream;
+    uint8_t *stream_row; /* for moving the rows */
+};
+/* that of dev: */
+static __thread struct fits_device *fdev = NULL;
+
+/* Make d the current device of this thread: */
+static void fits_select(device_t *d) {
+    dev = d;
+    fdev = d->fits;
+    image_h = fdev->image_h;
+    file_w = fdev->file_w;
+    sample_size = fdev->sample_size;
+}
+
+/* Format a card like cfitsio: non-string values right justified to
+   column 30, comments after a slash from column 32 or after the value,
+   truncated at 80 characters, and left out if not even one character
+   of them fits. */
+static void set_card(char *card, const char *key, const char *value,
+		     const char *comment) {
+    char s[3*FITS_CARD];
+    int n;
+
+    if (value[0] == '\'')
+	n = sprintf(s, "%-8.8s= %s", key, value);
+    else
+	n = sprintf(s, "%-8.8s= %20s", key, value);
+    if (comment && comment[0] && n < FITS_CARD - 3)
+	n += sprintf(s + n, "%*s / %.*s", n < 30 ? 30 - n : 0, "",
+		     FITS_CARD, comment);
+    if (n > FITS_CARD)
+	n = FITS_CARD;
+    memcpy(card, s, n);
+    memset(card + n, ' ', FITS_CARD - n);
+}
+
+static char *add_card(header_t *h, const char *key, const char *value,
+		      const char *comment) {
+    char *card = h->cards + FITS_CARD * h->n++;
+    set_card(card, key, value, comment);
+    return card;
+}
+
+static void add_comment(header_t *h, const char *text) {
+    char *card = h->cards + FITS_CARD * h->n++;
+    int n = snprintf(card, FITS_CARD + 1, "COMMENT %s", text);
+    if (n < FITS_CARD)
+	memset(card + n, ' ', FITS_CARD - n);
+}
+
+/* Add the END card. The cards are blank to begin with, so the rest
+   of the last block is padding. */
+static void header_end(header_t *h) {
+    memcpy(h->cards + FITS_CARD * h->n++, "END", 3);
+    h->len = (FITS_CARD * h->n + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+/* Value formatting, as cfitsio does it. Strings are cut at 68
+   characters, or where the quotes doubled reach that, and the closing
+   quote is lost if a doubled one takes its place: */
+static const char *str_value(char *v, const char *s) {
+    int i = 1, n = 0;
+
+    v[0] = '\'';
+    for (; s[n] && n < 68 && i < 69; n++, i++) {
+	v[i] = s[n];
+	if (s[n] == '\'')
+	    v[++i] = '\'';
+    }
+    while (i < 9) /* at least 8 characters */
+	v[i++] = ' ';
+    if (i == 70)
+	i--;
+    else
+	v[i++] = '\'';
+    v[i] = '\0';
+    return v;
+}
+
+static const char *double_value(char *v, double d) {
+    snprintf(v, MAX_VALUE, "%.15G", d);
+    /* always a decimal point, 1E+20 becomes 1.0E+20: */
+    if (!strchr(v, '.')) {
+	if (strchr(v, 'E'))
+	    snprintf(v, MAX_VALUE, "%.1E", d);
+	else if (isfinite(d))
+	    strcat(v, ".");
+    }
+    return v;
+}
+
+static const char *long_value(char *v, long l) {
+    snprintf(v, MAX_VALUE, "%ld", l);
+    return v;
+}
+
+static void put_double(uint8_t *p, double d) {
+    uint64_t u;
+    int i;
+
+    memcpy(&u, &d, sizeof(u));
+    for (i = 0; i < 8; i++)
+	p[i] = (uint8_t)(u >> (56 - 8*i));
+}
+
+/* The TIME column holds the start of each sweep, in seconds from the
+   first, by the sample clock of the device (see timing.h). These set
+   it up in big-endian order, for a whole file of nominal sweep times
+   from sweep x on, or for w sweeps of buf starting at x: */
+static void nominal_times(int x) {
+    double dt = 1.0 / ((double)dev->config.samplerate
+		       / (double)dev->config.nchannels);
+
+    for (; x < file_w; x++)
+	put_double(fdev->table_time + 8*x, x * dt);
+}
+
+static void put_times(uint8_t *p, const buffer_t *buf, int w,
+		      usec_t start) {
+    int x;
+
+    for (x = 0; x < w; x++)
+	put_double(p + 8*x, (buf->sweep_times[x] - start) / 1e6);
+}
+
+/* The FREQUENCY column, from the top channel down like the image.
+   Set for each file, as the frequencies are only known once they have
+   been read from the device, after native_init(): */
+static void put_freqs() {
+    int x;
+
+    for (x = 0; x < image_h; x++)
+	put_double(fdev->table_freq + 8*(image_h-1-x), dev->channels[x].f);
+}
+
+static int native_init() {
+    header_t *primary = &fdev->primary, *table = &fdev->table;
+    char v[MAX_VALUE], s[MAX_VALUE];
+    double dt = 1.0 / ((double)dev->config.samplerate
+		       / (double)dev->config.nchannels);
+    double d;
+
+    primary->cards = (char*)malloc(MAX_CARDS * FITS_CARD);
+    table->cards = (char*)malloc(MAX_CARDS * FITS_CARD);
+    fdev->table_time = (uint8_t*)malloc(8 * file_w);
+    fdev->table_freq = (uint8_t*)malloc(8 * image_h);
+    if (!primary->cards || !table->cards
+	|| !fdev->table_time || !fdev->table_freq)
+	return 0;
+    memset(primary->cards, ' ', MAX_CARDS * FITS_CARD);
+    memset(table->cards, ' ', MAX_CARDS * FITS_CARD);
+
+    /* fits_create_img(): */
+    add_card(primary, "SIMPLE", "T", "file does conform to FITS standard");
+    add_card(primary, "BITPIX", sample_size == 2 ? "16" : "8",
+	     "number of bits per data pixel");
+    add_card(primary, "NAXIS", "2", "number of data axes");
+    fdev->card_naxis1 = add_card(primary, "NAXIS1", long_value(v, file_w),
+			   "length of data axis 1");
+    add_card(primary, "NAXIS2", long_value(v, image_h),
+	     "length of data axis 2");
+    add_card(primary, "EXTEND", "T", "FITS dataset may contain extensions");
+    add_comment(primary, "  FITS (Flexible Image Transport System) format "
+		"is defined in 'Astronomy");
+    add_comment(primary, "  and Astrophysics', volume 376, page 359; "
+		"bibcode: 2001A&A...376..359H");
+    /* unsigned 16-bit images get the scaling keys here, and
+       write_fits() only updates them: */
+    if (sample_size == 2) {
+	add_card(primary, "BZERO", double_value(v, 32768.0),
+		 "scaling offset");
+	add_card(primary, "BSCALE", double_value(v, 1.0), "scaling factor");
+    }
+
+    /* the keys of write_fits(), in the same order: */
+    add_comment(primary, " File created by e-Callisto for Unix version "
+		PACKAGE_VERSION);
+    fdev->card_date = add_card(primary, "DATE", "", NULL);
+    fdev->card_content = add_card(primary, "CONTENT", "", NULL);
+    add_card(primary, "ORIGIN", str_value(v, dev->config.origin),
+	     "Organization name");
+    add_card(primary, "TELESCOP", str_value(v, "Radio Spectrometer"),
+	     "Type of instrument");
+    add_card(primary, "INSTRUME", str_value(v, dev->config.instrument),
+	     "Name of the spectrometer");
+    add_card(primary, "OBJECT", str_value(v, "Sun"), "object description");
+    fdev->card_date_obs = add_card(primary, "DATE-OBS", "", NULL);
+    fdev->card_time_obs = add_card(primary, "TIME-OBS", "", NULL);
+    fdev->card_date_end = add_card(primary, "DATE-END", "", NULL);
+    fdev->card_time_end = add_card(primary, "TIME-END", "", NULL);
+    if (sample_size == 1) {
+	add_card(primary, "BZERO", double_value(v, 0.0), "scaling offset");
+	add_card(primary, "BSCALE", double_value(v, 1.0), "scaling factor");
+    }
+    add_card(primary, "BUNIT", str_value(v, "digits"), "z-axis title");
+    fdev->card_datamin = add_card(primary, "DATAMIN", "", NULL);
+    fdev->card_datamax = add_card(primary, "DATAMAX", "", NULL);
+    fdev->card_crval1 = add_card(primary, "CRVAL1", "", NULL);
+    add_card(primary, "CRPIX1", long_value(v, 0),
+	     "reference pixel of axis 1");
+    add_card(primary, "CTYPE1", str_value(v, "Time [UT]"),
+	     "title of axis 1");
+    add_card(primary, "CDELT1", double_value(v, dt),
+	     "step between first and second element in x-axis [sec]");
+    add_card(primary, "CRVAL2", double_value(v, (double)dev->config.nchannels),
+	     "value on axis 2 at the reference pixel");
+    add_card(primary, "CRPIX2", long_value(v, 0),
+	     "reference pixel of axis 2");
+    add_card(primary, "CTYPE2", str_value(v, "Frequency [MHz]"),
+	     "title of axis 2");
+    add_card(primary, "CDELT2", double_value(v, -1.0),
+	     "step between first and second element in y-axis");
+    add_comment(primary, " Warning: the value of CDELT1 may be rounded!");
+    add_comment(primary, " Warning: the frequency axis may not be regular!");
+    add_comment(primary, " Warning: the value of CDELT2 may be rounded!");
+    add_card(primary, "OBS_LAT", double_value(v, fabs(dev->config.obs_lat)),
+	     "observatory latitude in degree");
+    sprintf(s, "%c", dev->config.obs_lat < 0.0 ? 'S' : 'N');
+    add_card(primary, "OBS_LAC", str_value(v, s),
+	     "observatory latitude code {N,S}");
+    add_card(primary, "OBS_LON", double_value(v, fabs(dev->config.obs_long)),
+	     "observatory longitude in degree");
+    sprintf(s, "%c", dev->config.obs_long < 0.0 ? 'W' : 'E');
+    add_card(primary, "OBS_LOC", str_value(v, s),
+	     "observatory longitude code {E,W}");
+    add_card(primary, "OBS_ALT", double_value(v, dev->config.obs_height),
+	     "observatory altitude in meter asl");
+    add_card(primary, "FRQFILE", str_value(v, dev->config.channelfile),
+	     "name of frequency file");
+    add_card(primary, "PWM_VAL", long_value(v, dev->config.agclevel),
+	     "PWM value to control tuner gain");
+
+    /* fits_create_tbl() and the scaling keys, NAXIS2 is as updated
+       by cfitsio after writing the row: */
+    add_card(table, "XTENSION", str_value(v, "BINTABLE"),
+	     "binary table extension");
+    add_card(table, "BITPIX", "8", "8-bit bytes");
+    add_card(table, "NAXIS", "2", "2-dimensional binary table");
+    fdev->card_tnaxis1 = add_card(table, "NAXIS1", "", NULL);
+    add_card(table, "NAXIS2", "1", "number of rows in table");
+    add_card(table, "PCOUNT", "0", "size of special data area");
+    add_card(table, "GCOUNT", "1", "one data group (required keyword)");
+    add_card(table, "TFIELDS", "2", "number of fields in each row");
+    add_card(table, "TTYPE1", str_value(v, "TIME"), "label for field   1");
+    fdev->card_tform1 = add_card(table, "TFORM1", "", NULL);
+    add_card(table, "TTYPE2", str_value(v, "FREQUENCY"),
+	     "label for field   2");
+    sprintf(s, "%dD8.3", image_h);
+    add_card(table, "TFORM2", str_value(v, s),
+	     "data format of field: 8-byte DOUBLE");
+    d = 1.0;
+    add_card(table, "TSCAL1", double_value(v, d), NULL);
+    add_card(table, "TSCAL2", double_value(v, d), NULL);
+    d = 0.0;
+    add_card(table, "TZERO1", double_value(v, d), NULL);
+    add_card(table, "TZERO2", double_value(v, d), NULL);
+
+    header_end(primary);
+    header_end(table);
+
+    nominal_times(0);
+
+    return 1;
+}
+
+/* Write all of iov at offset off, continuing after partial writes: */
+static int writev_all(int fd, struct iovec *iov, int n, off_t off) {
+    while (n > 0) {
+	ssize_t l = pwritev(fd, iov, n, off);
+	if (l < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	off += l;
+	for (; n > 0 && (size_t)l >= iov->iov_len; iov++, n--)
+	    l -= iov->iov_len;
+	if (n > 0) {
+	    iov->iov_base = (char*)iov->iov_base + l;
+	    iov->iov_len -= l;
+	}
+    }
+    return 1;
+}
+
+static void fits_times(usec_t timestamp, int w, struct tm *t, struct tm *et) {
+    time_t ut;
+    usec_t ets;
+
+    ut = timestamp / 1000000;
+    gmtime_r(&ut, t);
+    ets = timestamp
+	  + 1000000 * (usec_t)(w*image_h) / (usec_t)dev->config.samplerate;
+    ut = ets / 1000000;
+    gmtime_r(&ut, et);
+}
+
+static void fits_filename(char *s, size_t n, const struct tm *t) {
+    snprintf(s, n, "%s/%s_%04u%02u%02u_%02u%02u%02u_%02u.fit",
+	     dev->config.datadir, dev->config.instrument,
+	     t->tm_year+1900, t->tm_mon+1, t->tm_mday,
+	     t->tm_hour, t->tm_min, t->tm_sec,
+	     dev->config.focuscode);
+}
+
+/* Rewrite the cards that change from file to file, for a file of w
+   sweeps starting at timestamp: */
+static void native_cards(usec_t timestamp, int w,
+			 long minvalue, long maxvalue) {
+    char v[MAX_VALUE], s[MAX_VALUE];
+    struct tm tm, etm, *t = &tm, *et = &etm;
+    size_t table_len = (size_t)8 * (w + image_h);
+
+    fits_times(timestamp, w, t, et);
+
+    set_card(fdev->card_naxis1, "NAXIS1", long_value(v, w),
+	     "length of data axis 1");
+    sprintf(s, "%04u-%02u-%02u", t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+    set_card(fdev->card_date, "DATE", str_value(v, s), "Time of observation");
+    snprintf(s, MAX_VALUE, "%04u/%02u/%02u  Radio flux density, "
+	     "e-CALLISTO (%s)",
+	     t->tm_year+1900, t->tm_mon+1, t->tm_mday, dev->config.instrument);
+    set_card(fdev->card_content, "CONTENT", str_value(v, s), "Title of image");
+    sprintf(s, "%04u/%02u/%02u", t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+    set_card(fdev->card_date_obs, "DATE-OBS", str_value(v, s),
+	     "Date observation starts");
+    sprintf(s, "%02u:%02u:%02u.%03u", t->tm_hour, t->tm_min, t->tm_sec,
+	    (unsigned)((timestamp / 1000) % 1000));
+    set_card(fdev->card_time_obs, "TIME-OBS", str_value(v, s),
+	     "Time observation starts");
+    sprintf(s, "%04u/%02u/%02u",
+	    et->tm_year+1900, et->tm_mon+1, et->tm_mday);
+    set_card(fdev->card_date_end, "DATE-END", str_value(v, s),
+	     "date observation ends");
+    sprintf(s, "%02u:%02u:%02u", et->tm_hour, et->tm_min, et->tm_sec);
+    set_card(fdev->card_time_end, "TIME-END", str_value(v, s),
+	     "time observation ends");
+    set_card(fdev->card_datamin, "DATAMIN", long_value(v, minvalue),
+	     "minimum element in image");
+    set_card(fdev->card_datamax, "DATAMAX", long_value(v, maxvalue),
+	     "maximum element in image");
+    set_card(fdev->card_crval1, "CRVAL1",
+	     double_value(v, 3600.0*t->tm_hour + 60.0*t->tm_min
+			  + 1.0*t->tm_sec),
+	     "value on axis 1 at reference pixel [sec of day]");
+    set_card(fdev->card_tnaxis1, "NAXIS1", long_value(v, (long)table_len),
+	     "width of table in bytes");
+    sprintf(s, "%dD8.3", w);
+    set_card(fdev->card_tform1, "TFORM1", str_value(v, s),
+	     "data format of field: 8-byte DOUBLE");
+}
+
+/* The GTI extension lists the good time intervals of a file, the
+   times between the gaps in its data (see gaps.h), in seconds from the
+   first sweep like TIME, and the number of sweeps lost in the gaps.
+   The rows of a native file fit in one block: */
+#define MAX_GTI (FITS_BLOCK / 16)
+#define GTI_LEN (2 * FITS_BLOCK)
+
+/* The intervals from start to end, returns the number of rows: */
+static int gti_intervals(usec_t start, usec_t end, double *t_start,
+			 double *t_stop, long *lost) {
+    gap_t gap[MAX_GTI - 1], g;
+    usec_t t = start;
+    int i, j, n = 0, ngaps;
+
+    ngaps = gaps_find(&dev->gaps, start, end, gap, MAX_GTI - 1);
+    /* by start time, they are recorded when they end: */
+    for (i = 1; i < ngaps; i++)
+	for (j = i; j > 0 && gap[j-1].start > gap[j].start; j--) {
+	    g = gap[j];
+	    gap[j] = gap[j-1];
+	    gap[j-1] = g;
+	}
+
+    *lost = 0;
+    for (i = 0; i < ngaps; i++) {
+	*lost += gap[i].sweeps;
+	if (gap[i].start > t) {
+	    t_start[n] = (t - start) / 1e6;
+	    t_stop[n++] = (gap[i].start - start) / 1e6;
+	}
+	if (gap[i].end > t)
+	    t = gap[i].end;
+    }
+    if (t < end) {
+	t_start[n] = (t - start) / 1e6;
+	t_stop[n++] = (end - start) / 1e6;
+    }
+    return n;
+}
+
+/* Format the GTI extension, header and data, into p (GTI_LEN): */
+static void native_gti(uint8_t *p, usec_t start, usec_t end) {
+    double t_start[MAX_GTI], t_stop[MAX_GTI];
+    char v[MAX_VALUE];
+    header_t h;
+    long lost;
+    int i, n = gti_intervals(start, end, t_start, t_stop, &lost);
+
+    memset(p, ' ', FITS_BLOCK);
+    memset(p + FITS_BLOCK, 0, FITS_BLOCK);
+    h.cards = (char*)p;
+    h.n = 0;
+    add_card(&h, "XTENSION", str_value(v, "BINTABLE"),
+	     "binary table extension");
+    add_card(&h, "BITPIX", "8", "8-bit bytes");
+    add_card(&h, "NAXIS", "2", "2-dimensional binary table");
+    add_card(&h, "NAXIS1", "16", "width of table in bytes");
+    add_card(&h, "NAXIS2", long_value(v, n), "number of rows in table");
+    add_card(&h, "PCOUNT", "0", "size of special data area");
+    add_card(&h, "GCOUNT", "1", "one data group (required keyword)");
+    add_card(&h, "TFIELDS", "2", "number of fields in each row");
+    add_card(&h, "TTYPE1", str_value(v, "START"), "label for field   1");
+    add_card(&h, "TFORM1", str_value(v, "1D"),
+	     "data format of field: 8-byte DOUBLE");
+    add_card(&h, "TUNIT1", str_value(v, "s"), "physical unit of field");
+    add_card(&h, "TTYPE2", str_value(v, "STOP"), "label for field   2");
+    add_card(&h, "TFORM2", str_value(v, "1D"),
+	     "data format of field: 8-byte DOUBLE");
+    add_card(&h, "TUNIT2", str_value(v, "s"), "physical unit of field");
+    add_card(&h, "EXTNAME", str_value(v, "GTI"),
+	     "name of this binary table extension");
+    add_card(&h, "HDUCLAS1", str_value(v, "GTI"), "good time intervals");
+    add_card(&h, "LOSTSWP", long_value(v, lost), "sweeps lost in gaps");
+    header_end(&h);
+
+    for (i = 0; i < n; i++) {
+	put_double(p + FITS_BLOCK + 16*i, t_start[i]);
+	put_double(p + FITS_BLOCK + 16*i + 8, t_stop[i]);
+    }
+}
+
+/* The padding after an image of w sweeps, the table extension with
+   the TIME column times and the GTI extension, for writing after the
+   image. Returns the number of iovecs used. */
+static int native_tail(struct iovec *iov, int w, const uint8_t *times,
+		       const uint8_t *gti) {
+    size_t image_len = (size_t)w * image_h * sample_size;
+    size_t table_len = (size_t)8 * (w + image_h);
+
+    iov[0].iov_base = (void*)zeros;
+    iov[0].iov_len = (FITS_BLOCK - image_len % FITS_BLOCK) % FITS_BLOCK;
+    iov[1].iov_base = fdev->table.cards;
+    iov[1].iov_len = fdev->table.len;
+    iov[2].iov_base = (void*)times;
+    iov[2].iov_len = (size_t)8 * w;
+    iov[3].iov_base = fdev->table_freq;
+    iov[3].iov_len = (size_t)8 * image_h;
+    iov[4].iov_base = (void*)zeros;
+    iov[4].iov_len = (FITS_BLOCK - table_len % FITS_BLOCK) % FITS_BLOCK;
+    iov[5].iov_base = (void*)gti;
+    iov[5].iov_len = GTI_LEN;
+    return 6;
+}
+
+/* Transpose and flip w sweeps of either sample size into an image: */
+static void image_flip(const uint8_t *src, int w, uint8_t *dst,
+		       unsigned *min, unsigned *max) {
+    usec_t start = trace_start();
+
+    if (sample_size == 2) {
+	uint16_t mn, mx;
+	transpose16_flip((const uint16_t*)src, w, image_h, (uint16_t*)dst,
+			 &mn, &mx);
+	*min = mn;
+	*max = mx;
+    } else {
+	uint8_t mn, mx;
+	transpose_flip(src, w, image_h, dst, &mn, &mx);
+	*min = mn;
+	*max = mx;
+    }
+    trace_stage(TRACE_TRANSPOSE, start);
+}
+
+/* 16-bit FITS data is signed big-endian, the unsigned samples are
+   offset by BZERO (32768). Converted in place, n samples: */
+static void image_to_fits(uint8_t *p, size_t n) {
+    const uint16_t *q = (const uint16_t*)p;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	unsigned v = q[i] ^ 0x8000;
+	p[2*i] = v >> 8;
+	p[2*i+1] = v & 0xff;
+    }
+}
+
+/* Size of a whole native file of w sweeps: */
+static size_t native_size(int w) {
+    struct iovec iov[6];
+    size_t len = fdev->primary.len + (size_t)w * image_h * sample_size;
+    int i;
+
+    for (i = native_tail(iov, w, fdev->table_time, NULL) - 1; i >= 0; i--)
+	len += iov[i].iov_len;
+    return len;
+}
+
+/* Offset of the TIME column in a native file of w sweeps: */
+static off_t table_time_offset(int w) {
+    struct iovec iov[6];
+
+    native_tail(iov, w, fdev->table_time, NULL);
+    return fdev->primary.len + (off_t)w * image_h * sample_size
+	+ iov[0].iov_len + iov[1].iov_len;
+}
+
+/* The file is assembled in an output buffer, with the image
+   transposed straight into it, and written in the background. */
+static int write_fits_native(buffer_t *buf) {
+    output_file_t *f = output_get();
+    struct tm t, et;
+    struct iovec iov[6];
+    uint8_t *p = f->data, *times = (uint8_t*)image_time, gti[GTI_LEN];
+    unsigned minsample, maxsample;
+    int i, n;
+
+    fits_times(buf->timestamp, image_w, &t, &et);
+    fits_filename(f->name, sizeof(f->name), &t);
+
+    if (debug)
+	logprintf(LOG_DEBUG, "Writing FITS file %s", f->name);
+
+    image_flip(buf->data, image_w, p + fdev->primary.len,
+	       &minsample, &maxsample);
+    if (sample_size == 2)
+	image_to_fits(p + fdev->primary.len, (size_t)image_w * image_h);
+    native_cards(buf->timestamp, image_w, minsample, maxsample);
+
+    memcpy(p, fdev->primary.cards, fdev->primary.len);
+    p += fdev->primary.len + (size_t)image_w * image_h * sample_size;
+    put_times(times, buf, image_w, buf->timestamp);
+    put_freqs();
+    native_gti(gti, buf->timestamp,
+	       buf->sweep_times[image_w-1] + (usec_t)dev->gaps.sweep_len);
+    n = native_tail(iov, image_w, times, gti);
+    for (i = 0; i < n; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+    f->len = p - f->data;
+
+    output_submit(f);
+    return 1;
+}
+
+
+static int write_fits(buffer_t *buf)	{
     char s[PATH_MAX];
     long naxes[2] = { image_w, image_h };
-    long minvalue = 255, maxvalue = 0, l;
+    long minvalue, maxvalue, l;
+    unsigned minsample, maxsample;
     double d;
     int status = 0;
     fitsfile *fptr;
+    LONGLONG end = 0;
     struct tm t, et;
-    time_t ut;
-    usec_t ets;
-    int x, y;
+    output_file_t *f;
+    void *mem;
+    size_t size;
+    int x, n;
     char* tType[2] = { "TIME", "FREQUENCY" };
+    char *gti_type[2] = { "START", "STOP" };
+    char *gti_form[2] = { "1D", "1D" };
+    char *gti_unit[2] = { "s", "s" };
+    double gti_start[MAX_GTI], gti_stop[MAX_GTI];
+    long lost;
     char tForm_0[32], tForm_1[32];
     char* tForm[2] = { tForm_0, tForm_1 };
-    double dt = 1.0 / ((double)config.samplerate / (double)config.nchannels);
+    double dt = 1.0 / ((double)dev->config.samplerate
+		       / (double)dev->config.nchannels);
     char errstr[FLEN_STATUS];
     
-    ut = buffer[buf].timestamp / 1000000;
-    gmtime_r(&ut, &t);
-    ets = buffer[buf].timestamp
-	  + 1000000 * (usec_t)(image_w*image_h) / (usec_t)config.samplerate;
-    ut = ets / 1000000;
-    gmtime_r(&ut, &et);
+    if (dev->config.native_fits)
+	return write_fits_native(buf);
 
-    snprintf(s, PATH_MAX, "!%s/%s_%04u%02u%02u_%02u%02u%02u_%02u.fit",
-	     config.datadir, config.instrument,
-	     t.tm_year+1900, t.tm_mon+1, t.tm_mday,
-	     t.tm_hour, t.tm_min, t.tm_sec,
-	     config.focuscode);
+    /* CFITSIO writes the file into an output buffer, growing it if a
+       compressed file does not fit, and the output thread writes it out
+       like a native one: */
+    f = output_get();
+    fits_times(buf->timestamp, image_w, &t, &et);
+    fits_filename(f->name, sizeof(f->name), &t);
 
     if (debug)
-	logprintf(LOG_DEBUG, "Writing FITS file %s", s+1);
-    
-    fits_create_file(&fptr, s, &status);
+	logprintf(LOG_DEBUG, "Writing FITS file %s", f->name);
+
+    /* FITS image is transposed and vertically mirrored, find min
+       and max pixels on the way: */
+    image_flip(buf->data, image_w, image_buffer, &minsample, &maxsample);
+    minvalue = minsample;
+    maxvalue = maxsample;
+
+    mem = f->data;
+    size = f->size;
+    fits_create_memfile(&fptr, &mem, &size, FITS_BLOCK * 64, realloc,
+			&status);
+
+    /* the image is compressed in tiles of one row (frequency): */
+    if (compression)
+	fits_set_compression_type(fptr, compression, &status);
     
-    fits_create_img(fptr, BYTE_IMG, 2, naxes, &status);
+    fits_create_img(fptr, sample_size == 2 ? USHORT_IMG : BYTE_IMG, 2, naxes,
+		    &status);
 
     fits_write_comment(fptr, " File created by e-Callisto for Unix version "
 		       PACKAGE_VERSION, &status);
@@ -64,15 +699,15 @@ static int write_fits(int buf)	{
     fits_update_key(fptr, TSTRING, "DATE", s, "Time of observation",
 		    &status);
     sprintf(s, "%04u/%02u/%02u  Radio flux density, e-CALLISTO (%s)",
-	    t.tm_year+1900, t.tm_mon+1, t.tm_mday, config.instrument);
+	    t.tm_year+1900, t.tm_mon+1, t.tm_mday, dev->config.instrument);
     fits_update_key(fptr, TSTRING, "CONTENT", s, "Title of image",
 		    &status);
 
-    fits_update_key(fptr, TSTRING, "ORIGIN", (char*)config.origin,
+    fits_update_key(fptr, TSTRING, "ORIGIN", (char*)dev->config.origin,
 		    "Organization name", &status);
     fits_update_key(fptr, TSTRING, "TELESCOP", "Radio Spectrometer",
 		    "Type of instrument", &status);
-    fits_update_key(fptr, TSTRING, "INSTRUME", (char*)config.instrument,
+    fits_update_key(fptr, TSTRING, "INSTRUME", (char*)dev->config.instrument,
 		    "Name of the spectrometer", &status);
     fits_update_key(fptr, TSTRING, "OBJECT", "Sun",
 		    "object description", &status);
@@ -82,7 +717,7 @@ static int write_fits(int buf)	{
     fits_update_key(fptr, TSTRING, "DATE-OBS", s,
 		    "Date observation starts", &status);
     sprintf(s, "%02u:%02u:%02u.%03u", t.tm_hour, t.tm_min, t.tm_sec,
-	    (unsigned)((buffer[buf].timestamp / 1000) % 1000));
+	    (unsigned)((buf->timestamp / 1000) % 1000));
     fits_update_key(fptr, TSTRING, "TIME-OBS", s,
 		    "Time observation starts", &status);
 
@@ -94,21 +729,7 @@ static int write_fits(int buf)	{
     fits_update_key(fptr, TSTRING, "TIME-END", s,
 		    "time observation ends", &status);
 
-    /* FITS image is transposed and vertically mirrored: */
-    for (x = 0; x < image_w; x++)
-	for (y = 0; y < image_h; y++)
-	    image_buffer[y*image_w + x]
-		= buffer[buf].data[x*image_h + image_h-1-y];
-
-    /* find min and max pixels: */
-    for (x = 0; x < image_w*image_h; x++) {
-	if (image_buffer[x] > maxvalue)
-	    maxvalue = image_buffer[x];
-	if (image_buffer[x] < minvalue)
-	    minvalue = image_buffer[x];
-    }
-
-    d = 0.0;
+    d = sample_size == 2 ? 32768.0 : 0.0;
     fits_update_key(fptr, TDOUBLE, "BZERO", &d, "scaling offset", &status);
     d = 1.0;
     fits_update_key(fptr, TDOUBLE, "BSCALE", &d, "scaling factor", &status);
@@ -133,7 +754,7 @@ static int write_fits(int buf)	{
 		    "step between first and second element in x-axis [sec]",
 		    &status);
 
-    d = (double)config.nchannels;
+    d = (double)dev->config.nchannels;
     fits_update_key(fptr, TDOUBLE, "CRVAL2", &d,
 		    "value on axis 2 at the reference pixel", &status);
     l = 0;
@@ -153,30 +774,31 @@ static int write_fits(int buf)	{
 		       &status);
 
 
-    d = fabs(config.obs_lat);
+    d = fabs(dev->config.obs_lat);
     fits_update_key(fptr, TDOUBLE, "OBS_LAT", &d,
 		    "observatory latitude in degree", &status);
-    sprintf(s,"%c", config.obs_lat < 0.0 ? 'S' : 'N');
+    sprintf(s,"%c", dev->config.obs_lat < 0.0 ? 'S' : 'N');
     fits_update_key(fptr, TSTRING, "OBS_LAC", s,
 		    "observatory latitude code {N,S}", &status);
-    d = fabs(config.obs_long);
+    d = fabs(dev->config.obs_long);
     fits_update_key(fptr, TDOUBLE, "OBS_LON", &d,
 		    "observatory longitude in degree", &status);
-    sprintf(s,"%c", config.obs_long < 0.0 ? 'W' : 'E');
+    sprintf(s,"%c", dev->config.obs_long < 0.0 ? 'W' : 'E');
     fits_update_key(fptr, TSTRING, "OBS_LOC", s,
 		    "observatory longitude code {E,W}", &status);
-    fits_update_key(fptr, TDOUBLE, "OBS_ALT", &config.obs_height,
+    fits_update_key(fptr, TDOUBLE, "OBS_ALT", &dev->config.obs_height,
 		    "observatory altitude in meter asl", &status);
 
-    fits_update_key(fptr, TSTRING, "FRQFILE", (char*)config.channelfile,
+    fits_update_key(fptr, TSTRING, "FRQFILE", (char*)dev->config.channelfile,
 		    "name of frequency file" , &status);
-    l = config.agclevel;
+    l = dev->config.agclevel;
     fits_update_key(fptr, TLONG, "PWM_VAL", &l,
 		    "PWM value to control tuner gain", &status);
 
     /* fits_update_key(fptr, TSTRING, "HISTORY", "", "", &status); */
 
-    fits_write_img(fptr, TBYTE, 1, image_w*image_h, image_buffer, &status);
+    fits_write_img(fptr, sample_size == 2 ? TUSHORT : TBYTE, 1,
+		   image_w*image_h, image_buffer, &status);
 
 
     sprintf(tForm[0],"%dD8.3", image_w);
@@ -193,73 +815,406 @@ static int write_fits(int buf)	{
 
 
     for (x = 0; x < image_w; x++)
-	image_time[x] = x * dt;
+	image_time[x] = (buf->sweep_times[x] - buf->timestamp) / 1e6;
     fits_write_col(fptr, TDOUBLE, 1, 1, 1, image_w, image_time, &status);
 
     for (x = 0; x < image_h; x++)
-	image_freq[image_h-1-x] = channels[x].f;
+	image_freq[image_h-1-x] = dev->channels[x].f;
     fits_write_col(fptr, TDOUBLE, 2, 1, 1, image_h, image_freq, &status);
 
+    n = gti_intervals(buf->timestamp, buf->sweep_times[image_w-1]
+		      + (usec_t)dev->gaps.sweep_len, gti_start, gti_stop,
+		      &lost);
+    fits_create_tbl(fptr, BINARY_TBL, 0, 2, gti_type, gti_form, gti_unit,
+		    "GTI", &status);
+    fits_write_key(fptr, TSTRING, "HDUCLAS1", "GTI", "good time intervals",
+		   &status);
+    fits_write_key(fptr, TLONG, "LOSTSWP", &lost, "sweeps lost in gaps",
+		   &status);
+    fits_write_col(fptr, TDOUBLE, 1, 1, 1, n, gti_start, &status);
+    fits_write_col(fptr, TDOUBLE, 2, 1, 1, n, gti_stop, &status);
+
+    /* the end of the last HDU is the length of the file: */
+    fits_flush_file(fptr, &status);
+    fits_get_hduaddrll(fptr, NULL, NULL, &end, &status);
     fits_close_file(fptr, &status);
+    f->data = (uint8_t*)mem;
+    f->size = size;
+    f->len = end;
 
     if (status != 0) {
 	fits_get_errstatus(status, errstr);
 	logprintf(LOG_ERR, "FITS write failed: %s", errstr);
-    }
+	output_abort(f);
+    } else
+	output_submit(f);
 
     return (status == 0);
 }
 
 
 
-static pthread_t thread_id;
-static void *fitswriter(void *dummy) {
-    (void)dummy;
+/* Streaming mode. A file is created when its first buffer arrives,
+   with room for a whole filetime of sweeps and the table written after
+   it, so that it is a valid FITS file all the time. Each buffer is
+   then written into the image columns, and DATAMIN/DATAMAX updated.
+   If the file ends early, the image rows are moved together to the
+   actual width when it is closed. */
+
+static int pwrite_all(int fd, const void *p, size_t n, off_t off) {
+    struct iovec iov;
+
+    iov.iov_base = (void*)p;
+    iov.iov_len = n;
+    return writev_all(fd, &iov, 1, off);
+}
+
+static void stream_failed() {
+    stream_t *stream = &fdev->stream;
+    logprintf(LOG_ERR, "FITS write failed: %s: %s", stream->name,
+	      strerror(errno));
+    close(stream->fd);
+    stream->fd = -1;
+}
+
+static int stream_open(buffer_t *buf) {
+    stream_t *stream = &fdev->stream;
+    struct tm t, et;
+    struct iovec iov[6];
+    uint8_t gti[GTI_LEN];
+
+    fits_times(buf->timestamp, 0, &t, &et);
+    fits_filename(stream->name, sizeof(stream->name), &t);
+    if (debug)
+	logprintf(LOG_DEBUG, "Writing FITS file %s", stream->name);
+
+    stream->fd = open(stream->name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (stream->fd < 0) {
+	logprintf(LOG_ERR, "FITS write failed: %s: %s", stream->name,
+		  strerror(errno));
+	return 0;
+    }
+    stream->timestamp = buf->timestamp;
+    stream->end = buf->timestamp
+	+ (usec_t)(file_w * dev->gaps.sweep_len);
+    stream->w = 0;
+    stream->min = 0xffff;
+    stream->max = 0;
+
+    /* the image is left as a hole, to be filled in, and the times
+       as they arrive: */
+    native_cards(stream->timestamp, file_w, 0, 0);
+    nominal_times(0);
+    put_freqs();
+    native_gti(gti, stream->timestamp, stream->end);
+    if (!output_preallocate(stream->fd, native_size(file_w))
+	|| !pwrite_all(stream->fd, fdev->primary.cards, fdev->primary.len, 0)
+	|| !writev_all(stream->fd, iov,
+		       native_tail(iov, file_w, fdev->table_time, gti),
+		       fdev->primary.len
+		       + (off_t)file_w * image_h * sample_size)) {
+	stream_failed();
+	return 0;
+    }
+    return 1;
+}
+
+static void stream_append(buffer_t *buf) {
+    stream_t *stream = &fdev->stream;
+    int w = buf->size / image_h, y;
+    size_t row;
+    unsigned minsample, maxsample;
+
+    if (w > file_w - stream->w)
+	w = file_w - stream->w;
+    if (w <= 0)
+	return;
+
+    /* the image columns, one row at a time: */
+    image_flip(buf->data, w, image_buffer, &minsample, &maxsample);
+    if (sample_size == 2)
+	image_to_fits(image_buffer, (size_t)w * image_h);
+    row = (size_t)w * sample_size;
+    for (y = 0; y < image_h; y++)
+	if (!pwrite_all(stream->fd, image_buffer + y*row, row,
+			fdev->primary.len
+			+ ((off_t)y*file_w + stream->w) * sample_size)) {
+	    stream_failed();
+	    return;
+	}
+    put_times(fdev->table_time + 8*stream->w, buf, w, stream->timestamp);
+    if (!pwrite_all(stream->fd, fdev->table_time + 8*stream->w, 8*w,
+		    table_time_offset(file_w) + 8*stream->w)) {
+	stream_failed();
+	return;
+    }
+    stream->w += w;
+    stream->end = buf->sweep_times[w-1] + (usec_t)dev->gaps.sweep_len;
+    if (minsample < stream->min)
+	stream->min = minsample;
+    if (maxsample > stream->max)
+	stream->max = maxsample;
+
+    native_cards(stream->timestamp, file_w, stream->min, stream->max);
+    if (!pwrite_all(stream->fd, fdev->primary.cards, fdev->primary.len, 0))
+	stream_failed();
+}
+
+static void stream_close() {
+    stream_t *stream = &fdev->stream;
+    struct iovec iov[6];
+    uint8_t gti[GTI_LEN];
+    usec_t start = get_monotonic_usecs(), trace = trace_start();
+    off_t end = native_size(file_w);
+    int w = stream->w, y, n;
+    ssize_t row = (ssize_t)w * sample_size;
+
+    if (w == 0) { /* no whole sweeps */
+	close(stream->fd);
+	stream->fd = -1;
+	unlink(stream->name);
+	return;
+    }
+
+    native_cards(stream->timestamp, w, stream->min, stream->max);
+    native_gti(gti, stream->timestamp, stream->end);
+
+    if (w < file_w) {
+	for (y = 1; y < image_h; y++)
+	    if (pread(stream->fd, fdev->stream_row, row,
+		      fdev->primary.len + (off_t)y*file_w*sample_size) != row
+		|| !pwrite_all(stream->fd, fdev->stream_row, row,
+			       fdev->primary.len + (off_t)y*row)) {
+		stream_failed();
+		return;
+	    }
+	end = fdev->primary.len + (off_t)row * image_h;
+	n = native_tail(iov, w, fdev->table_time, gti);
+	if (!writev_all(stream->fd, iov, n, end)) {
+	    stream_failed();
+	    return;
+	}
+	for (y = 0; y < n; y++)
+	    end += iov[y].iov_len;
+	if (ftruncate(stream->fd, end)) {
+	    stream_failed();
+	    return;
+	}
+    } else if (!pwrite_all(stream->fd, gti, GTI_LEN,
+			   native_size(file_w) - GTI_LEN)) {
+	stream_failed();
+	return;
+    }
+
+    if (!pwrite_all(stream->fd, fdev->primary.cards, fdev->primary.len, 0)
+	|| (dev->config.fits_fsync > 0 && fsync(stream->fd))) {
+	stream_failed();
+	return;
+    }
+    if (close(stream->fd))
+	logprintf(LOG_ERR, "FITS write failed: %s: %s", stream->name,
+		  strerror(errno));
+    stream->fd = -1;
+    metric_add(METRIC_FITS_FILES, 1);
+    metric_observe(HISTOGRAM_FITS_TIME, get_monotonic_usecs() - start);
+    metric_observe(HISTOGRAM_FITS_SIZE, end);
+    trace_stage(TRACE_CLOSE, trace);
+}
+
+static void stream_buffer(buffer_t *buf) {
+    stream_t *stream = &fdev->stream;
+    /* a new file, or buffers dropped in between: */
+    if (stream->fd >= 0
+	&& ((buf->flags & BUFFER_FILE_START) || buf->seq != stream->seq + 1))
+	stream_close();
+    stream->seq = buf->seq;
+
+    if (buf->size >= image_h) {
+	if (stream->fd < 0 && !stream_open(buf))
+	    return;
+	stream_append(buf);
+    }
+
+    if (stream->fd >= 0 && (buf->flags & BUFFER_FILE_END))
+	stream_close();
+}
+
+
+
+static void *fitswriter(void *arg) {
+    writer_t *writer = (writer_t*)arg;
+    char name[32];
+
+    image_buffer = writer->image_buffer;
+    image_time = writer->image_time;
+    image_freq = writer->image_freq;
+    snprintf(name, sizeof(name), "fits writer %d", (int)(writer - writers));
+    trace_thread(name);
 
     while (1) {
-	while (save_buffer == -1) /* wait for buffer fill */
-	    msleep(100);
+	buffer_t *buf = buffer_wait(); /* wait for a queued buffer */
+	usec_t start = trace_start();
+
+	/* of any device: */
+	fits_select(buf->device);
+	trace_data(buf->trace_origin, buf->seq);
+	trace_stage(TRACE_HANDOFF, start ? buf->trace_queued : 0);
 
-	/* update w to support incomplete images: */
-	image_w = buffer[save_buffer].size / config.nchannels;
+	if (dev->config.stream_fits > 0) {
+	    stream_buffer(buf);
+	} else {
+	    /* update w to support incomplete images: */
+	    image_w = buf->size / dev->config.nchannels;
 
-	if (image_w)
-	    write_fits(save_buffer);
+	    if (image_w)
+		write_fits(buf);
+	}
+	trace_stage(TRACE_WRITE, start);
 
-	save_buffer = -1; /* done */
+	buffer_release(buf); /* done */
     }
 
     return NULL;
 }
 
-int fits_init() {
+/* The image size, native headers and stream of the current device: */
+static int fits_device_init() {
+    struct fits_device *f;
+
+    if (!(f = (struct fits_device*)calloc(1, sizeof(*f))))
+	return 0;
     /* h and initial w, for memory allocation: */
-    image_h = config.nchannels;
-    image_w = buffer_size / config.nchannels;
+    f->image_h = dev->config.nchannels;
+    f->sample_size = dev->ring.sample_size;
+    f->file_w = dev->config.filetime * dev->config.samplerate
+	/ dev->config.nchannels;
+    f->stream.fd = -1;
+    dev->fits = f;
+    fits_select(dev);
 
-    image_buffer =
-	(uint8_t*)malloc(image_w * image_h);
-    image_time = (double*)malloc(image_w * sizeof(double));
-    image_freq = (double*)malloc(image_h * sizeof(double));
+    /* streaming uses the native writer, and the native headers size
+       the file buffers for cfitsio too: */
+    if (!native_init())
+	return 0;
+    if (dev->config.stream_fits > 0
+	&& !(fdev->stream_row = (uint8_t*)malloc((size_t)file_w
+						 * sample_size)))
+	return 0;
+    return 1;
+}
+
+int fits_init() {
+    const char *kernel = transpose_init();
+    /* the FITS settings are the same for all devices: */
+    const config_t *c = &devices[0].config;
+    int i, d, slots = 0, max_w = 0, max_h = 0;
+    size_t max_image = 0, max_file = 0;
+
+    if (debug)
+	logprintf(LOG_DEBUG, "Using %s image transpose", kernel);
+
+    if (!c->fits_compress || !strcmp(c->fits_compress, "none"))
+	compression = 0;
+    else if (!strcmp(c->fits_compress, "rice"))
+	compression = RICE_1;
+    else if (!strcmp(c->fits_compress, "gzip"))
+	compression = GZIP_2;
+    else {
+	fprintf(stderr, "ERROR: Unknown FITS compression %s\n",
+		c->fits_compress);
+	return 0;
+    }
+    if (compression && (c->native_fits || c->stream_fits > 0)) {
+	fprintf(stderr, "ERROR: FITS compression cannot be used with "
+		"native_fits or stream_fits\n");
+	return 0;
+    }
 
-    if (!image_buffer || !image_time || !image_freq) {
+    /* the image buffers of the writers are sized for any device: */
+    for (d = 0; d < ndevices; d++) {
+	int w;
+
+	dev = &devices[d];
+	if (!fits_device_init()) {
+	    fprintf(stderr, "ERROR: Cannot allocate FITS headers\n");
+	    return 0;
+	}
+	w = dev->ring.size / dev->config.nchannels;
+	if (w > max_w)
+	    max_w = w;
+	if (image_h > max_h)
+	    max_h = image_h;
+	if ((size_t)w * image_h * sample_size > max_image)
+	    max_image = (size_t)w * image_h * sample_size;
+	if (native_size(file_w) > max_file)
+	    max_file = native_size(file_w);
+	slots += dev->ring.count;
+    }
+
+    /* Several writers can save files in parallel with cfitsio, if it
+       is thread safe. Compression defaults to two. One buffer of each
+       device is always being filled. */
+    nwriters = c->fits_threads > 0 ? c->fits_threads : (compression ? 2 : 1);
+    if (c->native_fits || c->stream_fits > 0)
+	nwriters = 1;
+    if (nwriters > 1 && !fits_is_reentrant()) {
+	logprintf(LOG_WARNING, "CFITSIO is not thread safe, "
+		  "using one FITS writer");
+	nwriters = 1;
+    }
+    if (nwriters > slots - ndevices)
+	nwriters = slots - ndevices;
+
+    writers = (writer_t*)calloc(nwriters, sizeof(writer_t));
+    if (!writers) {
 	fprintf(stderr, "ERROR: Cannot allocate image buffers\n");
 	return 0;
     }
+    for (i = 0; i < nwriters; i++) {
+	writers[i].image_buffer = (uint8_t*)malloc(max_image);
+	writers[i].image_time = (double*)malloc(max_w * sizeof(double));
+	writers[i].image_freq = (double*)malloc(max_h * sizeof(double));
+	if (!writers[i].image_buffer || !writers[i].image_time
+	    || !writers[i].image_freq) {
+	    fprintf(stderr, "ERROR: Cannot allocate image buffers\n");
+	    return 0;
+	}
+    }
+
+    /* Whole files are written in the background, as many as there are
+       sample buffers. Streamed files are written in place. */
+    if (c->stream_fits <= 0) {
+	const char *method = output_init(slots, max_file, c->fits_fsync);
+	if (!method) {
+	    fprintf(stderr, "ERROR: Cannot allocate FITS output buffers\n");
+	    return 0;
+	}
+	if (debug)
+	    logprintf(LOG_DEBUG, "Writing FITS files with %s", method);
+    }
 
     return 1;
 }
 
 void fits_start() {
     pthread_attr_t attr;
-    if (pthread_attr_init(&attr) != 0
-        || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
-        || pthread_create(&thread_id, &attr, fitswriter, NULL) != 0
-        || pthread_attr_destroy(&attr) != 0) {
-	logprintf(LOG_CRIT,
-		  "Cannot create FITS writer thread, terminating: %s",
-		  strerror(errno));
-        terminate(-1);
-    }
+    int i;
+
+    for (i = 0; i < nwriters; i++)
+	if (pthread_attr_init(&attr) != 0
+	    || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+	    || pthread_create(&writers[i].thread_id, &attr, fitswriter,
+			      &writers[i]) != 0
+	    || pthread_attr_destroy(&attr) != 0) {
+	    logprintf(LOG_CRIT,
+		      "Cannot create FITS writer thread, terminating: %s",
+		      strerror(errno));
+	    terminate(-1);
+	}
+
+    if (debug && nwriters > 1)
+	logprintf(LOG_DEBUG, "Started %d FITS writer threads", nwriters);
 
+    if (devices[0].config.stream_fits <= 0)
+	output_start();
 }
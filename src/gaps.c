@@ -0,0 +1,88 @@
+#include <config.h>
+
+#include <string.h>
+
+#include "gaps.h"
+#include "log.h"
+#include "callisto.h"
+
+static const char *causes[GAP_CAUSES] = {
+    "timeout", "reset", "rate", "overrun", "overflow", "resync"
+};
+
+void gaps_init(gaps_t *g, int samplerate, int nchannels) {
+    pthread_mutex_init(&g->lock, NULL);
+    g->sweep_len = 1e6 * nchannels / samplerate;
+    g->open = 0;
+}
+
+void gap_add(gaps_t *g, int cause, usec_t start, usec_t end) {
+    gap_t *gap;
+
+    if (end < start)
+	end = start;
+    pthread_mutex_lock(&g->lock);
+    gap = &g->gap[g->count++ % MAX_GAPS];
+    gap->start = start;
+    gap->end = end;
+    gap->cause = cause;
+    /* at least the sweep that was cut: */
+    gap->sweeps = (unsigned long)((end - start) / g->sweep_len + 0.5);
+    if (!gap->sweeps)
+	gap->sweeps = 1;
+    g->events[cause]++;
+    g->lost[cause] += gap->sweeps;
+    pthread_mutex_unlock(&g->lock);
+
+    if (debug)
+	logprintf(LOG_DEBUG, "Data gap (%s): %lu sweep(s) lost",
+		  causes[cause], gap->sweeps);
+}
+
+void gap_open(gaps_t *g, int cause, usec_t start) {
+    if (g->open)
+	return;
+    g->open = 1;
+    g->open_cause = cause;
+    g->open_start = start;
+}
+
+void gap_close(gaps_t *g, usec_t end) {
+    if (!g->open)
+	return;
+    g->open = 0;
+    gap_add(g, g->open_cause, g->open_start, end);
+}
+
+int gaps_find(gaps_t *g, usec_t t0, usec_t t1, gap_t *out, int max) {
+    unsigned long i;
+    int n = 0;
+
+    pthread_mutex_lock(&g->lock);
+    i = g->count > MAX_GAPS ? g->count - MAX_GAPS : 0;
+    for (; i < g->count && n < max; i++) {
+	const gap_t *gap = &g->gap[i % MAX_GAPS];
+	if (gap->end > t0 && gap->start < t1)
+	    out[n++] = *gap;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return n;
+}
+
+void gaps_received(gaps_t *g, int64_t n) {
+    pthread_mutex_lock(&g->lock);
+    g->samples += n;
+    pthread_mutex_unlock(&g->lock);
+}
+
+void gaps_stats(gaps_t *g, gap_stats_t *s) {
+    pthread_mutex_lock(&g->lock);
+    s->samples = g->samples;
+    memcpy(s->events, g->events, sizeof(s->events));
+    memcpy(s->lost, g->lost, sizeof(s->lost));
+    pthread_mutex_unlock(&g->lock);
+}
+
+const char *gap_cause(int cause) {
+    return causes[cause];
+}
@@ -0,0 +1,69 @@
+#ifndef CALLISTO_GAPS_H
+#define CALLISTO_GAPS_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "util.h"
+
+/* Accounting of the data lost by a device. A gap is a time range with
+   no data, with the number of sweeps lost in it. The acquisition
+   thread records them, the FITS writers and the command server read
+   them. */
+
+/* causes: */
+#define GAP_TIMEOUT 0  /* no data from the device */
+#define GAP_RESET 1    /* invalid data, or the device reset itself */
+#define GAP_RATE 2     /* the data arrived at the wrong rate */
+#define GAP_OVERRUN 3  /* the serial port lost input */
+#define GAP_OVERFLOW 4 /* the FITS writer fell behind */
+#define GAP_RESYNC 5   /* a corrupt sweep was dropped */
+#define GAP_CAUSES 6
+
+typedef struct {
+    usec_t start, end;
+    int cause;
+    unsigned long sweeps;
+} gap_t;
+
+/* The counters of a device, at one time: */
+typedef struct {
+    uint64_t samples;             /* samples received */
+    unsigned long events[GAP_CAUSES];
+    unsigned long lost[GAP_CAUSES]; /* sweeps */
+} gap_stats_t;
+
+/* the latest gaps are kept: */
+#define MAX_GAPS 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    double sweep_len;             /* usec */
+    gap_t gap[MAX_GAPS];          /* ring, by count */
+    unsigned long count;          /* gaps recorded */
+    unsigned long events[GAP_CAUSES];
+    unsigned long lost[GAP_CAUSES]; /* sweeps */
+    uint64_t samples;             /* samples received, see gaps_received() */
+    /* an interruption that has not ended yet, for the acquisition
+       thread only: */
+    int open, open_cause;
+    usec_t open_start;
+} gaps_t;
+
+void gaps_init(gaps_t *g, int samplerate, int nchannels);
+/* A gap from start to end: */
+void gap_add(gaps_t *g, int cause, usec_t start, usec_t end);
+/* The data stops at start (unless it already has), and resumes at
+   end: */
+void gap_open(gaps_t *g, int cause, usec_t start);
+void gap_close(gaps_t *g, usec_t end);
+/* Copy up to max of the kept gaps that overlap [t0, t1), oldest first.
+   Returns the number copied. */
+int gaps_find(gaps_t *g, usec_t t0, usec_t t1, gap_t *out, int max);
+/* Count n samples received (n < 0 to take back samples dropped): */
+void gaps_received(gaps_t *g, int64_t n);
+/* Copy the counters: */
+void gaps_stats(gaps_t *g, gap_stats_t *s);
+const char *gap_cause(int cause);
+
+#endif
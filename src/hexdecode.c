@@ -0,0 +1,307 @@
+#include <config.h>
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "hexdecode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEXDECODE_X86 1
+#include <immintrin.h>
+#define TARGET(t) __attribute__((target(t)))
+#else
+#define HEXDECODE_X86 0
+#endif
+
+/* Valid hex characters have bit 4 set, the nibble is in the low
+   bits. Lowercase is not valid, the firmware only sends uppercase. */
+static const uint8_t hexval[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13,
+    ['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+    ['8'] = 0x18, ['9'] = 0x19, ['A'] = 0x1a, ['B'] = 0x1b,
+    ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f
+};
+
+/* The sample in a 4-character word, or -1 if it is not one: */
+static inline int word_scalar(const char *s, int data10bit) {
+    unsigned range = data10bit ? ~0x3ffu : ~0xffu;
+    unsigned a = hexval[(uint8_t)s[0]], b = hexval[(uint8_t)s[1]],
+	c = hexval[(uint8_t)s[2]], d = hexval[(uint8_t)s[3]];
+    unsigned v;
+
+    if (!(a & b & c & d & 0x10))
+	return -1;
+    v = (a & 0xf) << 12 | (b & 0xf) << 8 | (c & 0xf) << 4 | (d & 0xf);
+    if (v & range) /* also catches end markers */
+	return -1;
+    return v;
+}
+
+/* Reference implementation, also used to finish off what the vector
+   kernels leave over, and to find the exact failing word. */
+static inline int decode_scalar(const char *s, int n, uint8_t *out,
+				int data10bit) {
+    int i, v;
+
+    for (i = 0; i < n && (v = word_scalar(s + 4*i, data10bit)) >= 0; i++)
+	out[i] = data10bit ? (uint8_t)(v >> 2) : (uint8_t)v;
+
+    return i;
+}
+
+/* The same into 16-bit samples, which keep all bits of 10-bit data: */
+static inline int decode_wide_scalar(const char *s, int n, uint16_t *out,
+				     int data10bit) {
+    int i, v;
+
+    for (i = 0; i < n && (v = word_scalar(s + 4*i, data10bit)) >= 0; i++)
+	out[i] = (uint16_t)v;
+
+    return i;
+}
+
+
+#if HEXDECODE_X86
+
+/* Convert 16 characters into 4 words in 32-bit lanes. Returns 0 if
+   there is an invalid character. */
+static inline TARGET("sse2") int words_sse2(const char *s, __m128i *w) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c = _mm_loadu_si128((const __m128i *)s);
+    __m128i dig = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i let = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+    __m128i isdig = _mm_cmpeq_epi8(_mm_subs_epu8(dig, _mm_set1_epi8(9)),
+				   zero);
+    __m128i islet = _mm_cmpeq_epi8(_mm_subs_epu8(let, _mm_set1_epi8(5)),
+				   zero);
+    __m128i nib;
+
+    if (_mm_movemask_epi8(_mm_or_si128(isdig, islet)) != 0xffff)
+	return 0;
+
+    nib = _mm_or_si128(_mm_and_si128(isdig, dig),
+		       _mm_and_si128(islet,
+				     _mm_add_epi8(let, _mm_set1_epi8(10))));
+    /* nibble pairs into bytes (in 16-bit lanes): */
+    nib = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib,
+						    _mm_set1_epi16(0xff)), 4),
+		       _mm_srli_epi16(nib, 8));
+    /* byte pairs into words (in 32-bit lanes): */
+    *w = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(nib,
+						   _mm_set1_epi32(0xffff)), 8),
+		      _mm_srli_epi32(nib, 16));
+    return 1;
+}
+
+/* Range check 4 words, and scale 10-bit data to 8 bits if scale is
+   set. Returns 0 if a word is not a valid sample. */
+static inline TARGET("sse2") int samples_sse2(__m128i *w, int data10bit,
+					      int scale) {
+    const __m128i range = _mm_set1_epi32(data10bit ? ~0x3ff : ~0xff);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(*w, range),
+					  _mm_setzero_si128())) != 0xffff)
+	return 0;
+    if (data10bit && scale)
+	*w = _mm_srli_epi32(*w, 2);
+    return 1;
+}
+
+static inline TARGET("sse2") int decode_sse2(const char *s, int n,
+					     uint8_t *out, int data10bit) {
+    __m128i w[4];
+    int i = 0, j;
+
+    while (i + 16 <= n) {
+	for (j = 0; j < 4; j++)
+	    if (!words_sse2(s + 4*i + 16*j, &w[j])
+		|| !samples_sse2(&w[j], data10bit, 1))
+		goto tail;
+	_mm_storeu_si128((__m128i *)(out + i),
+			 _mm_packus_epi16(_mm_packs_epi32(w[0], w[1]),
+					  _mm_packs_epi32(w[2], w[3])));
+	i += 16;
+    }
+
+    while (i + 4 <= n) {
+	int32_t v;
+	if (!words_sse2(s + 4*i, &w[0]) || !samples_sse2(&w[0], data10bit, 1))
+	    break;
+	w[0] = _mm_packs_epi32(w[0], w[0]);
+	v = _mm_cvtsi128_si32(_mm_packus_epi16(w[0], w[0]));
+	memcpy(out + i, &v, 4);
+	i += 4;
+    }
+
+ tail:
+    return i + decode_scalar(s + 4*i, n - i, out + i, data10bit);
+}
+
+/* 16-bit samples, 8 at a time. The samples are at most 10 bits, so the
+   signed pack is fine. */
+static inline TARGET("sse2") int decode_wide_sse2(const char *s, int n,
+						  uint16_t *out,
+						  int data10bit) {
+    __m128i w[2];
+    int i = 0, j;
+
+    while (i + 8 <= n) {
+	for (j = 0; j < 2; j++)
+	    if (!words_sse2(s + 4*i + 16*j, &w[j])
+		|| !samples_sse2(&w[j], data10bit, 0))
+		goto tail;
+	_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(w[0], w[1]));
+	i += 8;
+    }
+
+ tail:
+    return i + decode_wide_scalar(s + 4*i, n - i, out + i, data10bit);
+}
+
+
+/* The AVX2 variants work the same way, 32 characters at a time. */
+static inline TARGET("avx2") int words_avx2(const char *s, __m256i *w) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i c = _mm256_loadu_si256((const __m256i *)s);
+    __m256i dig = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i let = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+    __m256i isdig =
+	_mm256_cmpeq_epi8(_mm256_subs_epu8(dig, _mm256_set1_epi8(9)), zero);
+    __m256i islet =
+	_mm256_cmpeq_epi8(_mm256_subs_epu8(let, _mm256_set1_epi8(5)), zero);
+    __m256i nib;
+
+    if (_mm256_movemask_epi8(_mm256_or_si256(isdig, islet)) != -1)
+	return 0;
+
+    nib = _mm256_or_si256(_mm256_and_si256(isdig, dig),
+			  _mm256_and_si256(islet,
+					   _mm256_add_epi8(let,
+							   _mm256_set1_epi8(10))));
+    nib = _mm256_or_si256(
+	_mm256_slli_epi16(_mm256_and_si256(nib, _mm256_set1_epi16(0xff)), 4),
+	_mm256_srli_epi16(nib, 8));
+    *w = _mm256_or_si256(
+	_mm256_slli_epi32(_mm256_and_si256(nib, _mm256_set1_epi32(0xffff)), 8),
+	_mm256_srli_epi32(nib, 16));
+    return 1;
+}
+
+static inline TARGET("avx2") int samples_avx2(__m256i *w, int data10bit,
+					      int scale) {
+    const __m256i range = _mm256_set1_epi32(data10bit ? ~0x3ff : ~0xff);
+
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(*w, range),
+						_mm256_setzero_si256())) != -1)
+	return 0;
+    if (data10bit && scale)
+	*w = _mm256_srli_epi32(*w, 2);
+    return 1;
+}
+
+static inline TARGET("avx2") int decode_avx2(const char *s, int n,
+					     uint8_t *out, int data10bit) {
+    /* the packs work within 128-bit lanes, this puts the 32-bit
+       groups of samples back in order: */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i w[4];
+    int i = 0, j;
+
+    while (i + 32 <= n) {
+	for (j = 0; j < 4; j++)
+	    if (!words_avx2(s + 4*i + 32*j, &w[j])
+		|| !samples_avx2(&w[j], data10bit, 1))
+		goto tail;
+	w[0] = _mm256_packus_epi16(_mm256_packs_epi32(w[0], w[1]),
+				   _mm256_packs_epi32(w[2], w[3]));
+	_mm256_storeu_si256((__m256i *)(out + i),
+			    _mm256_permutevar8x32_epi32(w[0], order));
+	i += 32;
+    }
+
+ tail:
+    return i + decode_sse2(s + 4*i, n - i, out + i, data10bit);
+}
+
+static inline TARGET("avx2") int decode_wide_avx2(const char *s, int n,
+						  uint16_t *out,
+						  int data10bit) {
+    __m256i w[2];
+    int i = 0, j;
+
+    while (i + 16 <= n) {
+	for (j = 0; j < 2; j++)
+	    if (!words_avx2(s + 4*i + 32*j, &w[j])
+		|| !samples_avx2(&w[j], data10bit, 0))
+		goto tail;
+	/* the pack interleaves the 64-bit groups of the two: */
+	_mm256_storeu_si256((__m256i *)(out + i),
+			    _mm256_permute4x64_epi64(
+				_mm256_packs_epi32(w[0], w[1]), 0xd8));
+	i += 16;
+    }
+
+ tail:
+    return i + decode_wide_sse2(s + 4*i, n - i, out + i, data10bit);
+}
+
+static TARGET("sse2") int decode8_sse2(const char *s, int n, uint8_t *out) {
+    return decode_sse2(s, n, out, 0);
+}
+static TARGET("sse2") int decode10_sse2(const char *s, int n, uint8_t *out) {
+    return decode_sse2(s, n, out, 1);
+}
+static TARGET("avx2") int decode8_avx2(const char *s, int n, uint8_t *out) {
+    return decode_avx2(s, n, out, 0);
+}
+static TARGET("avx2") int decode10_avx2(const char *s, int n, uint8_t *out) {
+    return decode_avx2(s, n, out, 1);
+}
+static TARGET("sse2") int wide8_sse2(const char *s, int n, uint16_t *out) {
+    return decode_wide_sse2(s, n, out, 0);
+}
+static TARGET("sse2") int wide10_sse2(const char *s, int n, uint16_t *out) {
+    return decode_wide_sse2(s, n, out, 1);
+}
+static TARGET("avx2") int wide8_avx2(const char *s, int n, uint16_t *out) {
+    return decode_wide_avx2(s, n, out, 0);
+}
+static TARGET("avx2") int wide10_avx2(const char *s, int n, uint16_t *out) {
+    return decode_wide_avx2(s, n, out, 1);
+}
+
+#endif /* HEXDECODE_X86 */
+
+
+static int decode8_scalar(const char *s, int n, uint8_t *out) {
+    return decode_scalar(s, n, out, 0);
+}
+static int decode10_scalar(const char *s, int n, uint8_t *out) {
+    return decode_scalar(s, n, out, 1);
+}
+static int wide8_scalar(const char *s, int n, uint16_t *out) {
+    return decode_wide_scalar(s, n, out, 0);
+}
+static int wide10_scalar(const char *s, int n, uint16_t *out) {
+    return decode_wide_scalar(s, n, out, 1);
+}
+
+const char *hexdecode_init(int data10bit, hexdecode_t *decode,
+			   hexdecode_wide_t *wide) {
+#if HEXDECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	*decode = data10bit ? decode10_avx2 : decode8_avx2;
+	*wide = data10bit ? wide10_avx2 : wide8_avx2;
+	return "AVX2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+	*decode = data10bit ? decode10_sse2 : decode8_sse2;
+	*wide = data10bit ? wide10_sse2 : wide8_sse2;
+	return "SSE2";
+    }
+#endif
+    *decode = data10bit ? decode10_scalar : decode8_scalar;
+    *wide = data10bit ? wide10_scalar : wide8_scalar;
+    return "scalar";
+}
@@ -0,0 +1,23 @@
+#ifndef CALLISTO_HEXDECODE_H
+#define CALLISTO_HEXDECODE_H
+
+#include <inttypes.h>
+
+/* Decode up to n 4-character hex words from s into samples at
+   out. Decoding stops at the first word that is not a valid sample
+   (invalid character, value out of range or an end marker), which is
+   left for the caller to handle. Returns the number of samples
+   decoded. */
+typedef int (*hexdecode_t)(const char *s, int n, uint8_t *out);
+
+/* The same into 16-bit samples. 10-bit data is not scaled down, so
+   the samples keep their full precision. */
+typedef int (*hexdecode_wide_t)(const char *s, int n, uint16_t *out);
+
+/* Select the decoder variants for the firmware data format and the
+   CPU, to be called after the firmware version has been
+   detected. Returns the name of the selected implementation. */
+const char *hexdecode_init(int data10bit, hexdecode_t *decode,
+			   hexdecode_wide_t *wide);
+
+#endif
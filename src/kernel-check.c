@@ -0,0 +1,319 @@
+/* Check the vector kernels of hexdecode.c and transpose.c against
+   their scalar references with random input, for make check. The
+   sources are included to reach the kernels, which are static.
+
+   Without NEON, the NEON kernels are built with a plain C model of
+   the intrinsics they use. That checks the kernels' logic, but not
+   the compiler's code for them, which only a NEON build does. */
+
+#include <config.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !(defined(__ARM_NEON) && defined(__aarch64__))
+#define TRANSPOSE_NEON 1
+#define NEON_NAME "NEON model"
+
+#define NEON_MODEL(type, lanes, vec, sfx)				\
+typedef struct { type v[lanes]; } vec##_t;				\
+typedef struct { vec##_t val[2]; } vec##x2_t;				\
+static inline vec##_t vdupq_n_##sfx(type x) {				\
+    vec##_t r;								\
+    int i;								\
+    for (i = 0; i < lanes; i++)						\
+	r.v[i] = x;							\
+    return r;								\
+}									\
+static inline vec##_t vld1q_##sfx(const type *p) {			\
+    vec##_t r;								\
+    memcpy(r.v, p, sizeof(r.v));					\
+    return r;								\
+}									\
+static inline void vst1q_##sfx(type *p, vec##_t a) {			\
+    memcpy(p, a.v, sizeof(a.v));					\
+}									\
+static inline vec##_t vminq_##sfx(vec##_t a, vec##_t b) {		\
+    int i;								\
+    for (i = 0; i < lanes; i++)						\
+	a.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i];			\
+    return a;								\
+}									\
+static inline vec##_t vmaxq_##sfx(vec##_t a, vec##_t b) {		\
+    int i;								\
+    for (i = 0; i < lanes; i++)						\
+	a.v[i] = b.v[i] > a.v[i] ? b.v[i] : a.v[i];			\
+    return a;								\
+}									\
+static inline type vminvq_##sfx(vec##_t a) {				\
+    type m = a.v[0];							\
+    int i;								\
+    for (i = 1; i < lanes; i++)						\
+	if (a.v[i] < m)							\
+	    m = a.v[i];							\
+    return m;								\
+}									\
+static inline type vmaxvq_##sfx(vec##_t a) {				\
+    type m = a.v[0];							\
+    int i;								\
+    for (i = 1; i < lanes; i++)						\
+	if (a.v[i] > m)							\
+	    m = a.v[i];							\
+    return m;								\
+}									\
+/* the low halves of a and b interleaved, then the high halves: */	\
+static inline vec##x2_t vzipq_##sfx(vec##_t a, vec##_t b) {		\
+    vec##x2_t r;							\
+    int i;								\
+    for (i = 0; i < lanes; i++) {					\
+	r.val[i / (lanes/2)].v[2*i % lanes] = a.v[i];			\
+	r.val[i / (lanes/2)].v[2*i % lanes + 1] = b.v[i];		\
+    }									\
+    return r;								\
+}
+NEON_MODEL(uint8_t, 16, uint8x16, u8)
+NEON_MODEL(uint16_t, 8, uint16x8, u16)
+
+#else
+#define NEON_NAME "NEON"
+#endif
+
+#include "hexdecode.c"
+#include "transpose.c"
+
+#define ITERATIONS 20000
+
+static int always() {
+    return 1;
+}
+#if HEXDECODE_X86 || TRANSPOSE_X86
+static int have_sse2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+static int have_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+typedef struct {
+    const char *name;
+    int (*have)();
+    hexdecode_t decode[2];       /* 8 and 10-bit data */
+    hexdecode_wide_t wide[2];
+} decoder_t;
+
+static const decoder_t decoders[] = {
+#if HEXDECODE_X86
+    { "SSE2", have_sse2, { decode8_sse2, decode10_sse2 },
+      { wide8_sse2, wide10_sse2 } },
+    { "AVX2", have_avx2, { decode8_avx2, decode10_avx2 },
+      { wide8_avx2, wide10_avx2 } },
+#endif
+    { NULL, NULL, { NULL, NULL }, { NULL, NULL } }
+};
+
+typedef struct {
+    const char *name;
+    int (*have)();
+    transpose_t flip;
+    transpose16_t flip16;
+} transposer_t;
+
+static const transposer_t transposers[] = {
+#if TRANSPOSE_X86
+    { "SSE2", have_sse2, transpose_flip_sse2, transpose16_flip_sse2 },
+    { "AVX2", have_avx2, transpose_flip_avx2, transpose16_flip_avx2 },
+#endif
+    { NEON_NAME, always, transpose_flip_neon, transpose16_flip_neon },
+    { NULL, NULL, NULL, NULL }
+};
+
+/* xorshift64, the same sequence every run unless seeded: */
+static uint64_t state = 88172645463325252ull;
+
+static unsigned rnd(unsigned n) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (unsigned)(state >> 11) % n;
+}
+
+/* Hex words of valid samples, with now and then a word that ends the
+   decoding: a character that is not uppercase hex, a value out of
+   range or the 0x2323 end marker. */
+static void hex_word(char *s, unsigned v) {
+    char w[8];
+
+    snprintf(w, sizeof(w), "%04X", v);
+    memcpy(s, w, 4);
+}
+
+static void hex_input(char *s, int n, int data10bit) {
+    static const char bad[] = "abcdefGg:@/#\r\n $*x";
+    unsigned top = data10bit ? 0x400 : 0x100;
+    int i, at;
+
+    for (i = 0; i < n; i++)
+	hex_word(s + 4*i, rnd(top));
+    if (!n || rnd(4) == 0)
+	return;
+    at = rnd(n);
+    switch (rnd(4)) {
+    case 0:
+	s[4*at + rnd(4)] = bad[rnd(sizeof(bad) - 1)];
+	break;
+    case 1:
+	hex_word(s + 4*at, top + rnd(0x10000 - top));
+	break;
+    case 2:
+	memcpy(s + 4*at, "2323", 4);
+	break;
+    default: /* a second one after the first */
+	memcpy(s + 4*at, "2323", 4);
+	at = rnd(n);
+	s[4*at + rnd(4)] = bad[rnd(sizeof(bad) - 1)];
+    }
+}
+
+#define MAX_WORDS 100
+#define CANARY 16
+
+static int check_decoder(const decoder_t *d) {
+    static char s[4 * MAX_WORDS + 1];
+    uint8_t ref[MAX_WORDS], out[MAX_WORDS + CANARY];
+    uint16_t ref16[MAX_WORDS], out16[MAX_WORDS + CANARY];
+    int it, n, m, r, i, bits;
+
+    for (it = 0; it < ITERATIONS; it++) {
+	n = rnd(MAX_WORDS + 1);
+	bits = it & 1;
+	hex_input(s, n, bits);
+
+	r = decode_scalar(s, n, ref, bits);
+	memset(out, 0xa5, sizeof(out));
+	m = d->decode[bits](s, n, out);
+	if (m != r || memcmp(out, ref, r))
+	    goto failed;
+	for (i = n; i < n + CANARY; i++)
+	    if (out[i] != 0xa5)
+		goto failed;
+
+	r = decode_wide_scalar(s, n, ref16, bits);
+	memset(out16, 0xa5, sizeof(out16));
+	m = d->wide[bits](s, n, out16);
+	if (m != r || memcmp(out16, ref16, r * sizeof(uint16_t)))
+	    goto failed;
+	for (i = n; i < n + CANARY; i++)
+	    if (out16[i] != 0xa5a5)
+		goto failed;
+    }
+    return 1;
+
+ failed:
+    s[4*n] = 0;
+    fprintf(stderr, "hexdecode %s (%d-bit data): %d words decoded, %d "
+	    "expected, of %d: %s\n", d->name, bits ? 10 : 8, m, r, n, s);
+    return 0;
+}
+
+#define MAX_W 80
+#define MAX_H 300
+
+/* Samples from a random range, so that the minimum and maximum are
+   anywhere, in the tiles or in the edges: */
+static void samples(uint16_t *v, size_t n, unsigned top) {
+    unsigned lo = rnd(top + 1), hi = lo + rnd(top + 1 - lo);
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	v[i] = lo + rnd(hi - lo + 1);
+    if (n && rnd(2))
+	v[rnd(n)] = rnd(2) ? 0 : top;
+}
+
+static int check_transposer(const transposer_t *t) {
+    static uint16_t v[MAX_W * MAX_H];
+    static uint8_t src[MAX_W * MAX_H], ref[MAX_W * MAX_H],
+	dst[MAX_W * MAX_H];
+    static uint16_t ref16[MAX_W * MAX_H], dst16[MAX_W * MAX_H];
+    uint8_t mn, mx, rmn, rmx;
+    uint16_t mn16, mx16, rmn16, rmx16;
+    int it, w, h;
+    size_t i, n;
+
+    for (it = 0; it < ITERATIONS / 10; it++) {
+	w = 1 + rnd(MAX_W);
+	/* whole tiles, and the usual 200 channels, now and then: */
+	switch (rnd(4)) {
+	case 0:
+	    h = 16 * (1 + rnd(MAX_H / 16));
+	    break;
+	case 1:
+	    h = 200;
+	    break;
+	default:
+	    h = 1 + rnd(MAX_H);
+	}
+	n = (size_t)w * h;
+
+	samples(v, n, 255);
+	for (i = 0; i < n; i++)
+	    src[i] = v[i];
+	transpose_flip_scalar(src, w, h, ref, &rmn, &rmx);
+	memset(dst, 0, n);
+	t->flip(src, w, h, dst, &mn, &mx);
+	if (memcmp(dst, ref, n) || mn != rmn || mx != rmx) {
+	    fprintf(stderr, "transpose %s: %d sweeps of %d samples, min "
+		    "%u/%u, max %u/%u\n", t->name, w, h, mn, rmn, mx, rmx);
+	    return 0;
+	}
+
+	/* 16-bit samples have at most 10 bits: */
+	samples(v, n, 0x3ff);
+	transpose16_flip_scalar(v, w, h, ref16, &rmn16, &rmx16);
+	memset(dst16, 0, n * sizeof(uint16_t));
+	t->flip16(v, w, h, dst16, &mn16, &mx16);
+	if (memcmp(dst16, ref16, n * sizeof(uint16_t)) || mn16 != rmn16
+	    || mx16 != rmx16) {
+	    fprintf(stderr, "transpose %s (16-bit): %d sweeps of %d "
+		    "samples, min %u/%u, max %u/%u\n", t->name, w, h, mn16,
+		    rmn16, mx16, rmx16);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const decoder_t *d;
+    const transposer_t *t;
+    int ok = 1, passed;
+
+    if (argc > 1)
+	state = strtoull(argv[1], NULL, 0) | 1;
+
+    for (d = decoders; d->name; d++) {
+	if (!d->have()) {
+	    printf("hexdecode %s: not supported by the CPU\n", d->name);
+	    continue;
+	}
+	passed = check_decoder(d);
+	printf("hexdecode %s: %s\n", d->name, passed ? "ok" : "FAILED");
+	ok &= passed;
+    }
+    for (t = transposers; t->name; t++) {
+	if (!t->have()) {
+	    printf("transpose %s: not supported by the CPU\n", t->name);
+	    continue;
+	}
+	passed = check_transposer(t);
+	printf("transpose %s: %s\n", t->name, passed ? "ok" : "FAILED");
+	ok &= passed;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "device.h"
+
 static int use_stderr = 1;
 
 void log_init(int isdaemon) {
@@ -13,21 +15,31 @@ void log_init(int isdaemon) {
 	openlog(PACKAGE_NAME, LOG_NDELAY | LOG_PID, LOG_DAEMON);
 }
 
+/* With several devices, messages are prefixed with the instrument
+   and focus code of the current device: */
 void logprintf(int priority, const char *format, ...) {
     va_list args;
     time_t now;
     struct tm nowtm;
+    char prefix[64] = "", msg[1024];
 
     va_start(args, format);
 
+    if (ndevices > 1 && dev)
+	snprintf(prefix, sizeof(prefix), "%s/%i: ",
+		 dev->config.instrument, dev->config.focuscode);
+
     if (use_stderr) {
 	now = time(NULL);
 	localtime_r(&now, &nowtm);
-	fprintf(stderr, "[%.4i-%.2i-%.2i %.2i:%.2i:%.2i] ",
+	fprintf(stderr, "[%.4i-%.2i-%.2i %.2i:%.2i:%.2i] %s",
 		nowtm.tm_year + 1900, nowtm.tm_mon + 1, nowtm.tm_mday,
-		nowtm.tm_hour, nowtm.tm_min, nowtm.tm_sec);
+		nowtm.tm_hour, nowtm.tm_min, nowtm.tm_sec, prefix);
 	vfprintf(stderr, format, args);
 	fputc('\n', stderr);
+    } else if (prefix[0]) {
+	vsnprintf(msg, sizeof(msg), format, args);
+	syslog(priority, "%s%s", prefix, msg);
     } else
 	vsyslog(priority, format, args);
 
@@ -0,0 +1,344 @@
+#include <config.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "device.h"
+#include "gaps.h"
+
+#define CACHE_LINE 64
+
+/* metric flags: */
+#define PER_DEVICE 1
+#define GAUGE 2
+
+typedef struct {
+    const char *name, *labels, *help;
+    int flags;
+} metric_t;
+
+/* Metrics with the same name are one family, and must follow each
+   other: */
+static const metric_t metrics[METRICS] = {
+    { "serial_bytes_total", NULL,
+      "Bytes read from the serial port.", PER_DEVICE },
+    { "sweeps_total", NULL, "Sweeps received.", PER_DEVICE },
+    { "resets_total", "cause=\"startup\"", "Device resets.", PER_DEVICE },
+    { "resets_total", "cause=\"timeout\"", NULL, PER_DEVICE },
+    { "resets_total", "cause=\"hardware\"", NULL, PER_DEVICE },
+    { "resets_total", "cause=\"data\"", NULL, PER_DEVICE },
+    { "fits_files_total", NULL, "FITS files written.", PER_DEVICE },
+    { "server_connections_total", NULL,
+      "Command server connections accepted.", 0 },
+    { "server_clients", NULL, "Command server connections open.", GAUGE },
+    { "server_commands_total", NULL, "Commands executed.", 0 },
+    { "schedule_events_total", "event=\"start\"",
+      "Scheduled events run.", 0 },
+    { "schedule_events_total", "event=\"stop\"", NULL, 0 },
+    { "schedule_events_total", "event=\"overview\"", NULL, 0 }
+};
+
+/* Histogram buckets are powers of two times the base, in the units of
+   the values; the values are divided by scale for export. */
+#define HISTOGRAM_BUCKETS 24
+
+typedef struct {
+    const char *name, *help;
+    int flags;
+    uint64_t base;
+    int buckets;
+    double scale;
+} histogram_t;
+
+static const histogram_t histograms[HISTOGRAMS] = {
+    { "buffer_occupancy", "Sample buffers in flight after one is queued.",
+      PER_DEVICE, 1, 7, 1 },
+    { "fits_write_seconds",
+      "Time to write a FITS file, from the start of the write until "
+      "it is complete under its name.",
+      PER_DEVICE, 64, HISTOGRAM_BUCKETS, 1e6 },
+    { "fits_file_bytes", "Size of the FITS files written.",
+      PER_DEVICE, 1024, HISTOGRAM_BUCKETS, 1 },
+    { "server_command_seconds", "Time to execute a command.",
+      0, 16, HISTOGRAM_BUCKETS, 1e6 }
+};
+
+typedef struct {
+    atomic_ullong bucket[HISTOGRAM_BUCKETS + 1]; /* the last is +Inf */
+    atomic_ullong sum;
+} counts_t;
+
+/* the counts of a thread: */
+typedef struct block {
+    struct block *next;
+    atomic_ullong value[MAX_DEVICES][METRICS];
+    counts_t counts[MAX_DEVICES][HISTOGRAMS];
+} block_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static block_t *blocks = NULL;
+static __thread block_t *own = NULL;
+
+/* The block of this thread, a whole number of cache lines, NULL if
+   there is no memory for it: */
+static block_t *own_block() {
+    size_t size = (sizeof(block_t) + CACHE_LINE - 1) / CACHE_LINE
+	* CACHE_LINE;
+    block_t *b;
+
+    if (own)
+	return own;
+    if (posix_memalign((void**)&b, CACHE_LINE, size))
+	return NULL;
+    memset(b, 0, size);
+    pthread_mutex_lock(&lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&lock);
+    return own = b;
+}
+
+/* The thread's own counts are only written by it, so they need no
+   atomic read-modify-write: */
+static void add(atomic_ullong *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed)
+			  + n, memory_order_relaxed);
+}
+
+static int device_index(int flags) {
+    return (flags & PER_DEVICE) && dev ? dev->index : 0;
+}
+
+void metric_add(int metric, int64_t n) {
+    block_t *b = own_block();
+
+    if (b)
+	add(&b->value[device_index(metrics[metric].flags)][metric],
+	    (uint64_t)n);
+}
+
+void metric_observe(int histogram, uint64_t v) {
+    const histogram_t *h = &histograms[histogram];
+    block_t *b = own_block();
+    counts_t *c;
+    int i = 0;
+
+    if (!b)
+	return;
+    c = &b->counts[device_index(h->flags)][histogram];
+    while (i < h->buckets && v > h->base << i)
+	i++;
+    add(&c->bucket[i], 1);
+    add(&c->sum, v);
+}
+
+
+/* Export. The sums are read without stopping the writers, so a
+   histogram may be a count or two behind its sum. */
+
+typedef struct {
+    void (*put)(void *arg, const char *s, size_t n);
+    void *arg;
+} out_t;
+
+static void out_printf(out_t *out, const char *format, ...) {
+    char line[512];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line))
+	n = sizeof(line) - 1;
+    if (n > 0)
+	out->put(out->arg, line, n);
+}
+
+static void family(out_t *out, const char *name, const char *help,
+		   const char *type) {
+    out_printf(out, "# HELP callisto_%s %s\n# TYPE callisto_%s %s\n",
+	       name, help, name, type);
+}
+
+/* A label value, with \, " and newlines escaped as the exposition
+   format wants: */
+static void escape(char *s, size_t n, const char *v) {
+    size_t i = 0;
+
+    for (; *v && i + 2 < n; v++)
+	if (*v == '\\' || *v == '"') {
+	    s[i++] = '\\';
+	    s[i++] = *v;
+	} else if (*v == '\n') {
+	    s[i++] = '\\';
+	    s[i++] = 'n';
+	} else
+	    s[i++] = *v;
+    s[i] = 0;
+}
+
+/* The labels of device d, or none if d is NULL, and more labels if
+   not NULL, between braces: */
+static void labels(char *s, size_t n, const device_t *d, const char *more) {
+    char instrument[128];
+
+    if (d) {
+	escape(instrument, sizeof(instrument), d->config.instrument);
+	snprintf(s, n, "{device=\"%d\",instrument=\"%s\","
+		 "focuscode=\"%d\"%s%s}", d->index, instrument,
+		 d->config.focuscode, more ? "," : "", more ? more : "");
+    } else if (more)
+	snprintf(s, n, "{%s}", more);
+    else
+	*s = 0;
+}
+
+/* The sums over the threads: */
+static uint64_t value_sum(int d, int metric) {
+    const block_t *b;
+    uint64_t s = 0;
+
+    pthread_mutex_lock(&lock);
+    for (b = blocks; b; b = b->next)
+	s += atomic_load_explicit(&b->value[d][metric],
+				  memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    return s;
+}
+
+static void counts_sum(int d, int histogram, uint64_t *bucket,
+		       uint64_t *sum) {
+    const block_t *b;
+    int i;
+
+    memset(bucket, 0, sizeof(uint64_t) * (HISTOGRAM_BUCKETS + 1));
+    *sum = 0;
+    pthread_mutex_lock(&lock);
+    for (b = blocks; b; b = b->next) {
+	const counts_t *c = &b->counts[d][histogram];
+	for (i = 0; i <= HISTOGRAM_BUCKETS; i++)
+	    bucket[i] += atomic_load_explicit(&c->bucket[i],
+					      memory_order_relaxed);
+	*sum += atomic_load_explicit(&c->sum, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void export_histogram(out_t *out, int histogram, const device_t *d) {
+    const histogram_t *h = &histograms[histogram];
+    uint64_t bucket[HISTOGRAM_BUCKETS + 1], total, count = 0;
+    char l[256], le[32];
+    int i;
+
+    counts_sum(d ? d->index : 0, histogram, bucket, &total);
+    for (i = 0; i <= h->buckets; i++) {
+	count += bucket[i];
+	if (i < h->buckets)
+	    snprintf(le, sizeof(le), "le=\"%.10g\"",
+		     (double)(h->base << i) / h->scale);
+	else
+	    strcpy(le, "le=\"+Inf\"");
+	labels(l, sizeof(l), d, le);
+	out_printf(out, "callisto_%s_bucket%s %llu\n", h->name, l,
+		   (unsigned long long)count);
+    }
+    labels(l, sizeof(l), d, NULL);
+    out_printf(out, "callisto_%s_sum%s %.9g\ncallisto_%s_count%s %llu\n",
+	       h->name, l, total / h->scale, h->name, l,
+	       (unsigned long long)count);
+}
+
+/* What the devices keep track of anyway: */
+static void export_devices(out_t *out) {
+    char l[256], cause[32];
+    gap_stats_t st;
+    timing_t tm;
+    int d, i;
+
+    family(out, "lost_sweeps_total", "Sweeps lost in data gaps.",
+	   "counter");
+    for (d = 0; d < ndevices; d++) {
+	gaps_stats(&devices[d].gaps, &st);
+	for (i = 0; i < GAP_CAUSES; i++) {
+	    snprintf(cause, sizeof(cause), "cause=\"%s\"", gap_cause(i));
+	    labels(l, sizeof(l), &devices[d], cause);
+	    out_printf(out, "callisto_lost_sweeps_total%s %lu\n", l,
+		       st.lost[i]);
+	}
+    }
+
+    family(out, "buffer_overflows_total",
+	   "Sample buffers dropped because the FITS writer fell behind.",
+	   "counter");
+    for (d = 0; d < ndevices; d++) {
+	labels(l, sizeof(l), &devices[d], NULL);
+	out_printf(out, "callisto_buffer_overflows_total%s %lu\n", l,
+		   (unsigned long)atomic_load(&devices[d].ring.overflows));
+    }
+
+    family(out, "buffers_in_flight",
+	   "Sample buffers queued or being saved.", "gauge");
+    for (d = 0; d < ndevices; d++) {
+	labels(l, sizeof(l), &devices[d], NULL);
+	out_printf(out, "callisto_buffers_in_flight%s %d\n", l,
+		   buffer_in_flight(&devices[d].ring));
+    }
+
+    family(out, "sample_rate", "Measured samples per second.", "gauge");
+    for (d = 0; d < ndevices; d++) {
+	timing_read(&devices[d].timing_shared, &tm);
+	labels(l, sizeof(l), &devices[d], NULL);
+	out_printf(out, "callisto_sample_rate%s %.4f\n", l,
+		   timing_rate(&tm));
+    }
+}
+
+void metrics_export(void (*put)(void *arg, const char *s, size_t n),
+		    void *arg) {
+    out_t out;
+    char l[256];
+    uint64_t v;
+    int i, d, n;
+
+    out.put = put;
+    out.arg = arg;
+    for (i = 0; i < METRICS; i++) {
+	const metric_t *m = &metrics[i];
+
+	/* the first of its family: */
+	if (m->help)
+	    family(&out, m->name, m->help,
+		   m->flags & GAUGE ? "gauge" : "counter");
+	n = m->flags & PER_DEVICE ? ndevices : 1;
+	for (d = 0; d < n; d++) {
+	    labels(l, sizeof(l), m->flags & PER_DEVICE ? &devices[d] : NULL,
+		   m->labels);
+	    v = value_sum(d, i);
+	    if (m->flags & GAUGE)
+		out_printf(&out, "callisto_%s%s %lld\n", m->name, l,
+			   (long long)v);
+	    else
+		out_printf(&out, "callisto_%s%s %llu\n", m->name, l,
+			   (unsigned long long)v);
+	}
+    }
+
+    for (i = 0; i < HISTOGRAMS; i++) {
+	const histogram_t *h = &histograms[i];
+
+	family(&out, h->name, h->help, "histogram");
+	if (h->flags & PER_DEVICE)
+	    for (d = 0; d < ndevices; d++)
+		export_histogram(&out, i, &devices[d]);
+	else
+	    export_histogram(&out, i, NULL);
+    }
+
+    export_devices(&out);
+}
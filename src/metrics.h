@@ -0,0 +1,51 @@
+#ifndef CALLISTO_METRICS_H
+#define CALLISTO_METRICS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Counters and histograms of the work done, for the metrics command
+   and port of the command server. Each thread counts in a block of its
+   own, so that the threads never write to a shared cache line, and the
+   blocks are summed when the metrics are read. Most metrics are kept
+   per device, of the thread's current device (dev). */
+
+/* counters and gauges, in the order of the table in metrics.c: */
+enum {
+    METRIC_SERIAL_BYTES,
+    METRIC_SWEEPS,
+    /* device resets, by cause: */
+    METRIC_RESET_STARTUP,
+    METRIC_RESET_TIMEOUT,
+    METRIC_RESET_HARDWARE,   /* the device reset itself */
+    METRIC_RESET_DATA,       /* invalid data */
+    METRIC_FITS_FILES,
+    METRIC_CONNECTIONS,
+    METRIC_CLIENTS,          /* gauge */
+    METRIC_COMMANDS,
+    METRIC_SCHEDULE_START,
+    METRIC_SCHEDULE_STOP,
+    METRIC_SCHEDULE_OVERVIEW,
+    METRICS
+};
+
+/* histograms: */
+enum {
+    HISTOGRAM_BUFFERS,       /* slots in flight when one is queued */
+    HISTOGRAM_FITS_TIME,     /* usec to write a file, to close a stream */
+    HISTOGRAM_FITS_SIZE,     /* bytes */
+    HISTOGRAM_COMMAND_TIME,  /* usec */
+    HISTOGRAMS
+};
+
+/* Add n to a counter or gauge: */
+void metric_add(int metric, int64_t n);
+/* Count value v in a histogram: */
+void metric_observe(int histogram, uint64_t v);
+
+/* Write all metrics in the Prometheus text format, with put(arg, s,
+   n) for each piece of text: */
+void metrics_export(void (*put)(void *arg, const char *s, size_t n),
+		    void *arg);
+
+#endif
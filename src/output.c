@@ -0,0 +1,604 @@
+#define _GNU_SOURCE /* fallocate() */
+#include <config.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "output.h"
+#include "callisto.h"
+#include "log.h"
+#include "util.h"
+#include "device.h"
+#include "metrics.h"
+#include "trace.h"
+
+static output_file_t *files = NULL;
+static int nfiles = 0;
+static int sync_batch = 0;
+
+/* All of the following are protected by the mutex. A file is busy
+   from output_get() until it has been written (and synced), files
+   waiting to be synced are kept open on the sync list. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static output_file_t *free_list = NULL;
+static output_file_t *queue_head = NULL, **queue_tail = &queue_head;
+static output_file_t *sync_head = NULL, **sync_tail = &sync_head;
+static int busy = 0, nsync = 0, syncing = 0, flush = 0;
+
+static int use_ring = 0;
+static int wake_fd = -1; /* tells the io_uring thread about new files */
+
+
+output_file_t *output_get() {
+    int64_t start = get_monotonic_usecs();
+    output_file_t *f;
+
+    pthread_mutex_lock(&lock);
+    while (!(f = free_list))
+	pthread_cond_wait(&freed, &lock);
+    free_list = f->next;
+    busy++;
+    pthread_mutex_unlock(&lock);
+    f->started = start;
+
+    f->len = 0;
+    f->fd = -1;
+    return f;
+}
+
+static void release(output_file_t *f) {
+    pthread_mutex_lock(&lock);
+    f->next = free_list;
+    free_list = f;
+    busy--;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
+
+static void wake() {
+    uint64_t one = 1;
+
+    if (use_ring) {
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+	    logprintf(LOG_ERR, "Cannot wake FITS output thread: %s",
+		      strerror(errno));
+    } else
+	pthread_cond_signal(&queued);
+}
+
+void output_submit(output_file_t *f) {
+    snprintf(f->tmp, sizeof(f->tmp), "%s" OUTPUT_SUFFIX, f->name);
+    f->device = dev;
+    f->submitted = get_monotonic_usecs();
+    f->trace_origin = trace_origin();
+    f->trace_id = trace_id();
+
+    pthread_mutex_lock(&lock);
+    f->next = NULL;
+    *queue_tail = f;
+    queue_tail = &f->next;
+    wake();
+    pthread_mutex_unlock(&lock);
+}
+
+void output_abort(output_file_t *f) {
+    release(f);
+}
+
+static output_file_t *dequeue() {
+    output_file_t *f;
+
+    if ((f = queue_head) && !(queue_head = f->next))
+	queue_tail = &queue_head;
+    return f;
+}
+
+
+int output_preallocate(int fd, off_t len) {
+#ifdef HAVE_FALLOCATE
+    if (fallocate(fd, 0, 0, len) && errno != EOPNOTSUPP && errno != ENOSYS)
+	return 0;
+#endif
+    return 1;
+}
+
+static int open_tmp(output_file_t *f) {
+    f->done = 0;
+    f->fd = open(f->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return (f->fd >= 0 && output_preallocate(f->fd, f->len));
+}
+
+static void failed(output_file_t *f) {
+    logprintf(LOG_ERR, "FITS write failed: %s: %s", f->name,
+	      strerror(errno));
+    if (f->fd >= 0)
+	close(f->fd);
+    unlink(f->tmp);
+    release(f);
+}
+
+/* Count a file written, in the metrics of its device, and trace it: */
+static void written(output_file_t *f) {
+    dev = f->device;
+    metric_add(METRIC_FITS_FILES, 1);
+    metric_observe(HISTOGRAM_FITS_TIME, get_monotonic_usecs() - f->started);
+    metric_observe(HISTOGRAM_FITS_SIZE, f->len);
+    trace_data(f->trace_origin, f->trace_id);
+    trace_stage(TRACE_CLOSE, trace_start() ? f->submitted : 0);
+}
+
+/* All of f is written. Without syncs it gets its real name now,
+   otherwise it waits for the sync of its batch under the temporary
+   name. Returns nonzero if a batch of files is now due to be synced. */
+static int finished(output_file_t *f) {
+    int due;
+
+    if (!sync_batch) {
+	if (rename(f->tmp, f->name)) {
+	    failed(f);
+	    return 0;
+	}
+	written(f);
+	close(f->fd);
+	release(f);
+	return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    f->error = 0;
+    f->next = NULL;
+    *sync_tail = f;
+    sync_tail = &f->next;
+    nsync++;
+    due = (!syncing && nsync >= sync_batch);
+    pthread_mutex_unlock(&lock);
+    return due;
+}
+
+/* Take the files waiting to be synced, if they are due, or NULL: */
+static output_file_t *sync_take() {
+    output_file_t *f = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (!syncing && nsync > 0 && (nsync >= sync_batch || flush)) {
+	f = sync_head;
+	sync_head = NULL;
+	sync_tail = &sync_head;
+	nsync = 0;
+	syncing = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return f;
+}
+
+/* A batch of files is synced, give the files their real names. Files
+   that could not be synced are dropped. Returns the files renamed. */
+static output_file_t *sync_rename(output_file_t *f) {
+    output_file_t *next, *renamed = NULL, **tail = &renamed;
+
+    for (; f; f = next) {
+	next = f->next;
+	if (f->error) {
+	    errno = f->error;
+	    failed(f);
+	    continue;
+	}
+	if (rename(f->tmp, f->name)) {
+	    failed(f);
+	    continue;
+	}
+	written(f);
+	f->next = NULL;
+	*tail = f;
+	tail = &f->next;
+    }
+    return renamed;
+}
+
+/* The directory of a file, for syncing the renames: */
+static int open_dir(const char *name) {
+    char dir[PATH_MAX], *p;
+
+    snprintf(dir, sizeof(dir), "%s", name);
+    if (!(p = strrchr(dir, '/')))
+	return open(".", O_RDONLY | O_DIRECTORY);
+    if (p == dir)
+	p++;
+    *p = '\0';
+    return open(dir, O_RDONLY | O_DIRECTORY);
+}
+
+static void sync_done(output_file_t *f) {
+    output_file_t *next;
+
+    for (; f; f = next) {
+	next = f->next;
+	close(f->fd);
+	release(f);
+    }
+    pthread_mutex_lock(&lock);
+    syncing = 0;
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Sync a batch of files one at a time, rename them and sync their
+   directory: */
+static void sync_files() {
+    output_file_t *batch = sync_take(), *f;
+    int fd;
+
+    if (!batch)
+	return;
+    for (f = batch; f; f = f->next)
+	if (fsync(f->fd))
+	    f->error = errno;
+    batch = sync_rename(batch);
+    if (batch && (fd = open_dir(batch->name)) >= 0) {
+	if (fsync(fd))
+	    logprintf(LOG_ERR, "FITS directory sync failed: %s",
+		      strerror(errno));
+	close(fd);
+    }
+    sync_done(batch);
+}
+
+
+/* Without io_uring, the files are written by a few threads, so that a
+   stalled write only holds up the files of its own thread: */
+#define WRITE_THREADS 4
+
+static void *write_thread(void *dummy) {
+    output_file_t *f;
+    ssize_t n;
+    (void)dummy;
+
+    trace_thread("fits output");
+    while (1) {
+	pthread_mutex_lock(&lock);
+	while (!(f = dequeue()))
+	    pthread_cond_wait(&queued, &lock);
+	pthread_mutex_unlock(&lock);
+
+	if (!open_tmp(f)) {
+	    failed(f);
+	    continue;
+	}
+	while (f->done < f->len) {
+	    n = pwrite(f->fd, f->data + f->done, f->len - f->done, f->done);
+	    if (n > 0)
+		f->done += n;
+	    else if (n == 0 || errno != EINTR) {
+		if (n == 0)
+		    errno = EIO;
+		break;
+	    }
+	}
+	if (f->done < f->len) {
+	    failed(f);
+	    continue;
+	}
+	if (finished(f))
+	    sync_files();
+    }
+
+    return NULL;
+}
+
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* With io_uring, a single thread keeps the writes and syncs of all
+   files in flight. The ring is set up with the raw system calls. */
+static struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+} ring;
+
+/* user_data of the completions other than those of files: */
+#define RING_WAKE 0
+#define RING_SYNC 1 /* of the directory */
+
+static output_file_t *ring_batch = NULL; /* being synced */
+static int ring_syncs = 0, ring_dir = -1;
+
+static int ring_init(unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+	return 0;
+    ring.entries = p.sq_entries;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+	sq_len = cq_len;
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	cq = sq;
+    else {
+	cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+	    goto fail;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+	goto fail;
+
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 1;
+
+ fail:
+    close(ring.fd);
+    return 0;
+}
+
+static int ring_enter(unsigned wait) {
+    int n;
+
+    n = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0)
+	return (errno == EINTR || errno == EAGAIN || errno == EBUSY);
+    ring.to_submit -= n;
+    return 1;
+}
+
+/* Queue an operation, to be submitted on the next ring_wait(): */
+static struct io_uring_sqe *ring_prep(int op, int fd, void *addr,
+				      unsigned len, off_t off, uint64_t data) {
+    unsigned tail = *ring.sq_tail, i;
+    struct io_uring_sqe *sqe;
+
+    /* the ring is big enough for everything in flight, but not
+       everything that is queued is submitted yet: */
+    while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+	   >= ring.entries)
+	ring_enter(0);
+
+    i = tail & *ring.sq_mask;
+    sqe = &ring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+    ring.sq_array[i] = i;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+    return sqe;
+}
+
+/* Submit what is queued and wait for a completion: */
+static int ring_wait(struct io_uring_cqe *cqe) {
+    unsigned head = *ring.cq_head;
+
+    if (ring.to_submit && !ring_enter(0))
+	return 0;
+    while (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+	if (!ring_enter(1))
+	    return 0;
+    *cqe = ring.cqes[head & *ring.cq_mask];
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void ring_poll() {
+    ring_prep(IORING_OP_POLL_ADD, wake_fd, NULL, 0, 0, RING_WAKE)
+	->poll_events = POLLIN;
+}
+
+static void ring_write(output_file_t *f) {
+    f->iov.iov_base = f->data + f->done;
+    f->iov.iov_len = f->len - f->done;
+    ring_prep(IORING_OP_WRITEV, f->fd, &f->iov, 1, f->done,
+	      (uint64_t)(uintptr_t)f);
+}
+
+static void ring_start(output_file_t *f) {
+    if (!open_tmp(f))
+	failed(f);
+    else
+	ring_write(f);
+}
+
+/* A batch is synced in two steps: the files, and once they are
+   renamed, the directory. */
+static void ring_sync() {
+    output_file_t *f;
+
+    if (ring_syncs || !(ring_batch = sync_take()))
+	return;
+    for (f = ring_batch; f; f = f->next) {
+	ring_prep(IORING_OP_FSYNC, f->fd, NULL, 0, 0,
+		  (uint64_t)(uintptr_t)f);
+	ring_syncs++;
+    }
+}
+
+static void ring_synced() {
+    ring_batch = sync_rename(ring_batch);
+    if (ring_batch && (ring_dir = open_dir(ring_batch->name)) >= 0) {
+	ring_prep(IORING_OP_FSYNC, ring_dir, NULL, 0, 0, RING_SYNC);
+	ring_syncs++;
+    } else
+	sync_done(ring_batch);
+}
+
+static void *ring_thread(void *dummy) {
+    struct io_uring_cqe cqe;
+    output_file_t *f;
+    uint64_t n;
+    (void)dummy;
+
+    trace_thread("fits output");
+    ring_poll();
+    while (1) {
+	if (!ring_wait(&cqe)) {
+	    logprintf(LOG_CRIT, "FITS output failed, terminating: %s",
+		      strerror(errno));
+	    terminate(-1);
+	}
+
+	if (cqe.user_data == RING_WAKE) {
+	    if (read(wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		logprintf(LOG_ERR, "Cannot read FITS output wakeup: %s",
+			  strerror(errno));
+	    while (1) {
+		pthread_mutex_lock(&lock);
+		f = dequeue();
+		pthread_mutex_unlock(&lock);
+		if (!f)
+		    break;
+		ring_start(f);
+	    }
+	    ring_poll();
+	} else if (cqe.user_data == RING_SYNC) {
+	    if (cqe.res < 0)
+		logprintf(LOG_ERR, "FITS directory sync failed: %s",
+			  strerror(-cqe.res));
+	    ring_syncs--;
+	    close(ring_dir);
+	    sync_done(ring_batch);
+	} else {
+	    f = (output_file_t*)(uintptr_t)cqe.user_data;
+	    /* all of a file is written before it is synced: */
+	    if (f->done >= f->len) {
+		if (cqe.res < 0)
+		    f->error = -cqe.res;
+		if (--ring_syncs == 0)
+		    ring_synced();
+	    } else if (cqe.res <= 0) {
+		errno = cqe.res < 0 ? -cqe.res : EIO;
+		failed(f);
+	    } else if ((f->done += cqe.res) < f->len)
+		ring_write(f);
+	    else
+		finished(f);
+	}
+
+	ring_sync();
+    }
+
+    return NULL;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+
+const char *output_init(int count, size_t size, int batch) {
+    int i;
+
+    files = (output_file_t*)calloc(count, sizeof(output_file_t));
+    if (!files)
+	return NULL;
+    for (i = 0; i < count; i++) {
+	if (!(files[i].data = (uint8_t*)malloc(size)))
+	    return NULL;
+	files[i].size = size;
+	files[i].next = free_list;
+	free_list = &files[i];
+    }
+    nfiles = count;
+    /* all files waiting for a sync is a full batch: */
+    sync_batch = batch < count ? batch : count;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    /* writes and syncs of all files, a directory sync and the wakeup
+       can be in flight: */
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK)) >= 0
+	&& ring_init(2*count + 2)) {
+	use_ring = 1;
+	return "io_uring";
+    }
+    if (wake_fd >= 0)
+	close(wake_fd);
+#endif
+    return "threads";
+}
+
+void output_start() {
+    pthread_attr_t attr;
+    pthread_t thread_id;
+    int i, n = 1;
+    void *(*run)(void*) = write_thread;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (use_ring)
+	run = ring_thread;
+#endif
+    if (!use_ring)
+	n = nfiles < WRITE_THREADS ? nfiles : WRITE_THREADS;
+
+    for (i = 0; i < n; i++)
+	if (pthread_attr_init(&attr) != 0
+	    || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+	    || pthread_create(&thread_id, &attr, run, NULL) != 0
+	    || pthread_attr_destroy(&attr) != 0) {
+	    logprintf(LOG_CRIT,
+		      "Cannot create FITS output thread, terminating: %s",
+		      strerror(errno));
+	    terminate(-1);
+	}
+}
+
+void output_wait_idle() {
+    pthread_mutex_lock(&lock);
+    flush = 1;
+    while (busy) {
+	/* sync the last files even if the batch is not full: */
+	if (nsync > 0 && !syncing) {
+	    pthread_mutex_unlock(&lock);
+	    if (use_ring) {
+		pthread_mutex_lock(&lock);
+		wake();
+	    } else {
+		sync_files();
+		pthread_mutex_lock(&lock);
+		continue;
+	    }
+	}
+	pthread_cond_wait(&freed, &lock);
+    }
+    flush = 0;
+    pthread_mutex_unlock(&lock);
+}
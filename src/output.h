@@ -0,0 +1,62 @@
+#ifndef CALLISTO_OUTPUT_H
+#define CALLISTO_OUTPUT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Output of finished FITS files, in the background. A FITS writer
+   takes a file buffer, fills it in and submits it. The file is written
+   under a temporary name, preallocated to its size, and renamed to its
+   real name when all of it has been written, so a partial file is
+   never seen under that name. When files are synced, they are renamed
+   only after the sync, so that this also holds after a crash. The
+   writer only waits if all file buffers are still being written. */
+
+/* appended to the file name for the temporary name: */
+#define OUTPUT_SUFFIX ".part"
+
+struct device;
+
+typedef struct output_file {
+    uint8_t *data;
+    size_t size;         /* allocated, the writer may reallocate data */
+    size_t len;          /* bytes in data to write */
+    char name[PATH_MAX];
+    struct device *device; /* whose file */
+    int64_t started;     /* when the writer asked for the buffer */
+    int64_t submitted;
+    int64_t trace_origin; /* for trace.h */
+    uint64_t trace_id;
+    /* for the output thread(s): */
+    char tmp[PATH_MAX + sizeof(OUTPUT_SUFFIX)];
+    int fd;
+    size_t done;
+    int error;           /* errno of a failed sync */
+    struct iovec iov;
+    struct output_file *next;
+} output_file_t;
+
+/* count file buffers of size bytes, and fsync after every sync_batch
+   files (0 = never). Returns the name of the method used, or NULL on
+   failure. */
+const char *output_init(int count, size_t size, int sync_batch);
+void output_start();
+
+/* A free file buffer, sleeping until there is one: */
+output_file_t *output_get();
+/* Write out f->len bytes of f->data. f is returned to the free pool
+   when done. */
+void output_submit(output_file_t *f);
+/* Return f unused: */
+void output_abort(output_file_t *f);
+
+/* Sleep until all submitted files are written and synced: */
+void output_wait_idle();
+
+/* Reserve disk space for a file of len bytes, where supported: */
+int output_preallocate(int fd, off_t len);
+
+#endif
@@ -0,0 +1,197 @@
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pyramid.h"
+
+int pyramid_init(pyramid_t *p, int nchannels, int sample_size) {
+    static const int widths[LEVELS] = LEVEL_WIDTHS;
+    level_t *l;
+    int i;
+
+    p->nchannels = nchannels;
+    p->sample_size = sample_size;
+    p->out = (bin_t*)malloc(sizeof(bin_t) * nchannels);
+    if (!p->out)
+	return 0;
+    for (i = 0; i < LEVELS; i++) {
+	l = &p->level[i];
+	l->width = widths[i];
+	l->sweeps = 0;
+	l->min = (uint16_t*)malloc(sizeof(uint16_t) * nchannels);
+	l->max = (uint16_t*)malloc(sizeof(uint16_t) * nchannels);
+	l->sum = (double*)malloc(sizeof(double) * nchannels);
+	l->partial = (bin_t*)malloc(sizeof(bin_t) * nchannels);
+	atomic_init(&l->partial_seq, 0);
+	if (!l->min || !l->max || !l->sum || !l->partial
+	    || !sweeps_init(&l->bins, nchannels, sizeof(bin_t), LEVEL_BINS, 0))
+	    return 0;
+    }
+    return 1;
+}
+
+/* Publish the open bin of level i, and add it to the next level: */
+static void level_close(pyramid_t *p, int i) {
+    level_t *l = &p->level[i], *next = i + 1 < LEVELS ? l + 1 : NULL;
+    int64_t bin;
+    int ch;
+
+    for (ch = 0; ch < p->nchannels; ch++) {
+	p->out[ch].min = l->min[ch];
+	p->out[ch].max = l->max[ch];
+	p->out[ch].mean = l->sum[ch] / l->sweeps;
+    }
+    sweep_publish(&l->bins, (const uint8_t*)p->out,
+		  l->bin * l->width * (usec_t)1000000);
+
+    if (next) {
+	bin = l->bin * l->width / next->width;
+	if (next->sweeps && bin > next->bin)
+	    level_close(p, i + 1);
+	if (!next->sweeps) {
+	    next->bin = bin;
+	    for (ch = 0; ch < p->nchannels; ch++) {
+		next->min[ch] = l->min[ch];
+		next->max[ch] = l->max[ch];
+		next->sum[ch] = 0;
+	    }
+	}
+	for (ch = 0; ch < p->nchannels; ch++) {
+	    if (l->min[ch] < next->min[ch])
+		next->min[ch] = l->min[ch];
+	    if (l->max[ch] > next->max[ch])
+		next->max[ch] = l->max[ch];
+	    next->sum[ch] += l->sum[ch];
+	}
+	next->sweeps += l->sweeps;
+    }
+    l->sweeps = 0;
+}
+
+/* Update the partial bins from level first up. The partial bin of a
+   level merges its open bin with those of the levels below, so an open
+   bin older than the newest data, which would only be closed with the
+   bin below it, is closed now: */
+static void levels_partial(pyramid_t *p, int first) {
+    level_t *l, *below;
+    unsigned long sweeps;
+    uint64_t seq;
+    int64_t bin = 0;
+    double sum;
+    int i, j, ch;
+
+    for (j = 0; j < LEVELS && !p->level[j].sweeps; j++)
+	;
+    for (i = j + 1; i < LEVELS; i++) {
+	l = &p->level[i];
+	if (l->sweeps && p->level[j].bin * p->level[j].width / l->width
+	    > l->bin)
+	    level_close(p, i);
+    }
+
+    for (i = first; i < LEVELS; i++) {
+	l = &p->level[i];
+	sweeps = 0;
+	for (j = i; j >= 0; j--)
+	    if (p->level[j].sweeps) {
+		bin = p->level[j].bin * p->level[j].width / l->width;
+		sweeps += p->level[j].sweeps;
+	    }
+	if (!sweeps)
+	    continue;
+
+	seq = atomic_load_explicit(&l->partial_seq, memory_order_relaxed);
+	atomic_store_explicit(&l->partial_seq, seq + 1,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (ch = 0; ch < p->nchannels; ch++) {
+	    l->partial[ch].min = UINT16_MAX;
+	    l->partial[ch].max = 0;
+	    sum = 0;
+	    for (j = 0; j <= i; j++) {
+		below = &p->level[j];
+		if (!below->sweeps)
+		    continue;
+		if (below->min[ch] < l->partial[ch].min)
+		    l->partial[ch].min = below->min[ch];
+		if (below->max[ch] > l->partial[ch].max)
+		    l->partial[ch].max = below->max[ch];
+		sum += below->sum[ch];
+	    }
+	    l->partial[ch].mean = sum / sweeps;
+	}
+	l->partial_time = bin * l->width * (usec_t)1000000;
+	l->partial_sweeps = sweeps;
+	atomic_store_explicit(&l->partial_seq, seq + 2,
+			      memory_order_release);
+    }
+}
+
+/* Each sweep costs a pass over its channels at the finest level, and
+   each closed bin one at the next level, at most a tenth as often, and
+   one at each level for the partial bins: */
+void pyramid_add(pyramid_t *p, const uint8_t *samples, usec_t t) {
+    level_t *l = &p->level[0];
+    int64_t bin = t / (l->width * (usec_t)1000000);
+    unsigned v;
+    int ch;
+
+    /* a sweep that a clock correction moved back before the open bin
+       goes into it anyway: */
+    if (l->sweeps && bin > l->bin) {
+	level_close(p, 0);
+	levels_partial(p, 1);
+    }
+    if (!l->sweeps) {
+	l->bin = bin;
+	for (ch = 0; ch < p->nchannels; ch++) {
+	    l->min[ch] = UINT16_MAX;
+	    l->max[ch] = 0;
+	    l->sum[ch] = 0;
+	}
+    }
+    for (ch = 0; ch < p->nchannels; ch++) {
+	v = p->sample_size == 2 ? ((const uint16_t*)samples)[ch]
+	    : samples[ch];
+	if (v < l->min[ch])
+	    l->min[ch] = v;
+	if (v > l->max[ch])
+	    l->max[ch] = v;
+	l->sum[ch] += v;
+    }
+    l->sweeps++;
+}
+
+void pyramid_sync(pyramid_t *p) {
+    levels_partial(p, 0);
+}
+
+int pyramid_partial(level_t *l, int nchannels, bin_t *bin, usec_t *t,
+		    unsigned long *sweeps) {
+    uint64_t seq;
+
+    do {
+	seq = atomic_load_explicit(&l->partial_seq, memory_order_acquire);
+	if (!seq)
+	    return 0;
+	if (seq & 1)
+	    continue;
+	memcpy(bin, l->partial, sizeof(bin_t) * nchannels);
+	*t = l->partial_time;
+	*sweeps = l->partial_sweeps;
+	atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1)
+	     || atomic_load_explicit(&l->partial_seq, memory_order_relaxed)
+	     != seq);
+    return 1;
+}
+
+level_t *pyramid_level(pyramid_t *p, int width) {
+    int i;
+
+    for (i = 0; i < LEVELS; i++)
+	if (p->level[i].width == width)
+	    return &p->level[i];
+    return NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef CALLISTO_PYRAMID_H
+#define CALLISTO_PYRAMID_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "sweeps.h"
+
+/* The data of a device at coarser time resolutions, for plots of hours
+   or days. Each level divides time into bins of a fixed width, aligned
+   to the epoch, and keeps the minimum, maximum and mean of each channel
+   over the sweeps that start in a bin. The acquisition thread adds each
+   sweep to the open bin of the finest level; a closed bin is published
+   in the sweep ring of its level and added to the open bin of the next
+   one. The open bins are readable as partial bins, up to the latest
+   closed bin of the finest level, or all of the data when it stops. */
+
+#define LEVELS 4
+/* bin widths, in seconds, each a multiple of the one before: */
+#define LEVEL_WIDTHS { 1, 10, 60, 600 }
+/* bins kept per level, a day of the 1 minute level: */
+#define LEVEL_BINS 1440
+
+/* a channel in a bin, the sample of the ring: */
+typedef struct {
+    uint16_t min, max;
+    float mean;
+} bin_t;
+
+typedef struct {
+    int width;                /* seconds */
+    sweep_ring_t bins;        /* closed bins, by start time */
+    /* the open bin, for the acquisition thread only: */
+    int64_t bin;              /* start / width */
+    unsigned long sweeps;     /* in it, 0 if none */
+    uint16_t *min, *max;
+    double *sum;
+    /* the open bin so far, with the open bins below, for readers: */
+    atomic_ullong partial_seq;  /* odd while written, 0 if none */
+    bin_t *partial;
+    usec_t partial_time;
+    unsigned long partial_sweeps;
+} level_t;
+
+typedef struct {
+    int nchannels, sample_size;
+    level_t level[LEVELS];
+    bin_t *out;               /* a bin being published */
+} pyramid_t;
+
+int pyramid_init(pyramid_t *p, int nchannels, int sample_size);
+/* Add a sweep that starts at time t: */
+void pyramid_add(pyramid_t *p, const uint8_t *samples, usec_t t);
+/* The data has stopped, make all of the open bins readable: */
+void pyramid_sync(pyramid_t *p);
+/* Copy the partial bin of l, returns 0 if there is none: */
+int pyramid_partial(level_t *l, int nchannels, bin_t *bin, usec_t *t,
+		    unsigned long *sweeps);
+/* The level of bins width seconds wide, NULL if there is none: */
+level_t *pyramid_level(pyramid_t *p, int width);
+
+#endif
@@ -9,18 +9,65 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "log.h"
 #include "callisto.h"
+#include "serial.h"
+#include "device.h"
+#include "metrics.h"
+#include "trace.h"
 
 int serial_debug = 0;
-static int ignore_errors = 0;
-static int serial_fd = -1;
+
+/* Serial input ring buffer. Head and tail are free running, so the
+   size must be a power of two. */
+#define RXBUF_SIZE 16384
+
+/* The port of a device: */
+struct serial_port {
+    int fd;
+    int ignore_errors;
+    char rxbuf[RXBUF_SIZE];
+    unsigned rx_head, rx_tail;
+    usec_t read_time;  /* of the latest read, monotonic clock */
+    int have_icount;   /* the driver counts lost input */
+    unsigned long lost; /* input lost by the latest count */
+};
+
+/* Capture file format: the magic string, then the capture start time
+   (unix time in microseconds), then one record per read from the
+   device: the time since the previous record (monotonic clock, in
+   microseconds), the number of bytes read and the bytes. A read that
+   timed out is a record with no bytes. The numbers are unsigned LEB128
+   varints, so a record usually costs three bytes on top of the data. */
+#define CAPTURE_MAGIC "CALLCAP1"
+
+static FILE *capture = NULL;
+static usec_t capture_last;
+
+static FILE *replay = NULL;
+static double replay_speed;
+static usec_t replay_epoch;   /* unix time of the capture start */
+static usec_t replay_start;   /* monotonic time the replay started */
+static usec_t replay_clock;   /* capture time of the current record */
+static unsigned replay_left;  /* bytes of the current record not read */
 
 int init_serial(const char *devname) {
+    struct serial_port *p;
     struct termios tc;
 
-    if ((serial_fd = open(devname, O_RDWR|O_NOCTTY)) < 0) {
+    if (!(p = (struct serial_port*)calloc(1, sizeof(*p)))) {
+        fprintf(stderr, "ERROR: cannot allocate serial buffer\n");
+        return 0;
+    }
+    dev->serial = p;
+
+    if ((p->fd = open(devname, O_RDWR|O_NOCTTY)) < 0) {
         fprintf(stderr, "ERROR: cannot open serial device %s: %s\n",
                 devname, strerror(errno));
         return 0;
@@ -30,7 +77,7 @@ int init_serial(const char *devname) {
        with other callisto instances if they are started as root, for
        that use flock() below. */
 #ifdef TIOCEXCL
-    if (ioctl(serial_fd, TIOCEXCL)) {
+    if (ioctl(p->fd, TIOCEXCL)) {
         fprintf(stderr,
 		"ERROR: cannot exclusively claim serial device %s: %s\n",
                 devname, strerror(errno));
@@ -44,13 +91,13 @@ int init_serial(const char *devname) {
        that don't use locking at all... I won't bother implementing
        other locking mechanisms because there is no guarantee that
        they will work. */
-    if (flock(serial_fd, LOCK_EX|LOCK_NB)) {
+    if (flock(p->fd, LOCK_EX|LOCK_NB)) {
 	fprintf(stderr, "ERROR: cannot lock serial device %s: %s\n",
 		devname, strerror(errno));
 	return 0;
     }
 
-    if (tcgetattr(serial_fd, &tc)) {
+    if (tcgetattr(p->fd, &tc)) {
         fprintf(stderr, "ERROR: getting serial settings for %s failed: %s\n",
                 devname, strerror(errno));
         return 0;
@@ -68,54 +115,323 @@ int init_serial(const char *devname) {
     tc.c_cc[VMIN] = 0;  /* non-blocking reads */
     tc.c_cc[VTIME] = 10; /* wait at most 1s for data to read */
 
-    if (tcsetattr(serial_fd, TCSAFLUSH, &tc)) {
+    if (tcsetattr(p->fd, TCSAFLUSH, &tc)) {
         fprintf(stderr, "ERROR: changing serial settings for %s failed: %s\n",
                 devname, strerror(errno));
         return 0;
     }
 
+    /* the baseline of the lost input count, if the driver has one
+       (ptys and some USB adapters do not): */
+    p->have_icount = 1;
+    serial_lost();
+
     return 1;
 }
 
-int read_serial(char *c) {
-    ssize_t r;
-    while ((r = read(serial_fd, c, 1)) != 1) {
-	if (r == 0)
+int serial_lost() {
+#ifdef TIOCGICOUNT
+    struct serial_port *p = dev->serial;
+    struct serial_icounter_struct ic;
+    unsigned long lost, n;
+
+    if (!p->have_icount)
+	return 0;
+    if (ioctl(p->fd, TIOCGICOUNT, &ic)) {
+	p->have_icount = 0;
+	if (debug)
+	    logprintf(LOG_DEBUG, "The serial port does not count lost "
+		      "input: %s", strerror(errno));
+	return 0;
+    }
+    lost = (unsigned long)ic.overrun + ic.buf_overrun + ic.frame
+	+ ic.parity;
+    n = lost - p->lost;
+    p->lost = lost;
+    return (int)n;
+#else
+    return 0;
+#endif
+}
+
+static void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+	putc((int)(v & 0x7f) | 0x80, capture);
+	v >>= 7;
+    }
+    putc((int)v, capture);
+}
+
+static int get_varint(uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+	if ((c = getc(replay)) == EOF || shift > 63)
+	    return 0;
+	*v |= (uint64_t)(c & 0x7f) << shift;
+	shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+int capture_serial(const char *filename) {
+    if (!(capture = fopen(filename, "w"))) {
+        fprintf(stderr, "ERROR: cannot create capture file %s: %s\n",
+                filename, strerror(errno));
+        return 0;
+    }
+    setvbuf(capture, NULL, _IOFBF, 65536);
+    fputs(CAPTURE_MAGIC, capture);
+    put_varint(get_usecs());
+    capture_last = get_monotonic_usecs();
+    return 1;
+}
+
+/* Append a record of the n bytes just read at rx_head. The file is
+   flushed by the stdio buffering, and at exit. */
+static void capture_record(unsigned n) {
+    struct serial_port *p = dev->serial;
+    usec_t now = get_monotonic_usecs();
+    unsigned head = p->rx_head % RXBUF_SIZE, first = n;
+
+    put_varint(now - capture_last);
+    put_varint(n);
+    capture_last = now;
+    if (head + n > RXBUF_SIZE)
+	first = RXBUF_SIZE - head;
+    fwrite(&p->rxbuf[head], 1, first, capture);
+    fwrite(&p->rxbuf[0], 1, n - first, capture);
+    if (ferror(capture)) {
+	logprintf(LOG_ERR, "Error writing capture file, capture stopped: %s",
+		  strerror(errno));
+	fclose(capture);
+	capture = NULL;
+    }
+}
+
+int init_replay(const char *filename, double speed) {
+    struct serial_port *p;
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    uint64_t epoch;
+    uint64_t one = 1;
+
+    if (!(p = (struct serial_port*)calloc(1, sizeof(*p)))) {
+        fprintf(stderr, "ERROR: cannot allocate serial buffer\n");
+        return 0;
+    }
+    dev->serial = p;
+
+    if (!(replay = fopen(filename, "r"))) {
+        fprintf(stderr, "ERROR: cannot open capture file %s: %s\n",
+                filename, strerror(errno));
+        return 0;
+    }
+    if (fread(magic, sizeof(magic), 1, replay) != 1
+	|| memcmp(magic, CAPTURE_MAGIC, sizeof(magic))
+	|| !get_varint(&epoch)) {
+        fprintf(stderr, "ERROR: %s is not a serial capture file\n",
+		filename);
+        return 0;
+    }
+
+    /* Captured input is always there to be read, so the descriptor
+       polled for it is always readable: */
+    if ((p->fd = eventfd(0, EFD_CLOEXEC)) < 0
+	|| write(p->fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "ERROR: cannot create replay descriptor: %s\n",
+                strerror(errno));
+        return 0;
+    }
+
+    replay_speed = speed;
+    replay_epoch = epoch;
+    replay_start = get_monotonic_usecs();
+    return 1;
+}
+
+/* Read like readv() from the capture instead of the device, waiting
+   until the data is due at the replay speed. At the end of the
+   capture, the program is terminated cleanly. */
+static ssize_t replay_read(struct iovec *iov, int iovcnt) {
+    struct serial_port *p = dev->serial;
+    unsigned i, n, r = 0;
+
+    if (!replay_left) {
+	uint64_t delta, len;
+
+	if (!get_varint(&delta) || !get_varint(&len)) {
+	    if (!p->ignore_errors) {
+		logprintf(LOG_NOTICE, "End of serial capture, terminating");
+		p->ignore_errors = 1;
+		terminate(0);
+	    }
 	    return 0;
-	if (errno != EINTR) {
-	    if (ignore_errors)
-		return 0;
-	    logprintf(LOG_EMERG, "Error reading serial port: %s",
-		      strerror(errno));
-	    logprintf(LOG_EMERG, "Terminating due to I/O error");
-	    ignore_errors = 1;
-	    terminate(0);
 	}
+	replay_clock += delta;
+	if (replay_speed > 0) {
+	    usec_t due = replay_start + (usec_t)(replay_clock / replay_speed);
+	    usec_t now = get_monotonic_usecs();
+	    if (due > now)
+		microsleep(due - now);
+	}
+	replay_left = len;
     }
-    if (serial_debug) {
+
+    /* the record may not fit in the ring, the rest is read later: */
+    for (i = 0; i < (unsigned)iovcnt && replay_left; i++) {
+	n = iov[i].iov_len < replay_left ? iov[i].iov_len : replay_left;
+	if (fread(iov[i].iov_base, 1, n, replay) != n) {
+	    replay_left = 0;
+	    return r;
+	}
+	replay_left -= n;
+	r += n;
+    }
+    return r;
+}
+
+usec_t serial_time() {
+    if (replay)
+	return replay_epoch + replay_clock;
+    return get_usecs();
+}
+
+usec_t serial_read_time() {
+    return dev->serial->read_time;
+}
+
+usec_t serial_clock_offset() {
+    if (replay)
+	return replay_epoch;
+    return get_usecs() - get_monotonic_usecs();
+}
+
+/* Read as many bytes as are available (up to the free space in the
+   ring) with a single syscall. Returns the number of bytes read, 0 on
+   timeout. */
+static int fill_serial() {
+    struct serial_port *p = dev->serial;
+    struct iovec iov[2];
+    unsigned head = p->rx_head % RXBUF_SIZE;
+    unsigned space = RXBUF_SIZE - (p->rx_head - p->rx_tail);
+    int iovcnt = 1;
+    usec_t start;
+    ssize_t r;
+
+    if (!space)
+	return 0;
+
+    iov[0].iov_base = &p->rxbuf[head];
+    if (head + space > RXBUF_SIZE) {
+	iov[0].iov_len = RXBUF_SIZE - head;
+	iov[1].iov_base = &p->rxbuf[0];
+	iov[1].iov_len = space - iov[0].iov_len;
+	iovcnt = 2;
+    } else
+	iov[0].iov_len = space;
+
+    start = trace_start();
+    if (replay)
+	r = replay_read(iov, iovcnt);
+    else
+	while ((r = readv(p->fd, iov, iovcnt)) < 0) {
+	    if (errno != EINTR) {
+		if (p->ignore_errors)
+		    return 0;
+		logprintf(LOG_EMERG, "Error reading serial port: %s",
+			  strerror(errno));
+		logprintf(LOG_EMERG, "Terminating due to I/O error");
+		p->ignore_errors = 1;
+		terminate(0);
+	    }
+	}
+
+    p->read_time = replay ? replay_clock : get_monotonic_usecs();
+    if (r > 0) {
+	metric_add(METRIC_SERIAL_BYTES, r);
+	/* the data decoded from now on, numbered by the next sweep: */
+	trace_data(start, atomic_load_explicit(&dev->sweeps.published,
+					       memory_order_relaxed));
+	trace_stage(TRACE_READ, start);
+    }
+    if (capture)
+	capture_record(r);
+
+    if (serial_debug && r > 0) {
+	unsigned i;
 	if (serial_debug > 1)
 	    fputs("\033[01;34m", stderr);
-	fputc(*c == '\r' ? '\n' : *c, stderr);
+	for (i = p->rx_head; i != p->rx_head + r; i++) {
+	    char c = p->rxbuf[i % RXBUF_SIZE];
+	    fputc(c == '\r' ? '\n' : c, stderr);
+	}
 	if (serial_debug > 1)
 	    fputs("\033[0m", stderr);
     }
 
+    p->rx_head += r;
+    return r;
+}
+
+int read_serial_span(const char **span) {
+    struct serial_port *p = dev->serial;
+    unsigned tail, n;
+
+    if (p->rx_head == p->rx_tail && !fill_serial())
+	return 0;
+
+    tail = p->rx_tail % RXBUF_SIZE;
+    n = p->rx_head - p->rx_tail;
+    if (tail + n > RXBUF_SIZE)
+	n = RXBUF_SIZE - tail;
+    *span = &p->rxbuf[tail];
+    return n;
+}
+
+int get_serial_fd() {
+    return dev->serial->fd;
+}
+
+int pending_serial() {
+    return dev->serial->rx_head - dev->serial->rx_tail;
+}
+
+void consume_serial(int n) {
+    dev->serial->rx_tail += n;
+}
+
+void flush_serial() {
+    dev->serial->rx_tail = dev->serial->rx_head;
+}
+
+int read_serial(char *c) {
+    const char *span;
+
+    if (!read_serial_span(&span))
+	return 0;
+    *c = *span;
+    consume_serial(1);
     return 1;
 }
 
 int write_serial(const char *s) {
+    struct serial_port *p = dev->serial;
     ssize_t w, left = strlen(s);
     const char *ss = s;
+    /* the replayed device does not listen: */
+    if (replay)
+	left = 0;
     while (left > 0) {
-	w = write(serial_fd, s, left);
+	w = write(p->fd, s, left);
 	if (w < 0) {
 	    if (errno != EINTR) {
-		if (ignore_errors)
+		if (p->ignore_errors)
 		    return 0;
 		logprintf(LOG_EMERG, "Error writing serial port: %s",
 			  strerror(errno));
 		logprintf(LOG_EMERG, "Terminating due to I/O error");
-		ignore_errors = 1;
+		p->ignore_errors = 1;
 		terminate(0);
 	    }
 	    w = 0;
@@ -123,7 +439,8 @@ int write_serial(const char *s) {
 	left -= w;
 	s += w;
     }
-    tcdrain(serial_fd);
+    if (!replay)
+	tcdrain(p->fd);
 
     if (serial_debug) {
 	if (serial_debug > 1)
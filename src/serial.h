@@ -1,8 +1,39 @@
 #ifndef CALLISTO_SERIAL_H
 #define CALLISTO_SERIAL_H
 
+#include "util.h"
+
 int init_serial(const char *devname);
+/* Record all serial input into a capture file: */
+int capture_serial(const char *filename);
+/* Read serial input from a capture file instead of a device, at speed
+   times the captured rate (0 = as fast as possible). Output is
+   discarded. */
+int init_replay(const char *filename, double speed);
+/* Unix time of the latest serial input: now, or when replaying, the
+   time it was captured. */
+usec_t serial_time();
+/* Monotonic time of the latest read from the device, and the offset
+   from the monotonic clock to unix time. When replaying, the capture
+   clock stands in for the monotonic clock. */
+usec_t serial_read_time();
+usec_t serial_clock_offset();
 int read_serial(char *c);
+/* Get a contiguous span of buffered serial input, reading more from
+   the device if the buffer is empty. Returns the span length, or 0 on
+   timeout. The span stays valid until the next read. */
+int read_serial_span(const char **span);
+/* Mark n bytes from the start of the span as processed: */
+void consume_serial(int n);
+/* Discard all buffered serial input: */
+void flush_serial();
+/* Number of bytes of buffered serial input: */
+int pending_serial();
+/* Characters lost by the serial port (overruns, framing and parity
+   errors) since the previous call, as counted by the driver: */
+int serial_lost();
+/* The device descriptor, for polling: */
+int get_serial_fd();
 int write_serial(const char *s);
 
 extern int serial_debug;
@@ -5,213 +5,979 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #include "log.h"
 #include "callisto.h"
+#include "buffer.h"
 #include "util.h"
 #include "conf.h"
+#include "device.h"
+#include "metrics.h"
+#include "trace.h"
 
-static int listen_fd = -1;
+static int listen_fd = -1, metrics_fd = -1, epoll_fd = -1;
 
 #define MAXLINE 128
+/* Output queued for a client beyond which its commands wait until the
+   output has been written, and beyond which it is disconnected: */
+#define OUTPUT_HIGH 65536
+#define OUTPUT_MAX (1024 * 1024)
+#define MAX_EVENTS 64
 
-static void *handle_client(void *arg) {
-    int fd = (int)((long)arg);
-    int read_fd;
-    FILE *f, *read_f;
-    char buf[MAXLINE];
-
-    read_fd = dup(fd);
-    if (read_fd < 0) {
-        logprintf(LOG_ERR, "handle_client:dup() failed: %s", strerror(errno));
-        close(fd);
-        return NULL;
-    }
-
-    if ((read_f = fdopen(read_fd, "r")) == NULL) {
-        logprintf(LOG_ERR, "handle_client:fdopen() failed: %s",
-                  strerror(errno));
-        close(fd);
-        close(read_fd);
-        return NULL;
-    }
-    if ((f = fdopen(fd, "w")) == NULL) {
-        logprintf(LOG_ERR, "handle_client:fdopen() failed: %s",
-                  strerror(errno));
-        close(fd);
-        fclose(read_f);
-        return NULL;
-    }
-
-    fputs("e-Callisto for Unix " PACKAGE_VERSION "\n", f);
-    fflush(f);
-
-    while ((fgets(buf, MAXLINE, read_f)) != NULL) {
-        int l = strlen(buf);
-
-        if (l == 0) break;
-        if (buf[l-1] != '\n') {
-            logprintf(LOG_ERR, "handle_client(): Line too long");
-            fputs("ERROR line too long, closing connection\n", f);
-            fflush(f);
-            break;
-        }
-
-        /* clear LF and possible CR */
-        buf[l-1] = 0; l--;
-        if (buf[l-1] == '\r') buf[l-1] = 0;
-
-        /* convert to lowercase */
-        l--;
-        while (l >= 0) {
-            if (buf[l] >= 'A' && buf[l] <= 'Z')
-                buf[l] += ('a' - 'A');
-            l--;
-        }
-
-        /* parse commands */
-        if (!buf[0]) { /* empty command */
-            fputs("OK\n\n", f);
-            fflush(f);
-
-            
-        } else if (!strcmp(buf, "quit")) {
-            fputs("OK closing connection\n\n", f);
-            fflush(f);
-            break;
-
-
-        } else if (!strcmp(buf, "start")) {
-	    start_command = 1;
-	    logprintf(LOG_NOTICE, "Recording (re)started by command server");
-            fputs("OK starting new FITS file\n\n", f);
-            fflush(f);
-
-
-        } else if (!strcmp(buf, "stop")) {
-	    stop_command = 1;
-	    logprintf(LOG_NOTICE, "Recording stopped by command server");
-            fputs("OK stopping\n\n", f);
-            fflush(f);
-
-
-        } else if (!strcmp(buf, "overview")) {
-	    overview_command = 1;
-	    logprintf(LOG_NOTICE, "Overview started by command server");
-            fputs("OK starting spectral overview\n\n", f);
-            fflush(f);
-
-
-        } else if (!strcmp(buf, "get")) {
-	    int mybuf = active_buffer;
-	    buffer_t databuf = buffer[mybuf];
-	    int i;
-	    usec_t sweeplen = 1000000 * (usec_t)config.nchannels
-		/ (usec_t)config.samplerate;
-	    
-	    databuf.size -= databuf.size % config.nchannels;
-	    if (!databuf.size) { /* empty buffer, try the other one */
-		databuf = buffer[1-mybuf];
-		databuf.size -= databuf.size % config.nchannels;
+/* A connection. Input is collected until there is a whole command
+   line, and the responses are queued for writing as the socket
+   allows. */
+typedef struct client {
+    int fd;
+    device_t *dev;         /* selected device */
+    char in[MAXLINE];
+    int in_len;
+    char *out;
+    size_t out_pos, out_len, out_size;
+    int closing;           /* close after writing the output */
+    uint32_t events;       /* waited for */
+    int binary;            /* get sends binary frames */
+    int http;              /* on the metrics port, see http_input() */
+    int http_newlines;
+    /* live sweeps, see stream_sweeps(): */
+    device_t *stream_dev;  /* NULL if not streaming */
+    uint64_t stream_next;  /* next sweep to send */
+    unsigned long stream_dropped;
+    int stream_binary;
+    int stream_nchan, *stream_chan; /* the channels sent, from 0 */
+    struct client *stream_prev, *stream_following;
+    /* a range being sent, see client_range(): */
+    sweep_ring_t *range_ring;
+    uint64_t range_next, range_end;
+    int range_step;
+    int range_width;       /* of the bins of a summary, 0 for sweeps */
+    unsigned long range_lost;
+    /* the open bin, sent last, if range_partial: */
+    int range_partial;
+    usec_t partial_time;
+    unsigned long partial_sweeps;
+    bin_t partial[MAX_CHANNELS];
+} client_t;
+
+/* the streaming clients: */
+static client_t *streaming;
+
+/* Binary sweep frames, the numbers little-endian:
+     0  "SWEP"
+     4  uint16 number of samples
+     6  uint8 bytes per sample
+     7  uint8 0
+     8  uint64 sweep number
+    16  int64 start time of the sweep, usec since the epoch
+    24  uint32 sweeps dropped so far
+    28  uint32 0
+    32  the samples
+   and summary frames the same, but for
+     0  "SUMM"
+     6  uint8 8, bytes per channel
+    24  uint32 bin width, seconds
+    28  uint32 0, or the sweeps so far in a bin still open
+    32  per channel uint16 minimum, uint16 maximum, float32 mean */
+#define FRAME_HEADER 32
+
+static void client_write(client_t *c, const char *s, size_t n) {
+    if (c->out_len + n > c->out_size) {
+	size_t size = c->out_size ? c->out_size : 4096;
+	char *out;
+
+	/* reuse the space already written: */
+	if (c->out_pos) {
+	    memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+	    c->out_len -= c->out_pos;
+	    c->out_pos = 0;
+	}
+	while (c->out_len + n > size)
+	    size *= 2;
+	if (size > c->out_size) {
+	    if (c->out_len + n > OUTPUT_MAX
+		|| !(out = (char*)realloc(c->out, size))) {
+		logprintf(LOG_ERR, "Command server client not reading, "
+			  "closing connection");
+		c->closing = 2;
+		return;
 	    }
-	    if (databuf.size) {
-		usec_t sweep = databuf.size / config.nchannels - 1;
-		databuf.timestamp += sweep * sweeplen;
-		fprintf(f, "OK\nt=%llu.%.6llu\n",
-			databuf.timestamp/1000000, databuf.timestamp%1000000);
-		for (i = 0; i < config.nchannels; i++)
-		    fprintf(f, "ch%.3i=%.3f:%i\n", i+1, channels[i].f,
-			    databuf.data[databuf.size - config.nchannels + i]);
-		fputs("\n", f);
-	    } else
-		fputs("ERROR no data (yet)\n\n", f);
-	    fflush(f);
-
-
-	} else if (!strncmp(buf, "get", 3)
-		   || !strncmp(buf, "put", 3)
-		   || !strncmp(buf, "post", 4)
-		   || !strncmp(buf, "head", 4)
-		   || !strncmp(buf, "connect", 7)
-		   || !strncmp(buf, "trace", 5)
-		   || !strncmp(buf, "options", 7)
-		   || !strncmp(buf, "delete", 6)
-		   || strchr(buf, ':')) {
-	    fputs("ERROR No HTTP allowed\n\n", f);
-	    fflush(f);
-	    break;
+	    c->out = out;
+	    c->out_size = size;
+	}
+    }
+    memcpy(c->out + c->out_len, s, n);
+    c->out_len += n;
+}
+
+static void client_puts(client_t *c, const char *s) {
+    client_write(c, s, strlen(s));
+}
+
+static void client_put(void *c, const char *s, size_t n) {
+    client_write((client_t*)c, s, n);
+}
+
+static void client_printf(client_t *c, const char *format, ...) {
+    char line[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line))
+	n = sizeof(line) - 1;
+    if (n > 0)
+	client_write(c, line, n);
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+    while (n--) {
+	*p++ = (uint8_t)v;
+	v >>= 8;
+    }
+}
+
+/* Queue a binary frame of sweep n, of the nchan channels in chan, or
+   of the first nchan channels if chan is NULL: */
+static void client_frame(client_t *c, uint64_t n, usec_t t,
+			 const uint8_t *samples, int sample_size,
+			 const int *chan, int nchan, unsigned long dropped) {
+    uint8_t frame[FRAME_HEADER + MAX_CHANNELS * 2], *p = frame;
+    int i, ch;
+
+    memcpy(p, "SWEP", 4);
+    put_le(p + 4, nchan, 2);
+    p[6] = sample_size;
+    p[7] = 0;
+    put_le(p + 8, n, 8);
+    put_le(p + 16, (uint64_t)t, 8);
+    put_le(p + 24, dropped > UINT32_MAX ? UINT32_MAX : dropped, 4);
+    put_le(p + 28, 0, 4);
+    p += FRAME_HEADER;
+    if (sample_size == 2)
+	for (i = 0; i < nchan; i++) {
+	    ch = chan ? chan[i] : i;
+	    put_le(p, ((const uint16_t*)samples)[ch], 2);
+	    p += 2;
+	}
+    else if (chan)
+	for (i = 0; i < nchan; i++)
+	    *p++ = samples[chan[i]];
+    else {
+	memcpy(p, samples, nchan);
+	p += nchan;
+    }
+    client_write(c, (char*)frame, p - frame);
+}
+
+/* Queue a summary frame of bin n of width seconds, of nchan
+   channels, an open bin of so many sweeps if sweeps is not 0: */
+static void client_bin(client_t *c, uint64_t n, usec_t t, const bin_t *bin,
+		       int nchan, int width, unsigned long sweeps) {
+    uint8_t frame[FRAME_HEADER + MAX_CHANNELS * 8], *p = frame;
+    uint32_t mean;
+    int i;
+
+    memcpy(p, "SUMM", 4);
+    put_le(p + 4, nchan, 2);
+    p[6] = 8;
+    p[7] = 0;
+    put_le(p + 8, n, 8);
+    put_le(p + 16, (uint64_t)t, 8);
+    put_le(p + 24, width, 4);
+    put_le(p + 28, sweeps > UINT32_MAX ? UINT32_MAX : sweeps, 4);
+    p += FRAME_HEADER;
+    for (i = 0; i < nchan; i++) {
+	put_le(p, bin[i].min, 2);
+	put_le(p + 2, bin[i].max, 2);
+	memcpy(&mean, &bin[i].mean, 4);
+	put_le(p + 4, mean, 4);
+	p += 8;
+    }
+    client_write(c, (char*)frame, p - frame);
+}
+
+/* Queue a sweep in the format of the client's stream: */
+static void client_sweep(client_t *c, uint64_t n, usec_t t,
+			 const uint8_t *samples, int sample_size) {
+    char line[64 + MAX_CHANNELS * 5];
+    int i, ch, l;
+
+    if (c->stream_binary) {
+	client_frame(c, n, t, samples, sample_size, c->stream_chan,
+		     c->stream_nchan, c->stream_dropped);
+	return;
+    }
+
+    l = snprintf(line, 64, "sweep=%llu:%lld.%.6lld:%lu:",
+		 (unsigned long long)n, (long long)(t / 1000000),
+		 (long long)(t % 1000000), c->stream_dropped);
+    for (i = 0; i < c->stream_nchan; i++) {
+	unsigned v;
+	char digits[8];
+	int d = 0;
+
+	ch = c->stream_chan[i];
+	v = sample_size == 2 ? ((const uint16_t*)samples)[ch] : samples[ch];
+	do
+	    digits[d++] = '0' + v % 10;
+	while (v /= 10);
+	if (i)
+	    line[l++] = ',';
+	while (d)
+	    line[l++] = digits[--d];
+    }
+    line[l++] = '\n';
+    client_write(c, line, l);
+}
+
+/* Queue the sweeps published since the last call to a streaming
+   client. Its queue is its output, which is held to OUTPUT_HIGH:
+   sweeps that find it full, or that the ring has already overwritten,
+   are dropped and counted. */
+static void client_stream(client_t *c) {
+    sweep_ring_t *r = &c->stream_dev->sweeps;
+    uint64_t latest = atomic_load(&r->published);
+    uint8_t samples[MAX_CHANNELS * 2];
+    usec_t t;
+
+    if (latest - c->stream_next > (uint64_t)r->size) {
+	c->stream_dropped += latest - r->size - c->stream_next;
+	c->stream_next = latest - r->size;
+    }
+    for (; c->stream_next < latest; c->stream_next++)
+	if (c->out_len - c->out_pos >= OUTPUT_HIGH || c->closing
+	    || !sweep_read(r, c->stream_next, samples, &t))
+	    c->stream_dropped++;
+	else
+	    client_sweep(c, c->stream_next, t, samples, r->sample_size);
+}
+
+/* Queue the frames of the range the client asked for, as far as its
+   output takes them. A sweep or bin overwritten before its turn is
+   sent as a frame without samples, so that the number of frames is
+   still the one announced. The open bin of a summary comes last. */
+static void client_range(client_t *c) {
+    sweep_ring_t *r = c->range_ring;
+    uint8_t samples[MAX_CHANNELS * sizeof(bin_t)];
+    int nchan;
+    usec_t t;
+
+    for (; c->range_next < c->range_end
+	     && c->out_len - c->out_pos < OUTPUT_HIGH && !c->closing;
+	 c->range_next += c->range_step) {
+	nchan = r->nchannels;
+	if (!sweep_read(r, c->range_next, samples, &t)) {
+	    nchan = t = 0;
+	    c->range_lost++;
+	}
+	if (c->range_width)
+	    client_bin(c, c->range_next, t, (const bin_t*)samples, nchan,
+		       c->range_width, 0);
+	else
+	    client_frame(c, c->range_next, t, samples, r->sample_size,
+			 NULL, nchan, c->range_lost);
+    }
+    if (c->range_next < c->range_end)
+	return;
+    if (c->range_partial && !c->closing) {
+	if (c->out_len - c->out_pos >= OUTPUT_HIGH)
+	    return;
+	client_bin(c, c->range_end, c->partial_time, c->partial,
+		   r->nchannels, c->range_width, c->partial_sweeps);
+    }
+    c->range_partial = 0;
+    c->range_ring = NULL;
+}
+
+/* Start sending the sweeps, or the bins of level l if not NULL, that
+   start from t0 to before t1, in seconds, every step'th. Bins are sent
+   if they overlap the range, and the open bin if it is newer than the
+   closed ones. */
+static void range_open(client_t *c, level_t *l, double t0, double t1,
+		       int step) {
+    sweep_ring_t *r = l ? &l->bins : &dev->sweeps;
+    int width = l ? l->width : 0;
+    uint8_t latest[MAX_CHANNELS * sizeof(bin_t)];
+    uint64_t first, last, n;
+    usec_t from, t;
+
+    if (c->stream_dev) {
+	client_puts(c, "ERROR stream in progress\n\n");
+	return;
+    }
+    /* times of 0 or less are relative to the present: */
+    if (t0 <= 0 || t1 <= 0) {
+	double now = get_usecs() / 1e6;
+	if (t0 <= 0)
+	    t0 += now;
+	if (t1 <= 0)
+	    t1 += now;
+    }
+
+    from = (usec_t)(t0 * 1e6);
+    /* and the bin that t0 falls in: */
+    if (width)
+	from -= (usec_t)width * 1000000 - 1;
+    first = sweep_find(r, from);
+    last = sweep_find(r, (usec_t)(t1 * 1e6));
+    if (last < first)
+	last = first;
+    c->range_partial = l
+	&& pyramid_partial(l, r->nchannels, c->partial, &c->partial_time,
+			   &c->partial_sweeps)
+	&& c->partial_time >= from && c->partial_time < (usec_t)(t1 * 1e6)
+	&& !(sweep_latest(r, &n, latest, &t) && t >= c->partial_time);
+    c->range_ring = r;
+    c->range_width = width;
+    c->range_next = first;
+    c->range_end = last;
+    c->range_step = step;
+    c->range_lost = 0;
+    client_printf(c, "OK %llu\n\n",
+		  (unsigned long long)((last - first + step - 1) / step
+				       + c->range_partial));
+}
+
+/* The range command: */
+static void range_start(client_t *c, const char *args) {
+    double t0, t1;
+    long step = 1;
+    int n = 0, m = 0;
+
+    if (sscanf(args, "%lf %lf%n", &t0, &t1, &n) < 2
+	|| (args[n] && (sscanf(args + n, "%ld%n", &step, &m) < 1
+			|| args[n + m]))
+	|| step < 1 || step > INT32_MAX) {
+	client_printf(c, "ERROR invalid range (%s)\n\n", args);
+	return;
+    }
+    range_open(c, NULL, t0, t1, step);
+}
+
+/* The summary command: */
+static void summary_start(client_t *c, const char *args) {
+    level_t *l;
+    double t0, t1;
+    int width, n = 0;
+
+    if (sscanf(args, "%d %lf %lf%n", &width, &t0, &t1, &n) < 3
+	|| args[n]) {
+	client_printf(c, "ERROR invalid range (%s)\n\n", args);
+	return;
+    }
+    if (!(l = pyramid_level(&dev->pyramid, width))) {
+	client_printf(c, "ERROR no such level (%d)\n\n", width);
+	return;
+    }
+    range_open(c, l, t0, t1, 1);
+}
+
+/* The latency percentiles of each stage: */
+static void latency_report(client_t *c) {
+    static const double p[4] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t q[4], max, n;
+    int i;
+
+    client_printf(c, "OK\ntracing=%s\n",
+		  atomic_load(&tracing) ? "on" : "off");
+    for (i = 0; i < TRACE_STAGES; i++) {
+	n = trace_latency(i, p, 4, q, &max);
+	client_printf(c, "%s=%llu:%llu:%llu:%llu:%llu:%llu\n",
+		      trace_stage_name(i), (unsigned long long)n,
+		      (unsigned long long)q[0], (unsigned long long)q[1],
+		      (unsigned long long)q[2], (unsigned long long)q[3],
+		      (unsigned long long)max);
+    }
+    client_puts(c, "\n");
+}
+
+/* Write the trace to a file in the data directory of the selected
+   device, too big for a reply: */
+static void trace_file(client_t *c) {
+    char name[PATH_MAX], stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    FILE *f;
+    long n;
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", gmtime_r(&now, &tm));
+    snprintf(name, sizeof(name), "%s/trace_%s.json", dev->config.datadir,
+	     stamp);
+    if (!(f = fopen(name, "w"))) {
+	client_printf(c, "ERROR cannot write %s: %s\n\n", name,
+		      strerror(errno));
+	return;
+    }
+    n = trace_dump(f);
+    if (fclose(f) || n < 0) {
+	client_printf(c, "ERROR cannot write %s: %s\n\n", name,
+		      strerror(errno));
+	unlink(name);
+    } else
+	client_printf(c, "OK %ld event(s) written to %s\n\n", n, name);
+}
+
+static void stream_stop(client_t *c) {
+    if (!c->stream_dev)
+	return;
+    if (c->stream_prev)
+	c->stream_prev->stream_following = c->stream_following;
+    else
+	streaming = c->stream_following;
+    if (c->stream_following)
+	c->stream_following->stream_prev = c->stream_prev;
+    c->stream_dev = NULL;
+    free(c->stream_chan);
+    c->stream_chan = NULL;
+}
+
+/* Parse a channel list like 1-10,20 into chan, from 0. Returns the
+   number of channels, or 0 if the list is invalid. */
+static int parse_channels(const char *s, int nchannels, int *chan) {
+    long a, b;
+    char *end;
+    int n = 0;
+
+    while (1) {
+	a = b = strtol(s, &end, 10);
+	if (end == s)
+	    return 0;
+	if (*end == '-') {
+	    s = end + 1;
+	    b = strtol(s, &end, 10);
+	    if (end == s)
+		return 0;
+	}
+	if (a < 1 || b > nchannels || a > b || n + b - a + 1 > nchannels)
+	    return 0;
+	while (a <= b)
+	    chan[n++] = a++ - 1;
+	if (!*end)
+	    return n;
+	if (*end != ',')
+	    return 0;
+	s = end + 1;
+    }
+}
+
+/* Subscribe the client to the sweeps of the selected device, with the
+   arguments of the stream command: */
+static void stream_start(client_t *c, const char *args) {
+    int *chan, n, i;
+
+    if (!(chan = (int*)malloc(sizeof(int) * dev->config.nchannels))) {
+	client_puts(c, "ERROR out of memory\n\n");
+	return;
+    }
+    stream_stop(c);
+    c->stream_binary = 0;
+    if (!strncmp(args, "binary", 6) && (!args[6] || args[6] == ' ')) {
+	c->stream_binary = 1;
+	args += 6;
+	while (*args == ' ')
+	    args++;
+    }
+    if (!*args) {
+	for (n = 0; n < dev->config.nchannels; n++)
+	    chan[n] = n;
+    } else if (!(n = parse_channels(args, dev->config.nchannels, chan))) {
+	client_printf(c, "ERROR invalid channels (%s)\n\n", args);
+	free(chan);
+	return;
+    }
+
+    c->stream_dev = dev;
+    c->stream_chan = chan;
+    c->stream_nchan = n;
+    c->stream_next = atomic_load(&dev->sweeps.published);
+    c->stream_dropped = 0;
+    c->stream_prev = NULL;
+    c->stream_following = streaming;
+    if (streaming)
+	streaming->stream_prev = c;
+    streaming = c;
+
+    /* the frequencies, once: */
+    client_puts(c, "OK\n");
+    for (i = 0; i < n; i++)
+	client_printf(c, "ch%.3i=%.3f\n", chan[i] + 1,
+		      dev->channels[chan[i]].f);
+    client_puts(c, "\n");
+}
+
+/* Execute a command line, returns 0 to close the connection. */
+static int command(client_t *c, char *buf) {
+    int l = strlen(buf);
+
+    /* convert to lowercase */
+    l--;
+    while (l >= 0) {
+	if (buf[l] >= 'A' && buf[l] <= 'Z')
+	    buf[l] += ('a' - 'A');
+	l--;
+    }
+
+    /* parse commands */
+    if (!buf[0]) { /* empty command */
+	client_puts(c, "OK\n\n");
+
+
+    } else if (!strcmp(buf, "quit")) {
+	client_puts(c, "OK closing connection\n\n");
+	return 0;
+
+
+    } else if (!strcmp(buf, "start")) {
+	post_command(dev, COMMAND_START);
+	logprintf(LOG_NOTICE, "Recording (re)started by command server");
+	client_puts(c, "OK starting new FITS file\n\n");
+
+
+    } else if (!strcmp(buf, "stop")) {
+	post_command(dev, COMMAND_STOP);
+	logprintf(LOG_NOTICE, "Recording stopped by command server");
+	client_puts(c, "OK stopping\n\n");
+
+
+    } else if (!strcmp(buf, "overview")) {
+	post_command(dev, COMMAND_OVERVIEW);
+	logprintf(LOG_NOTICE, "Overview started by command server");
+	client_puts(c, "OK starting spectral overview\n\n");
+
+
+    } else if (!strcmp(buf, "device")) {
+	int i;
+
+	client_puts(c, "OK\n");
+	for (i = 0; i < ndevices; i++)
+	    client_printf(c, "dev%i=%s:%i:%s%s\n", i,
+			  devices[i].config.instrument,
+			  devices[i].config.focuscode,
+			  devices[i].config.serialport,
+			  &devices[i] == dev ? " (selected)" : "");
+	client_puts(c, "\n");
+
+
+    } else if (!strncmp(buf, "device ", 7)) {
+	char *end;
+	long i = strtol(buf + 7, &end, 10);
+
+	if (end == buf + 7 || *end || i < 0 || i >= ndevices) {
+	    client_printf(c, "ERROR no such device (%s)\n\n", buf + 7);
+	} else {
+	    dev = &devices[i];
+	    client_printf(c, "OK device %li selected\n\n", i);
+	}
+
+
+    } else if (!strcmp(buf, "mode binary") || !strcmp(buf, "mode text")) {
+	int i;
+
+	c->binary = buf[5] == 'b';
+	client_puts(c, "OK\n");
+	/* the frequencies, once for the binary replies: */
+	if (c->binary)
+	    for (i = 0; i < dev->config.nchannels; i++)
+		client_printf(c, "ch%.3i=%.3f\n", i+1, dev->channels[i].f);
+	client_puts(c, "\n");
+
 
+    } else if (!strcmp(buf, "get")) {
+	/* a copy of the latest sweep, never torn by the acquisition
+	   thread: */
+	sweep_ring_t *r = &dev->sweeps;
+	uint8_t samples[MAX_CHANNELS * 2];
+	uint64_t n;
+	usec_t t;
+	int i;
 
+	if (!sweep_latest(r, &n, samples, &t)) {
+	    client_puts(c, "ERROR no data (yet)\n\n");
+	} else if (c->binary) {
+	    client_frame(c, n, t, samples, r->sample_size, NULL,
+			 r->nchannels, 0);
 	} else {
-            fprintf(f, "ERROR unrecognized command (%s)\n\n", buf);
-            fflush(f);
+	    client_printf(c, "OK\nt=%lld.%.6lld\n",
+			  (long long)(t / 1000000), (long long)(t % 1000000));
+	    for (i = 0; i < r->nchannels; i++)
+		client_printf(c, "ch%.3i=%.3f:%u\n", i+1, dev->channels[i].f,
+			      r->sample_size == 2
+			      ? ((const uint16_t*)samples)[i] : samples[i]);
+	    client_puts(c, "\n");
 	}
-	
-        msleep(1); /* avoid hogging the cpu */	
+
+
+    } else if (!strcmp(buf, "stream off")) {
+	client_printf(c, "OK stream stopped, %lu sweep(s) dropped\n\n",
+		      c->stream_dropped);
+	stream_stop(c);
+
+
+    } else if (!strcmp(buf, "stream") || !strncmp(buf, "stream ", 7)) {
+	stream_start(c, buf[6] ? buf + 7 : "");
+
+
+    } else if (!strcmp(buf, "range") || !strncmp(buf, "range ", 6)) {
+	range_start(c, buf[5] ? buf + 6 : "");
+
+
+    } else if (!strcmp(buf, "summary") || !strncmp(buf, "summary ", 8)) {
+	summary_start(c, buf[7] ? buf + 8 : "");
+
+
+    } else if (!strcmp(buf, "metrics")) {
+	client_puts(c, "OK\n");
+	metrics_export(client_put, c);
+	client_puts(c, "\n");
+
+
+    } else if (!strcmp(buf, "latency on") || !strcmp(buf, "latency off")) {
+	atomic_store(&tracing, buf[9] == 'n');
+	logprintf(LOG_NOTICE, "Tracing %s by command server", buf + 8);
+	client_printf(c, "OK tracing %s\n\n", buf + 8);
+
+
+    } else if (!strcmp(buf, "latency")) {
+	latency_report(c);
+
+
+    } else if (!strcmp(buf, "dumptrace")) {
+	trace_file(c);
+
+
+    } else if (!strcmp(buf, "timing")) {
+	timing_t tm;
+
+	timing_read(&dev->timing_shared, &tm);
+	client_printf(c, "OK\nnominal=%d\nrate=%.4f\ndrift=%+.2f\n"
+		      "jitter=%.1f\nmax_residual=%.1f\nobservations=%lu\n"
+		      "resyncs=%lu\n\n",
+		      dev->config.samplerate, timing_rate(&tm),
+		      timing_drift(&tm), timing_jitter(&tm), tm.max_residual,
+		      tm.observations, tm.resyncs);
+
+
+    } else if (!strcmp(buf, "gaps")) {
+	gap_stats_t st;
+	gap_t gap[MAX_GAPS];
+	unsigned long lost = 0;
+	int i, n;
+
+	gaps_stats(&dev->gaps, &st);
+	n = gaps_find(&dev->gaps, 0, INT64_MAX, gap, MAX_GAPS);
+	client_printf(c, "OK\nreceived=%llu\n", (unsigned long long)
+		      (st.samples / dev->config.nchannels));
+	for (i = 0; i < GAP_CAUSES; i++) {
+	    client_printf(c, "%s=%lu:%lu\n", gap_cause(i), st.events[i],
+			  st.lost[i]);
+	    lost += st.lost[i];
+	}
+	client_printf(c, "lost=%lu\nstray=%lu\n", lost, dev->stray_bytes);
+	for (i = 0; i < n; i++)
+	    client_printf(c, "gap%d=%.3f:%.3f:%s:%lu\n", i,
+			  gap[i].start / 1e6, gap[i].end / 1e6,
+			  gap_cause(gap[i].cause), gap[i].sweeps);
+	client_puts(c, "\n");
+
+
+    } else if (!strncmp(buf, "get", 3)
+	       || !strncmp(buf, "put", 3)
+	       || !strncmp(buf, "post", 4)
+	       || !strncmp(buf, "head", 4)
+	       || !strncmp(buf, "connect", 7)
+	       || !strncmp(buf, "trace", 5)
+	       || !strncmp(buf, "options", 7)
+	       || !strncmp(buf, "delete", 6)
+	       || strchr(buf, ':')) {
+	client_puts(c, "ERROR No HTTP allowed\n\n");
+	return 0;
+
+
+    } else {
+	client_printf(c, "ERROR unrecognized command (%s)\n\n", buf);
     }
 
-    shutdown(fd, SHUT_RDWR);
-    fclose(f);
-    fclose(read_f);
-    return NULL;
+    return 1;
 }
 
-static void *server_loop(void *dummy) {
+/* Execute the whole command lines received, until the output backs
+   up: */
+static void client_commands(client_t *c) {
+    char *nl;
+    int l;
+    usec_t t;
+
+    /* commands apply to the device selected by this client: */
+    dev = c->dev;
+    while (!c->closing && c->out_len - c->out_pos < OUTPUT_HIGH) {
+	/* the frames of a range come before the next command: */
+	if (c->range_ring) {
+	    client_range(c);
+	    continue;
+	}
+	if (!(nl = (char*)memchr(c->in, '\n', c->in_len)))
+	    break;
+	*nl = 0;
+	l = nl - c->in;
+	/* clear possible CR */
+	if (l > 0 && c->in[l-1] == '\r')
+	    c->in[l-1] = 0;
+	t = get_monotonic_usecs();
+	if (!command(c, c->in) && !c->closing)
+	    c->closing = 1;
+	metric_add(METRIC_COMMANDS, 1);
+	metric_observe(HISTOGRAM_COMMAND_TIME, get_monotonic_usecs() - t);
+	l++;
+	c->in_len -= l;
+	memmove(c->in, c->in + l, c->in_len);
+    }
+    c->dev = dev;
+
+    if (!c->closing && c->in_len == MAXLINE - 1
+	&& !memchr(c->in, '\n', c->in_len)) {
+	logprintf(LOG_ERR, "Command server: line too long");
+	client_puts(c, "ERROR line too long, closing connection\n");
+	if (!c->closing)
+	    c->closing = 1;
+    }
+}
+
+static void client_close(client_t *c) {
+    metric_add(METRIC_CLIENTS, -1);
+    stream_stop(c);
+    shutdown(c->fd, SHUT_RDWR);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+/* Wait for whatever the client is ready for next: */
+static int client_wait(client_t *c) {
+    struct epoll_event ev;
+
+    /* the rest of a range is queued when the socket takes more: */
+    ev.events = (c->out_len || c->range_ring ? EPOLLOUT : 0)
+	| (c->closing || c->out_len - c->out_pos >= OUTPUT_HIGH ? 0 : EPOLLIN);
+    if (ev.events != c->events) {
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev)) {
+	    logprintf(LOG_ERR, "Command server: epoll_ctl() failed: %s",
+		      strerror(errno));
+	    return 0;
+	}
+	c->events = ev.events;
+    }
+    return 1;
+}
+
+/* Write what the socket takes, and wait for whatever the client is
+   ready for next. Returns 0 if the client has been closed. */
+static int client_flush(client_t *c) {
+    ssize_t n;
+
+    while (c->closing < 2 && c->out_pos < c->out_len) {
+	n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	if (n <= 0) {
+	    c->closing = 2;
+	    break;
+	}
+	c->out_pos += n;
+    }
+    if (c->out_pos == c->out_len)
+	c->out_pos = c->out_len = 0;
+
+    if (c->closing == 2 || (c->closing && !c->out_len)
+	|| !client_wait(c)) {
+	client_close(c);
+	return 0;
+    }
+    return 1;
+}
+
+/* A request on the metrics port: it is read up to the empty line that
+   ends its header, and whatever it asks for, answered with all metrics
+   in the Prometheus text format. */
+static void http_input(client_t *c, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+	if (c->in[i] == '\n') {
+	    if (++c->http_newlines == 2) {
+		client_puts(c, "HTTP/1.0 200 OK\r\n"
+			    "Content-Type: text/plain; version=0.0.4\r\n"
+			    "Connection: close\r\n\r\n");
+		metrics_export(client_put, c);
+		c->closing = 1;
+		return;
+	    }
+	} else if (c->in[i] != '\r')
+	    c->http_newlines = 0;
+}
+
+static void client_input(client_t *c) {
+    ssize_t n;
+
+    n = read(c->fd, c->in + c->in_len, MAXLINE - 1 - c->in_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN
+		  || errno == EWOULDBLOCK))
+	return;
+    if (n <= 0) {
+	/* closed by the client, or failed: */
+	c->closing = 2;
+	return;
+    }
+    if (c->http) {
+	http_input(c, n);
+	return;
+    }
+    c->in_len += n;
+    client_commands(c);
+}
+
+/* New connections on the listening socket fd: */
+static void accept_clients(int fd) {
+    static int errorcount = 0;
+    struct epoll_event ev;
+    client_t *c;
     int client_fd;
 
-    (void)dummy;
+    while (1) {
+	client_fd = accept(fd, NULL, NULL);
+
+	if (client_fd < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return;
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    logprintf(LOG_ERR, "accept() failed: %s", strerror(errno));
+	    errorcount++;
+	    if (errorcount > 10) { /* over ten consecutive errors */
+		logprintf(LOG_ERR, "Too many consecutive accept() errors");
+		logprintf(LOG_CRIT, "Shutting down");
+		terminate(0);
+	    }
+	    return;
+	}
+	errorcount = 0;
+
+	if (fcntl(client_fd, F_SETFL, O_NONBLOCK)
+	    || !(c = (client_t*)calloc(1, sizeof(*c)))) {
+	    char msg[] = "ERROR out of memory\n";
+	    int e;
+	    logprintf(LOG_ERR, "Cannot set up command server client: %s",
+		      strerror(errno));
+	    e = write(client_fd, msg, strlen(msg));
+	    (void)e;
+	    close(client_fd);
+	    continue;
+	}
+	c->fd = client_fd;
+	c->http = fd == metrics_fd;
+	metric_add(METRIC_CONNECTIONS, 1);
+	metric_add(METRIC_CLIENTS, 1);
+	/* commands go to the first device until another is selected: */
+	c->dev = &devices[0];
+	c->events = ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev)) {
+	    logprintf(LOG_ERR, "Command server: epoll_ctl() failed: %s",
+		      strerror(errno));
+	    client_close(c);
+	    continue;
+	}
+
+	if (!c->http)
+	    client_puts(c, "e-Callisto for Unix " PACKAGE_VERSION "\n");
+	client_flush(c);
+    }
+}
+
+/* New sweeps of device d: queue them to its streaming clients, to be
+   written when the sockets are ready. (Writing here could close a
+   client that has an event pending.) */
+static void stream_sweeps(device_t *d) {
+    uint64_t n;
+    client_t *c;
+
+    if (read(d->sweeps.event_fd, &n, sizeof(n)) < 0)
+	return;
+    for (c = streaming; c; c = c->stream_following)
+	if (c->stream_dev == d) {
+	    client_stream(c);
+	    client_wait(c);
+	}
+}
+
+/* All connections are served by one thread, which waits for them with
+   epoll. The event data is the fd of a listening socket, a device for
+   its sweep ring, otherwise the client. */
+static void *server_loop(void *dummy) {
+    struct epoll_event events[MAX_EVENTS];
+    int i, nev;
 
-    int errorcount = 0;
+    (void)dummy;
 
     while (1) {
-        struct sockaddr_in addr;
-        socklen_t addr_sz;
-        pthread_t handler_thread;
-	pthread_attr_t attr;
-
-        addr_sz = sizeof(addr);
-        client_fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_sz);
-
-        if (client_fd < 0) {
-            if (errno == EINTR) continue;
-            logprintf(LOG_ERR, "accept() failed: %s", strerror(errno));
-            errorcount++;
-            if (errorcount > 10) { /* over ten consecutive errors */
-                logprintf(LOG_ERR, "Too many consecutive accept() errors");
-                logprintf(LOG_CRIT, "Shutting down");
-                terminate(0);
-            }
-            continue;
-        }
-        errorcount = 0;
-        
-        if (pthread_attr_init(&attr) != 0
-	    || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
-	    || pthread_create(&handler_thread, &attr, handle_client,
-			      (void*)((long)client_fd)) != 0
-	    || pthread_attr_destroy(&attr) != 0) {
-            char msg[] = "ERROR start_thread()\n";
-            int e;
-            logprintf(LOG_ERR, "Thread creation failed: %s", strerror(errno));
-            e = write(client_fd, msg, strlen(msg));
-            close(client_fd);
-        }
-
-        microsleep(1); /* sleep the rest of this timeslice */
+	nev = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+	if (nev < 0) {
+	    if (errno == EINTR)
+		continue;
+	    logprintf(LOG_CRIT, "Command server: epoll_wait() failed, "
+		      "terminating: %s", strerror(errno));
+	    terminate(-1);
+	}
+
+	for (i = 0; i < nev; i++) {
+	    client_t *c = (client_t*)events[i].data.ptr;
+	    device_t *d = (device_t*)events[i].data.ptr;
+
+	    if (events[i].data.ptr == &listen_fd
+		|| events[i].data.ptr == &metrics_fd) {
+		accept_clients(*(int*)events[i].data.ptr);
+		continue;
+	    }
+	    if (d >= devices && d < devices + ndevices) {
+		stream_sweeps(d);
+		continue;
+	    }
+	    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		client_input(c);
+	    /* the written output may let waiting commands run: */
+	    if (!client_flush(c))
+		continue;
+	    if ((c->in_len || c->range_ring) && !c->closing) {
+		client_commands(c);
+		client_flush(c);
+	    }
+	}
     }
 
     return NULL;
 }
 
 
-int server_init(uint16_t port, int ipv4, int ipv6) {
+/* Listen on port, with the socket in *fd, and wait for connections on
+   it in the server thread: */
+static int listen_port(int *fd, uint16_t port, int ipv4, int ipv6) {
     struct sockaddr_storage addr;
     struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
     struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    struct epoll_event ev;
     int opt_true = 1;
     
     memset(&addr, 0, sizeof(addr));
@@ -225,11 +991,11 @@ int server_init(uint16_t port, int ipv4, int ipv6) {
 	memcpy(&addr6->sin6_addr, &in6addr_any, sizeof(in6addr_any));
     }
     
-    if ((listen_fd = socket(ipv6 ? PF_INET6 : PF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((*fd = socket(ipv6 ? PF_INET6 : PF_INET, SOCK_STREAM, 0)) == -1) {
 	fprintf(stderr, "ERROR: Cannot create socket: %s\n", strerror(errno));
 	return 0;
     }
-    if(setsockopt(listen_fd,
+    if(setsockopt(*fd,
 		  SOL_SOCKET,
 		  SO_REUSEADDR,
 		  &opt_true,
@@ -239,7 +1005,7 @@ int server_init(uint16_t port, int ipv4, int ipv6) {
 		strerror(errno));
 	return 0;
     }
-    if(!ipv4 && ipv6 && setsockopt(listen_fd,
+    if(!ipv4 && ipv6 && setsockopt(*fd,
 				   IPPROTO_IPV6,
 				   IPV6_V6ONLY,
 				   &opt_true,
@@ -249,18 +1015,57 @@ int server_init(uint16_t port, int ipv4, int ipv6) {
 		strerror(errno));
 	return 0;
     }
-    if (bind(listen_fd, (struct sockaddr *)(&addr),
+    if (bind(*fd, (struct sockaddr *)(&addr),
 	     !ipv6 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) < 0) {
 	fprintf(stderr, "ERROR: Cannot bind to port %i: %s\n",
 		port, strerror(errno));
-	return EXIT_FAILURE;
+	return 0;
     }
     
-    if (listen(listen_fd, 0) < 0) {
+    if (listen(*fd, SOMAXCONN) < 0) {
 	fprintf(stderr, "ERROR: Cannot listen(): %s\n", strerror(errno));
 	return 0;
     }
 
+    /* the server thread waits for new connections along with the
+       clients: */
+    ev.events = EPOLLIN;
+    ev.data.ptr = fd;
+    if (fcntl(*fd, F_SETFL, fcntl(*fd, F_GETFL) | O_NONBLOCK)
+	|| epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *fd, &ev)) {
+	fprintf(stderr, "ERROR: Cannot set up the command server: %s\n",
+		strerror(errno));
+	return 0;
+    }
+    return 1;
+}
+
+int server_init(uint16_t port, uint16_t metrics_port, int ipv4, int ipv6) {
+    struct epoll_event ev;
+    int i;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	fprintf(stderr, "ERROR: Cannot set up the command server: %s\n",
+		strerror(errno));
+	return 0;
+    }
+    if ((port && !listen_port(&listen_fd, port, ipv4, ipv6))
+	|| (metrics_port
+	    && !listen_port(&metrics_fd, metrics_port, ipv4, ipv6)))
+	return 0;
+
+    /* the server thread also waits for the sweeps of the devices: */
+    ev.events = EPOLLIN;
+    for (i = 0; i < ndevices; i++) {
+	ev.data.ptr = &devices[i];
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, devices[i].sweeps.event_fd,
+		      &ev)) {
+	    fprintf(stderr, "ERROR: Cannot set up the command server: %s\n",
+		    strerror(errno));
+	    return 0;
+	}
+    }
+
     return 1;
 }
 
@@ -3,7 +3,9 @@
 
 #include <inttypes.h>
 
-int server_init(uint16_t port, int ipv4, int ipv6);
+/* The command server on port, and the metrics on metrics_port, each
+   unless 0: */
+int server_init(uint16_t port, uint16_t metrics_port, int ipv4, int ipv6);
 void server_start();
 
 #endif
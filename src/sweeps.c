@@ -0,0 +1,107 @@
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "sweeps.h"
+
+int sweeps_init(sweep_ring_t *r, int nchannels, int sample_size, int size,
+		int notify) {
+    int i;
+
+    if (size < SWEEP_RING)
+	size = SWEEP_RING;
+    r->nchannels = nchannels;
+    r->sample_size = sample_size;
+    r->size = size;
+    r->data = (uint8_t*)malloc((size_t)size * nchannels * sample_size);
+    r->time = (usec_t*)malloc(sizeof(usec_t) * size);
+    r->seq = (atomic_ullong*)malloc(sizeof(atomic_ullong) * size);
+    if (!r->data || !r->time || !r->seq)
+	return 0;
+    for (i = 0; i < size; i++)
+	atomic_init(&r->seq[i], 0);
+    atomic_init(&r->published, 0);
+    r->event_fd = -1;
+    if (notify)
+	r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return !notify || r->event_fd >= 0;
+}
+
+void sweep_publish(sweep_ring_t *r, const uint8_t *samples, usec_t t) {
+    uint64_t n = atomic_load_explicit(&r->published, memory_order_relaxed);
+    size_t len = (size_t)r->nchannels * r->sample_size;
+    int slot = n % r->size;
+    uint64_t one = 1;
+    ssize_t e;
+
+    atomic_store_explicit(&r->seq[slot], 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(r->data + (size_t)slot * len, samples, len);
+    r->time[slot] = t;
+    atomic_store_explicit(&r->seq[slot], n + 1, memory_order_release);
+    atomic_store_explicit(&r->published, n + 1, memory_order_release);
+
+    /* this only fails if the counter is full, when the reader is due
+       anyway: */
+    if (r->event_fd >= 0) {
+	e = write(r->event_fd, &one, sizeof(one));
+	(void)e;
+    }
+}
+
+int sweep_read(sweep_ring_t *r, uint64_t n, uint8_t *samples, usec_t *t) {
+    size_t len = (size_t)r->nchannels * r->sample_size;
+    int slot = n % r->size;
+
+    if (atomic_load_explicit(&r->seq[slot], memory_order_acquire) != n + 1)
+	return 0;
+    memcpy(samples, r->data + (size_t)slot * len, len);
+    *t = r->time[slot];
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->seq[slot], memory_order_relaxed) == n + 1;
+}
+
+int sweep_latest(sweep_ring_t *r, uint64_t *n, uint8_t *samples,
+		 usec_t *t) {
+    uint64_t published;
+
+    do {
+	published = atomic_load_explicit(&r->published, memory_order_acquire);
+	if (!published)
+	    return 0;
+	*n = published - 1;
+    } while (!sweep_read(r, *n, samples, t));
+    return 1;
+}
+
+/* Read the start time of sweep n. Returns 0 if it is not in the
+   ring. */
+static int sweep_time(sweep_ring_t *r, uint64_t n, usec_t *t) {
+    int slot = n % r->size;
+
+    if (atomic_load_explicit(&r->seq[slot], memory_order_acquire) != n + 1)
+	return 0;
+    *t = r->time[slot];
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->seq[slot], memory_order_relaxed) == n + 1;
+}
+
+uint64_t sweep_find(sweep_ring_t *r, usec_t t) {
+    uint64_t hi = atomic_load_explicit(&r->published, memory_order_acquire);
+    uint64_t lo = hi > (uint64_t)r->size ? hi - r->size : 0, mid;
+    usec_t tm;
+
+    /* a sweep overwritten meanwhile was among the oldest, before t as
+       far as the reader is concerned: */
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (!sweep_time(r, mid, &tm) || tm < t)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
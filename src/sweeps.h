@@ -0,0 +1,56 @@
+#ifndef CALLISTO_SWEEPS_H
+#define CALLISTO_SWEEPS_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+/* The latest completed sweeps of a device, for any number of readers
+   that follow the data live or look back over the last minutes. The
+   acquisition thread writes each sweep into the next slot of the ring
+   and publishes it, readers copy the sweeps they want at their own
+   pace. Each slot is guarded by its
+   sequence number like a seqlock: a reader that finds the number
+   changed after copying has been overtaken, and the sweep is lost to
+   it. Neither side ever waits for the other. */
+
+/* the least number of slots: */
+#define SWEEP_RING 64
+/* the most seconds of sweeps kept, to bound the memory used: */
+#define MAX_HISTORY 3600
+
+typedef struct {
+    int nchannels, sample_size;
+    int size;                   /* slots */
+    uint8_t *data;              /* size sweeps */
+    usec_t *time;               /* start of each sweep */
+    /* number + 1 of the sweep in each slot, 0 while it is written: */
+    atomic_ullong *seq;
+    atomic_ullong published;    /* sweeps published */
+    int event_fd;               /* an eventfd, signalled on publishing,
+				   or -1 */
+} sweep_ring_t;
+
+/* A ring of size sweeps, at least SWEEP_RING, with an event_fd if
+   notify is set: */
+int sweeps_init(sweep_ring_t *r, int nchannels, int sample_size, int size,
+		int notify);
+/* Publish the next sweep, starting at time t: */
+void sweep_publish(sweep_ring_t *r, const uint8_t *samples, usec_t t);
+/* Copy sweep n (from 0) into samples. Returns 0 if the sweep is not
+   in the ring, or no longer. */
+int sweep_read(sweep_ring_t *r, uint64_t n, uint8_t *samples, usec_t *t);
+/* Copy the latest sweep, and set n to its number. The slot of the
+   latest sweep is overwritten only size sweeps later, so this
+   never waits for the producer, and retries only if the producer went
+   around the whole ring during the copy. Returns 0 if no sweep has
+   been published. */
+int sweep_latest(sweep_ring_t *r, uint64_t *n, uint8_t *samples,
+		 usec_t *t);
+/* The number of the first sweep in the ring that starts at or after
+   t, or the number of sweeps published if there is none. This is a
+   binary search, the sweeps being in order of time. */
+uint64_t sweep_find(sweep_ring_t *r, usec_t t);
+
+#endif
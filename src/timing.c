@@ -0,0 +1,116 @@
+#include <config.h>
+
+#include <math.h>
+
+#include "timing.h"
+
+/* Filter gains per observation. There is an observation for each read
+   from the device, many per second, so the gains are small: the phase
+   settles in some hundred reads and the period in some thousand.
+   beta = alpha^2 / (2 - alpha) is the Benedict-Bordner choice. */
+#define ALPHA 0.01
+#define BETA (ALPHA * ALPHA / (2 - ALPHA))
+/* weight of an observation in the jitter average: */
+#define JITTER_WEIGHT 0.01
+/* A larger residual means that samples were lost or the clock was
+   disturbed, and the filter starts again from the observation: */
+#define RESYNC_LIMIT 250000.0
+/* nor is the period allowed to stray further from the nominal: */
+#define PERIOD_LIMIT 0.01
+
+void timing_init(timing_t *tm, int samplerate) {
+    tm->nominal = tm->period = 1e6 / samplerate;
+    tm->jitter2 = tm->max_residual = 0;
+    tm->observations = tm->resyncs = 0;
+    timing_reset(tm);
+}
+
+void timing_reset(timing_t *tm) {
+    tm->valid = 0;
+    tm->samples = tm->n = 0;
+    tm->t = 0;
+}
+
+static void resync(timing_t *tm, usec_t t) {
+    tm->t = t;
+    tm->n = tm->samples;
+    tm->valid = 1;
+}
+
+double timing_observe(timing_t *tm, usec_t t, usec_t offset) {
+    uint64_t dn = tm->samples - tm->n;
+    double pred, r;
+
+    tm->offset = offset;
+    if (!tm->valid) {
+	if (tm->samples)
+	    resync(tm, t);
+	return 0;
+    }
+    if (!dn)
+	return 0;
+
+    pred = tm->t + dn * tm->period;
+    r = t - pred;
+    if (fabs(r) > RESYNC_LIMIT) {
+	tm->resyncs++;
+	resync(tm, t);
+	return r;
+    }
+
+    tm->t = pred + ALPHA * r;
+    tm->period += BETA * r / dn;
+    if (fabs(tm->period - tm->nominal) > PERIOD_LIMIT * tm->nominal) {
+	tm->period = tm->nominal;
+	tm->resyncs++;
+	resync(tm, t);
+	return 0;
+    }
+    tm->n = tm->samples;
+
+    tm->observations++;
+    tm->jitter2 += (r * r - tm->jitter2) * JITTER_WEIGHT;
+    if (fabs(r) > tm->max_residual)
+	tm->max_residual = fabs(r);
+    return 0;
+}
+
+void timing_publish(timing_shared_t *s, const timing_t *tm) {
+    unsigned seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->tm = *tm;
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+void timing_read(timing_shared_t *s, timing_t *tm) {
+    unsigned seq;
+
+    do {
+	while ((seq = atomic_load_explicit(&s->seq, memory_order_acquire))
+	       & 1)
+	    ;
+	*tm = s->tm;
+	atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq);
+}
+
+usec_t timing_sample_time(const timing_t *tm, uint64_t i, usec_t now) {
+    if (!tm->valid)
+	return now + (usec_t)llround(((double)i - tm->samples) * tm->nominal);
+    return tm->offset
+	+ (usec_t)llround(tm->t + ((double)i + 1 - tm->n) * tm->period);
+}
+
+double timing_rate(const timing_t *tm) {
+    return 1e6 / tm->period;
+}
+
+double timing_drift(const timing_t *tm) {
+    return (tm->nominal / tm->period - 1) * 1e6;
+}
+
+double timing_jitter(const timing_t *tm) {
+    return sqrt(tm->jitter2);
+}
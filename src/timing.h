@@ -0,0 +1,63 @@
+#ifndef CALLISTO_TIMING_H
+#define CALLISTO_TIMING_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+/* Sample clock of a device. Callisto sends samples at its own clock
+   rate, and they arrive in bursts with the USB latency on top. After
+   each read from the device, the number of samples received so far
+   and the arrival time are fed to an alpha-beta filter, which tracks
+   the arrival time of a sample and the sample period. The time of any
+   sample follows from these, without the jitter of the individual
+   reads. The filter runs on the monotonic clock, so that steps of the
+   system clock do not disturb it, and times are converted to unix time
+   with the current offset between the two clocks. */
+
+typedef struct {
+    double nominal;     /* configured sample period, usec */
+    double period;      /* estimated sample period, usec */
+    double t;           /* estimated arrival time of sample n-1 */
+    uint64_t n;         /* samples at the last observation */
+    uint64_t samples;   /* samples received since the reset */
+    usec_t offset;      /* unix time - monotonic time */
+    int valid;          /* t and n are set */
+    /* statistics: */
+    double jitter2;     /* mean squared residual, usec^2 */
+    double max_residual;
+    unsigned long observations;
+    unsigned long resyncs;
+} timing_t;
+
+/* A copy of the state for other threads, published by the acquisition
+   thread at sweep boundaries. The sequence number works like a
+   seqlock: it is odd while the copy is written, and a reader that
+   finds it changed after copying tries again. */
+typedef struct {
+    atomic_uint seq;
+    timing_t tm;
+} timing_shared_t;
+
+void timing_init(timing_t *tm, int samplerate);
+/* The sample stream starts again, keep the period: */
+void timing_reset(timing_t *tm);
+/* tm->samples samples have arrived by the monotonic time t. Returns
+   how much later they arrived than expected, if so late that the
+   filter started again, else 0. */
+double timing_observe(timing_t *tm, usec_t t, usec_t offset);
+/* Unix time of sample i since the reset. Until there is an estimate,
+   the next sample is taken to be at time now. */
+usec_t timing_sample_time(const timing_t *tm, uint64_t i, usec_t now);
+
+void timing_publish(timing_shared_t *s, const timing_t *tm);
+/* Copy the latest state published: */
+void timing_read(timing_shared_t *s, timing_t *tm);
+
+/* Statistics: */
+double timing_rate(const timing_t *tm);     /* samples / sec */
+double timing_drift(const timing_t *tm);    /* ppm from the nominal */
+double timing_jitter(const timing_t *tm);   /* rms, usec */
+
+#endif
@@ -0,0 +1,239 @@
+#include <config.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define CACHE_LINE 64
+
+/* events kept per thread: */
+#define TRACE_EVENTS 4096
+
+/* Latencies are counted in buckets a sixteenth of a power of two
+   wide, so each one is known to within about 6%, up to 2^40 usec: */
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define MAX_BITS 40
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB)
+
+atomic_int tracing = 0;
+
+static const char *stage_names[TRACE_STAGES] = {
+    "read", "decode", "publish", "handoff", "transpose", "write", "close"
+};
+
+typedef struct {
+    atomic_ullong seq;   /* n + 1 when event n is in the slot */
+    usec_t start, end, origin;
+    uint64_t id;
+    int stage;
+} event_t;
+
+/* the events and latencies of a thread: */
+typedef struct block {
+    struct block *next;
+    int index;
+    char name[32];
+    atomic_ullong written;
+    event_t event[TRACE_EVENTS];
+    atomic_ullong count[TRACE_STAGES][BUCKETS];
+    atomic_ullong max[TRACE_STAGES];
+} block_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static block_t *blocks = NULL;
+static int nblocks = 0;
+static __thread block_t *own = NULL;
+static __thread char own_name[32];
+static __thread usec_t own_origin = 0;
+static __thread uint64_t own_id = 0;
+
+/* The block of this thread, allocated when it first traces a stage,
+   NULL if there is no memory for it: */
+static block_t *own_block() {
+    size_t size = (sizeof(block_t) + CACHE_LINE - 1) / CACHE_LINE
+	* CACHE_LINE;
+    block_t *b;
+
+    if (own)
+	return own;
+    if (posix_memalign((void**)&b, CACHE_LINE, size))
+	return NULL;
+    memset(b, 0, size);
+    pthread_mutex_lock(&lock);
+    b->index = ++nblocks;
+    if (own_name[0])
+	strcpy(b->name, own_name);
+    else
+	snprintf(b->name, sizeof(b->name), "thread %d", b->index);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&lock);
+    return own = b;
+}
+
+void trace_thread(const char *name) {
+    snprintf(own_name, sizeof(own_name), "%s", name);
+}
+
+void trace_data(usec_t origin, uint64_t id) {
+    own_origin = origin;
+    own_id = id;
+}
+
+usec_t trace_origin() {
+    return own_origin;
+}
+
+uint64_t trace_id() {
+    return own_id;
+}
+
+static int bucket(uint64_t v) {
+    int m = SUB_BITS;
+
+    if (v < SUB)
+	return (int)v;
+    while (m < MAX_BITS && v >> (m + 1))
+	m++;
+    if (m == MAX_BITS)
+	return BUCKETS - 1;
+    return (m - SUB_BITS + 1) * SUB + (int)(v >> (m - SUB_BITS)) - SUB;
+}
+
+/* the highest latency counted in bucket i: */
+static uint64_t bucket_top(int i) {
+    int m = i / SUB + SUB_BITS - 1;
+
+    if (i < SUB)
+	return i;
+    return ((uint64_t)(i % SUB + SUB + 1) << (m - SUB_BITS)) - 1;
+}
+
+/* Only the thread writes to its block: */
+static void add(atomic_ullong *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed)
+			  + n, memory_order_relaxed);
+}
+
+void trace_stage(int stage, usec_t start) {
+    block_t *b;
+    event_t *e;
+    usec_t end;
+    uint64_t n, v;
+
+    if (!start || !(b = own_block()))
+	return;
+    end = get_monotonic_usecs();
+
+    n = atomic_load_explicit(&b->written, memory_order_relaxed);
+    e = &b->event[n % TRACE_EVENTS];
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->start = start;
+    e->end = end;
+    e->origin = own_origin;
+    e->id = own_id;
+    e->stage = stage;
+    atomic_store_explicit(&e->seq, n + 1, memory_order_release);
+    atomic_store_explicit(&b->written, n + 1, memory_order_release);
+
+    if (own_origin) {
+	v = end > own_origin ? end - own_origin : 0;
+	add(&b->count[stage][bucket(v)], 1);
+	if (v > atomic_load_explicit(&b->max[stage], memory_order_relaxed))
+	    atomic_store_explicit(&b->max[stage], v, memory_order_relaxed);
+    }
+}
+
+uint64_t trace_latency(int stage, const double *p, int n, uint64_t *q,
+		       uint64_t *max) {
+    uint64_t count[BUCKETS], total = 0, sum, rank, m;
+    const block_t *b;
+    int i, j;
+
+    memset(count, 0, sizeof(count));
+    *max = 0;
+    pthread_mutex_lock(&lock);
+    for (b = blocks; b; b = b->next) {
+	for (i = 0; i < BUCKETS; i++)
+	    count[i] += atomic_load_explicit(&b->count[stage][i],
+					     memory_order_relaxed);
+	m = atomic_load_explicit(&b->max[stage], memory_order_relaxed);
+	if (m > *max)
+	    *max = m;
+    }
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < BUCKETS; i++)
+	total += count[i];
+
+    /* the bucket of the latency at rank p of the total: */
+    for (j = 0; j < n; j++) {
+	rank = (uint64_t)(p[j] * total + 0.5);
+	if (rank < 1)
+	    rank = 1;
+	for (i = 0, sum = count[0]; sum < rank && i < BUCKETS - 1; )
+	    sum += count[++i];
+	q[j] = bucket_top(i) < *max ? bucket_top(i) : *max;
+    }
+    return total;
+}
+
+const char *trace_stage_name(int stage) {
+    return stage_names[stage];
+}
+
+/* Copy event n of b, returns 0 if it has been overwritten: */
+static int event_read(const block_t *b, uint64_t n, event_t *out) {
+    const event_t *e = &b->event[n % TRACE_EVENTS];
+
+    if (atomic_load_explicit(&e->seq, memory_order_acquire) != n + 1)
+	return 0;
+    out->start = e->start;
+    out->end = e->end;
+    out->origin = e->origin;
+    out->id = e->id;
+    out->stage = e->stage;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&e->seq, memory_order_relaxed) == n + 1;
+}
+
+long trace_dump(FILE *f) {
+    const block_t *b;
+    const char *sep = "";
+    event_t e;
+    uint64_t i, written;
+    long events = 0;
+    int pid = getpid();
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+    pthread_mutex_lock(&lock);
+    for (b = blocks; b; b = b->next) {
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep, pid, b->index,
+		b->name);
+	sep = ",";
+	written = atomic_load_explicit(&b->written, memory_order_acquire);
+	i = written > TRACE_EVENTS ? written - TRACE_EVENTS : 0;
+	for (; i < written; i++) {
+	    if (!event_read(b, i, &e))
+		continue;
+	    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"callisto\",\"ph\":\"X\","
+		    "\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+		    "\"args\":{\"id\":%llu", stage_names[e.stage], pid,
+		    b->index, (long long)e.start,
+		    (long long)(e.end - e.start), (unsigned long long)e.id);
+	    if (e.origin)
+		fprintf(f, ",\"latency\":%lld",
+			(long long)(e.end - e.origin));
+	    fputs("}}", f);
+	    events++;
+	}
+    }
+    pthread_mutex_unlock(&lock);
+    fputs("\n]}\n", f);
+    return ferror(f) ? -1 : events;
+}
@@ -0,0 +1,59 @@
+#ifndef CALLISTO_TRACE_H
+#define CALLISTO_TRACE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "util.h"
+
+/* Optional tracing of the data on its way from the serial port to the
+   command server and to the FITS files. Each stage a thread runs is
+   recorded, when tracing is on, in a ring of the latest events of the
+   thread and in a histogram per stage of the time since the data was
+   read from the serial port. The rings and histograms are per thread,
+   written by their thread only and read without stopping it. */
+
+/* the stages, in the order the data goes through them: */
+enum {
+    TRACE_READ,      /* serial port read */
+    TRACE_DECODE,    /* hexdata() */
+    TRACE_PUBLISH,   /* a sweep made available to the command server */
+    TRACE_HANDOFF,   /* a buffer from queueing to a FITS writer */
+    TRACE_TRANSPOSE,
+    TRACE_WRITE,     /* a file or stream part written or submitted */
+    TRACE_CLOSE,     /* a file complete under its real name */
+    TRACE_STAGES
+};
+
+extern atomic_int tracing;
+
+/* The start of a stage, 0 if tracing is off: */
+static inline usec_t trace_start() {
+    return atomic_load_explicit(&tracing, memory_order_relaxed)
+	? get_monotonic_usecs() : 0;
+}
+
+/* The calling thread's name in the trace: */
+void trace_thread(const char *name);
+/* The data the calling thread works on from now: read at origin
+   (monotonic clock, 0 if unknown) and numbered id, a sweep or buffer
+   number: */
+void trace_data(usec_t origin, uint64_t id);
+usec_t trace_origin();
+uint64_t trace_id();
+/* A stage of the current data from start (from trace_start(), nothing
+   is recorded if 0) to now: */
+void trace_stage(int stage, usec_t start);
+
+/* The latency percentiles of a stage, in usec, for q of each of the
+   n fractions in p. Returns the number of latencies counted. */
+uint64_t trace_latency(int stage, const double *p, int n, uint64_t *q,
+		       uint64_t *max);
+const char *trace_stage_name(int stage);
+
+/* Write the events in the rings as Chrome trace event JSON. Returns the
+   number of events written, -1 on error. */
+long trace_dump(FILE *f);
+
+#endif
@@ -0,0 +1,467 @@
+#include <config.h>
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "transpose.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSPOSE_X86 1
+#include <immintrin.h>
+#define TARGET(t) __attribute__((target(t)))
+#else
+#define TRANSPOSE_X86 0
+#endif
+
+/* kernel-check.c builds the NEON kernels elsewhere too, with a model
+   of the intrinsics: */
+#ifndef TRANSPOSE_NEON
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define TRANSPOSE_NEON 1
+#else
+#define TRANSPOSE_NEON 0
+#endif
+#endif
+#if TRANSPOSE_NEON && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* The vector kernels work on tiles of 16 sweeps by 16 (or 32)
+   channels. Each tile reads 16 short runs of the sweeps and writes 16
+   short runs of image rows, all of which stay in the cache while the
+   next tiles along the sweeps are done. */
+#define TILE 16
+
+/* Copy sweeps x0..x1-1, channels c0..c1-1 a sample at a time. The
+   8 and 16-bit versions are the same apart from the sample type. */
+#define BLOCK_SCALAR(name, type)					\
+static inline void name(const type *src, int w, int h, type *dst,	\
+			int x0, int x1, int c0, int c1,			\
+			unsigned *min, unsigned *max) {			\
+    int x, c;								\
+									\
+    for (x = x0; x < x1; x++) {						\
+	const type *s = src + (size_t)x*h;				\
+	for (c = c0; c < c1; c++) {					\
+	    unsigned v = s[c];						\
+	    dst[(size_t)(h-1-c)*w + x] = v;				\
+	    if (v < *min)						\
+		*min = v;						\
+	    if (v > *max)						\
+		*max = v;						\
+	}								\
+    }									\
+}
+BLOCK_SCALAR(block_scalar, uint8_t)
+BLOCK_SCALAR(block16_scalar, uint16_t)
+
+void transpose_flip_scalar(const uint8_t *src, int w, int h, uint8_t *dst,
+			   uint8_t *min, uint8_t *max) {
+    unsigned mn = 255, mx = 0;
+
+    block_scalar(src, w, h, dst, 0, w, 0, h, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+void transpose16_flip_scalar(const uint16_t *src, int w, int h,
+			     uint16_t *dst, uint16_t *min, uint16_t *max) {
+    unsigned mn = 0xffff, mx = 0;
+
+    block16_scalar(src, w, h, dst, 0, w, 0, h, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+/* What is left over from the whole tiles (sweeps below tw, channels
+   below th): */
+static inline void edges_scalar(const uint8_t *src, int w, int h,
+				uint8_t *dst, int tw, int th,
+				unsigned *min, unsigned *max) {
+    block_scalar(src, w, h, dst, 0, tw, th, h, min, max);
+    block_scalar(src, w, h, dst, tw, w, 0, h, min, max);
+}
+static inline void edges16_scalar(const uint16_t *src, int w, int h,
+				  uint16_t *dst, int tw, int th,
+				  unsigned *min, unsigned *max) {
+    block16_scalar(src, w, h, dst, 0, tw, th, h, min, max);
+    block16_scalar(src, w, h, dst, tw, w, 0, h, min, max);
+}
+
+/* The tiles are transposed in registers with four rounds of
+   interleaving rows i and i+8. Each round rotates the 8 bits of the
+   (row, column) index of a byte left by one, so four rounds swap the
+   row and column. Row i of the result is then channel c0+i, which is
+   image row h-1-c0-i.
+
+   16-bit samples go the same way in tiles of 8 by 8 (TILE16), with
+   three rounds of interleaving rows i and i+4. The samples have at
+   most 10 bits, so the signed 16-bit min/max of SSE2 work for them. */
+#define TILE16 8
+
+
+#if TRANSPOSE_X86
+
+static inline TARGET("sse2") void round_sse2(__m128i *r) {
+    __m128i t[16];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	t[2*i] = _mm_unpacklo_epi8(r[i], r[i+8]);
+	t[2*i+1] = _mm_unpackhi_epi8(r[i], r[i+8]);
+    }
+    for (i = 0; i < 16; i++)
+	r[i] = t[i];
+}
+
+static inline TARGET("sse2") void tile_sse2(const uint8_t *src, int w, int h,
+					    uint8_t *dst, int x0, int c0,
+					    __m128i *min, __m128i *max) {
+    __m128i r[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	r[i] = _mm_loadu_si128((const __m128i *)(src + (size_t)(x0+i)*h + c0));
+	*min = _mm_min_epu8(*min, r[i]);
+	*max = _mm_max_epu8(*max, r[i]);
+    }
+    for (i = 0; i < 4; i++)
+	round_sse2(r);
+    for (i = 0; i < 16; i++)
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-i)*w + x0), r[i]);
+}
+
+/* Reduce the 16 bytes to their minimum or maximum: */
+static inline TARGET("sse2") unsigned hmin_sse2(__m128i v) {
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xff;
+}
+static inline TARGET("sse2") unsigned hmax_sse2(__m128i v) {
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xff;
+}
+
+static TARGET("sse2") void transpose_flip_sse2(const uint8_t *src, int w,
+					       int h, uint8_t *dst,
+					       uint8_t *min, uint8_t *max) {
+    __m128i vmin = _mm_set1_epi8(-1), vmax = _mm_setzero_si128();
+    int tw = w & ~(TILE-1), th = h & ~(TILE-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE)
+	for (c = 0; c < th; c += TILE)
+	    tile_sse2(src, w, h, dst, x, c, &vmin, &vmax);
+    mn = hmin_sse2(vmin);
+    mx = hmax_sse2(vmax);
+    edges_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+
+/* The AVX2 unpacks work within 128-bit lanes, so the same rounds
+   transpose two tiles side by side: 16 sweeps by 32 channels. */
+static inline TARGET("avx2") void round_avx2(__m256i *r) {
+    __m256i t[16];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	t[2*i] = _mm256_unpacklo_epi8(r[i], r[i+8]);
+	t[2*i+1] = _mm256_unpackhi_epi8(r[i], r[i+8]);
+    }
+    for (i = 0; i < 16; i++)
+	r[i] = t[i];
+}
+
+static inline TARGET("avx2") void tile_avx2(const uint8_t *src, int w, int h,
+					    uint8_t *dst, int x0, int c0,
+					    __m256i *min, __m256i *max) {
+    __m256i r[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	r[i] = _mm256_loadu_si256((const __m256i *)(src + (size_t)(x0+i)*h
+						    + c0));
+	*min = _mm256_min_epu8(*min, r[i]);
+	*max = _mm256_max_epu8(*max, r[i]);
+    }
+    for (i = 0; i < 4; i++)
+	round_avx2(r);
+    for (i = 0; i < 16; i++) {
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-i)*w + x0),
+			 _mm256_castsi256_si128(r[i]));
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-16-i)*w + x0),
+			 _mm256_extracti128_si256(r[i], 1));
+    }
+}
+
+static TARGET("avx2") void transpose_flip_avx2(const uint8_t *src, int w,
+					       int h, uint8_t *dst,
+					       uint8_t *min, uint8_t *max) {
+    __m256i vmin = _mm256_set1_epi8(-1), vmax = _mm256_setzero_si256();
+    __m128i min128, max128;
+    int tw = w & ~(TILE-1), th = h & ~(TILE-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE) {
+	for (c = 0; c + 2*TILE <= th; c += 2*TILE)
+	    tile_avx2(src, w, h, dst, x, c, &vmin, &vmax);
+	if (c < th) {
+	    min128 = _mm256_castsi256_si128(vmin);
+	    max128 = _mm256_castsi256_si128(vmax);
+	    tile_sse2(src, w, h, dst, x, c, &min128, &max128);
+	    vmin = _mm256_inserti128_si256(vmin, min128, 0);
+	    vmax = _mm256_inserti128_si256(vmax, max128, 0);
+	}
+    }
+    mn = hmin_sse2(_mm_min_epu8(_mm256_castsi256_si128(vmin),
+				_mm256_extracti128_si256(vmin, 1)));
+    mx = hmax_sse2(_mm_max_epu8(_mm256_castsi256_si128(vmax),
+				_mm256_extracti128_si256(vmax, 1)));
+    edges_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+
+static inline TARGET("sse2") void tile16_sse2(const uint16_t *src, int w,
+					      int h, uint16_t *dst,
+					      int x0, int c0,
+					      __m128i *min, __m128i *max) {
+    __m128i r[8], t[8];
+    int i, j;
+
+    for (i = 0; i < 8; i++) {
+	r[i] = _mm_loadu_si128((const __m128i *)(src + (size_t)(x0+i)*h + c0));
+	*min = _mm_min_epi16(*min, r[i]);
+	*max = _mm_max_epi16(*max, r[i]);
+    }
+    for (j = 0; j < 3; j++) {
+	for (i = 0; i < 4; i++) {
+	    t[2*i] = _mm_unpacklo_epi16(r[i], r[i+4]);
+	    t[2*i+1] = _mm_unpackhi_epi16(r[i], r[i+4]);
+	}
+	for (i = 0; i < 8; i++)
+	    r[i] = t[i];
+    }
+    for (i = 0; i < 8; i++)
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-i)*w + x0), r[i]);
+}
+
+static inline TARGET("sse2") unsigned hmin16_sse2(__m128i v) {
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 2));
+    return _mm_cvtsi128_si32(v) & 0xffff;
+}
+static inline TARGET("sse2") unsigned hmax16_sse2(__m128i v) {
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 2));
+    return _mm_cvtsi128_si32(v) & 0xffff;
+}
+
+static TARGET("sse2") void transpose16_flip_sse2(const uint16_t *src, int w,
+						 int h, uint16_t *dst,
+						 uint16_t *min, uint16_t *max) {
+    __m128i vmin = _mm_set1_epi16(0x7fff), vmax = _mm_setzero_si128();
+    int tw = w & ~(TILE16-1), th = h & ~(TILE16-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE16)
+	for (c = 0; c < th; c += TILE16)
+	    tile16_sse2(src, w, h, dst, x, c, &vmin, &vmax);
+    mn = hmin16_sse2(vmin);
+    mx = hmax16_sse2(vmax);
+    edges16_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+
+/* Two 8 by 8 tiles side by side: 8 sweeps by 16 channels. */
+static inline TARGET("avx2") void tile16_avx2(const uint16_t *src, int w,
+					      int h, uint16_t *dst,
+					      int x0, int c0,
+					      __m256i *min, __m256i *max) {
+    __m256i r[8], t[8];
+    int i, j;
+
+    for (i = 0; i < 8; i++) {
+	r[i] = _mm256_loadu_si256((const __m256i *)(src + (size_t)(x0+i)*h
+						    + c0));
+	*min = _mm256_min_epi16(*min, r[i]);
+	*max = _mm256_max_epi16(*max, r[i]);
+    }
+    for (j = 0; j < 3; j++) {
+	for (i = 0; i < 4; i++) {
+	    t[2*i] = _mm256_unpacklo_epi16(r[i], r[i+4]);
+	    t[2*i+1] = _mm256_unpackhi_epi16(r[i], r[i+4]);
+	}
+	for (i = 0; i < 8; i++)
+	    r[i] = t[i];
+    }
+    for (i = 0; i < 8; i++) {
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-i)*w + x0),
+			 _mm256_castsi256_si128(r[i]));
+	_mm_storeu_si128((__m128i *)(dst + (size_t)(h-1-c0-8-i)*w + x0),
+			 _mm256_extracti128_si256(r[i], 1));
+    }
+}
+
+static TARGET("avx2") void transpose16_flip_avx2(const uint16_t *src, int w,
+						 int h, uint16_t *dst,
+						 uint16_t *min, uint16_t *max) {
+    __m256i vmin = _mm256_set1_epi16(0x7fff), vmax = _mm256_setzero_si256();
+    __m128i min128, max128;
+    int tw = w & ~(TILE16-1), th = h & ~(TILE16-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE16) {
+	for (c = 0; c + 2*TILE16 <= th; c += 2*TILE16)
+	    tile16_avx2(src, w, h, dst, x, c, &vmin, &vmax);
+	if (c < th) {
+	    min128 = _mm256_castsi256_si128(vmin);
+	    max128 = _mm256_castsi256_si128(vmax);
+	    tile16_sse2(src, w, h, dst, x, c, &min128, &max128);
+	    vmin = _mm256_inserti128_si256(vmin, min128, 0);
+	    vmax = _mm256_inserti128_si256(vmax, max128, 0);
+	}
+    }
+    mn = hmin16_sse2(_mm_min_epi16(_mm256_castsi256_si128(vmin),
+				   _mm256_extracti128_si256(vmin, 1)));
+    mx = hmax16_sse2(_mm_max_epi16(_mm256_castsi256_si128(vmax),
+				   _mm256_extracti128_si256(vmax, 1)));
+    edges16_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+#endif /* TRANSPOSE_X86 */
+
+
+#if TRANSPOSE_NEON
+
+static inline void round_neon(uint8x16_t *r) {
+    uint8x16_t t[16];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	uint8x16x2_t z = vzipq_u8(r[i], r[i+8]);
+	t[2*i] = z.val[0];
+	t[2*i+1] = z.val[1];
+    }
+    for (i = 0; i < 16; i++)
+	r[i] = t[i];
+}
+
+static inline void tile_neon(const uint8_t *src, int w, int h,
+			     uint8_t *dst, int x0, int c0,
+			     uint8x16_t *min, uint8x16_t *max) {
+    uint8x16_t r[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	r[i] = vld1q_u8(src + (size_t)(x0+i)*h + c0);
+	*min = vminq_u8(*min, r[i]);
+	*max = vmaxq_u8(*max, r[i]);
+    }
+    for (i = 0; i < 4; i++)
+	round_neon(r);
+    for (i = 0; i < 16; i++)
+	vst1q_u8(dst + (size_t)(h-1-c0-i)*w + x0, r[i]);
+}
+
+static void transpose_flip_neon(const uint8_t *src, int w, int h,
+				uint8_t *dst, uint8_t *min, uint8_t *max) {
+    uint8x16_t vmin = vdupq_n_u8(255), vmax = vdupq_n_u8(0);
+    int tw = w & ~(TILE-1), th = h & ~(TILE-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE)
+	for (c = 0; c < th; c += TILE)
+	    tile_neon(src, w, h, dst, x, c, &vmin, &vmax);
+    mn = vminvq_u8(vmin);
+    mx = vmaxvq_u8(vmax);
+    edges_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+
+static inline void tile16_neon(const uint16_t *src, int w, int h,
+			       uint16_t *dst, int x0, int c0,
+			       uint16x8_t *min, uint16x8_t *max) {
+    uint16x8_t r[8], t[8];
+    int i, j;
+
+    for (i = 0; i < 8; i++) {
+	r[i] = vld1q_u16(src + (size_t)(x0+i)*h + c0);
+	*min = vminq_u16(*min, r[i]);
+	*max = vmaxq_u16(*max, r[i]);
+    }
+    for (j = 0; j < 3; j++) {
+	for (i = 0; i < 4; i++) {
+	    uint16x8x2_t z = vzipq_u16(r[i], r[i+4]);
+	    t[2*i] = z.val[0];
+	    t[2*i+1] = z.val[1];
+	}
+	for (i = 0; i < 8; i++)
+	    r[i] = t[i];
+    }
+    for (i = 0; i < 8; i++)
+	vst1q_u16(dst + (size_t)(h-1-c0-i)*w + x0, r[i]);
+}
+
+static void transpose16_flip_neon(const uint16_t *src, int w, int h,
+				  uint16_t *dst, uint16_t *min,
+				  uint16_t *max) {
+    uint16x8_t vmin = vdupq_n_u16(0xffff), vmax = vdupq_n_u16(0);
+    int tw = w & ~(TILE16-1), th = h & ~(TILE16-1), x, c;
+    unsigned mn, mx;
+
+    for (x = 0; x < tw; x += TILE16)
+	for (c = 0; c < th; c += TILE16)
+	    tile16_neon(src, w, h, dst, x, c, &vmin, &vmax);
+    mn = vminvq_u16(vmin);
+    mx = vmaxvq_u16(vmax);
+    edges16_scalar(src, w, h, dst, tw, th, &mn, &mx);
+    *min = mn;
+    *max = mx;
+}
+
+#endif /* TRANSPOSE_NEON */
+
+
+transpose_t transpose_flip = transpose_flip_scalar;
+transpose16_t transpose16_flip = transpose16_flip_scalar;
+
+const char *transpose_init() {
+#if TRANSPOSE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	transpose_flip = transpose_flip_avx2;
+	transpose16_flip = transpose16_flip_avx2;
+	return "AVX2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+	transpose_flip = transpose_flip_sse2;
+	transpose16_flip = transpose16_flip_sse2;
+	return "SSE2";
+    }
+#endif
+#if TRANSPOSE_NEON
+    transpose_flip = transpose_flip_neon;
+    transpose16_flip = transpose16_flip_neon;
+    return "NEON";
+#endif
+    transpose_flip = transpose_flip_scalar;
+    transpose16_flip = transpose16_flip_scalar;
+    return "scalar";
+}
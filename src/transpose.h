@@ -0,0 +1,28 @@
+#ifndef CALLISTO_TRANSPOSE_H
+#define CALLISTO_TRANSPOSE_H
+
+#include <inttypes.h>
+
+/* Assemble the FITS image from w sweeps of h samples: the image is
+   the transpose of the sweeps with the rows in reverse order, i.e.
+   dst[y*w + x] = src[x*h + h-1-y]. The minimum and maximum sample are
+   found in the same pass. */
+typedef void (*transpose_t)(const uint8_t *src, int w, int h, uint8_t *dst,
+			    uint8_t *min, uint8_t *max);
+extern transpose_t transpose_flip;
+
+/* The same for 16-bit samples: */
+typedef void (*transpose16_t)(const uint16_t *src, int w, int h,
+			      uint16_t *dst, uint16_t *min, uint16_t *max);
+extern transpose16_t transpose16_flip;
+
+/* The plain loops that the others are checked against: */
+void transpose_flip_scalar(const uint8_t *src, int w, int h, uint8_t *dst,
+			   uint8_t *min, uint8_t *max);
+void transpose16_flip_scalar(const uint16_t *src, int w, int h,
+			     uint16_t *dst, uint16_t *min, uint16_t *max);
+
+/* Select the implementation for the CPU. Returns its name. */
+const char *transpose_init();
+
+#endif
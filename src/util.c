@@ -17,6 +17,12 @@ usec_t get_usecs() {
     return 1000000LL*(usec_t)tv.tv_sec + (usec_t)tv.tv_usec;
 }
 
+usec_t get_monotonic_usecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000LL*(usec_t)ts.tv_sec + (usec_t)(ts.tv_nsec / 1000);
+}
+
 void nsleep(uint64_t nsecs) {
     struct timespec ts;
     ts.tv_sec = nsecs / 1000000000LL;
@@ -13,6 +13,9 @@ typedef int64_t usec_t;
 /* Get current unix time in microseconds */
 usec_t get_usecs();
 
+/* Get monotonic clock time in microseconds, for measuring intervals */
+usec_t get_monotonic_usecs();
+
 /* Wrapper to nanosleep(2) that handles EINTR */
 void nsleep(uint64_t nsecs);
 #define msleep(x) nsleep((uint64_t)(x)*1000000LL)